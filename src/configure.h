@@ -25,4 +25,40 @@
 #define ENABLE_STATUS
 #endif
 
+#if !defined(ENABLE_EVENT_REARM) && !defined(DISABLE_EVENT_REARM)
+#define ENABLE_EVENT_REARM
+#endif
+
+// reads pick their buffer from a provided buffer ring, so several can be in
+// flight without sharing one. the ring buffers are not registered: a read is
+// a plain READ with buffer select, the registered read buffer and READ_FIXED
+// are only used with -DDISABLE_READ_BUF_RING
+#if !defined(ENABLE_READ_BUF_RING) && !defined(DISABLE_READ_BUF_RING)
+#define ENABLE_READ_BUF_RING
+#endif
+
+// submission polled by a kernel thread, opt-in with -DENABLE_SQPOLL
+// #define ENABLE_SQPOLL
+
+// writer job writes the log filled by appender threads, opt-in with -DENABLE_WAL
+// #define ENABLE_WAL
+
+// cell_ptr slots carry a key prefix searched before the cells, -DDISABLE_KEY_PREFIX for offset only slots
+#if !defined(ENABLE_KEY_PREFIX) && !defined(DISABLE_KEY_PREFIX)
+#define ENABLE_KEY_PREFIX
+#endif
+
+// prefixes of the last slots of a search compared with avx2 when the cpu has it, -DDISABLE_SIMD_SEARCH for the scalar loop
+#if !defined(ENABLE_SIMD_SEARCH) && !defined(DISABLE_SIMD_SEARCH)
+#define ENABLE_SIMD_SEARCH
+#endif
+
+#if !defined(ENABLE_FIXED_FILES) && !defined(DISABLE_FIXED_FILES)
+#define ENABLE_FIXED_FILES
+#endif
+
+#if !defined(ENABLE_FIXED_BUFFERS) && !defined(DISABLE_FIXED_BUFFERS)
+#define ENABLE_FIXED_BUFFERS
+#endif
+
 #endif
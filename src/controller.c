@@ -0,0 +1,142 @@
+#include "utils.h"
+#include "controller.h"
+
+static enum controller_decision controller_heuristic(struct controller *ctl, __u32 inflight)
+{
+    if (inflight <= INFLIGHT_LOW_RANGE && ctl->depth < ctl->max_depth)
+    {
+        if (inflight == 0 && ctl->depth > 0)
+            ctl->depth *= 2;
+        else
+            ctl->depth += max(1, ctl->depth * BATCH_INCREMENT_PERCENT / 100);
+        return CONTROLLER_INCREASE;
+    }
+    else if (ctl->depth > 0 && inflight >= INFLIGHT_HIGH_RANGE)
+    {
+        ctl->depth -= max(1, ctl->depth * BATCH_INCREMENT_PERCENT / 100);
+        return CONTROLLER_DECREASE;
+    }
+
+    return CONTROLLER_HOLD;
+}
+
+static enum controller_decision controller_grow(struct controller *ctl)
+{
+    if (ctl->slow_start)
+        ctl->depth *= 2;
+    else
+        ctl->depth += CONTROLLER_AIMD_INCREASE;
+    return CONTROLLER_INCREASE;
+}
+
+static enum controller_decision controller_aimd(struct controller *ctl, __u32 inflight)
+{
+    // nothing completed: grow only if the queue is drained, otherwise wait
+    if (!ctl->latency.total)
+        return inflight == 0 ? controller_grow(ctl) : CONTROLLER_HOLD;
+
+    ctl->observed_us = histogram_value_at(&ctl->latency, 99.0);
+
+    if (ctl->observed_us > ctl->target_us)
+    {
+        ctl->slow_start = 0;
+        ctl->depth = ctl->depth * CONTROLLER_AIMD_DECREASE_PERCENT / 100;
+        return CONTROLLER_DECREASE;
+    }
+
+    return controller_grow(ctl);
+}
+
+static enum controller_decision controller_gradient(struct controller *ctl, __u32 inflight)
+{
+    if (!ctl->latency.total)
+    {
+        if (inflight)
+            return CONTROLLER_HOLD;
+        ctl->depth++;
+        ctl->smoothed_depth = ctl->depth;
+        return CONTROLLER_INCREASE;
+    }
+
+    __u64 p50 = histogram_value_at(&ctl->latency, 50.0);
+    ctl->observed_us = histogram_value_at(&ctl->latency, 99.0);
+
+    if (!ctl->min_latency_us || p50 < ctl->min_latency_us)
+        ctl->min_latency_us = max(1, p50);
+
+    // once the device is saturated more depth only adds queueing delay,
+    // the latency growth over the no-load latency pushes the depth back
+    double gradient = (double)ctl->min_latency_us * CONTROLLER_GRADIENT_TOLERANCE / max(1, p50);
+    if (ctl->target_us && ctl->observed_us > ctl->target_us)
+        gradient = min(gradient, (double)ctl->target_us / ctl->observed_us);
+    gradient = max(0.5, min(1.0, gradient));
+
+    // headroom to keep probing for throughput, ~log2(depth)
+    __u32 headroom = 64 - __builtin_clzll((__u64)ctl->depth | 1);
+    double next = ctl->depth * gradient + headroom;
+    ctl->smoothed_depth = ctl->smoothed_depth * (1 - CONTROLLER_GRADIENT_SMOOTHING) + next * CONTROLLER_GRADIENT_SMOOTHING;
+
+    __u32 prev = ctl->depth;
+    ctl->depth = (__u32)(ctl->smoothed_depth + 0.5);
+
+    if (ctl->depth > prev)
+        return CONTROLLER_INCREASE;
+    if (ctl->depth < prev)
+        return CONTROLLER_DECREASE;
+    return CONTROLLER_HOLD;
+}
+
+static const controller_update_fn controller_updates[] = {
+    [CONTROLLER_HEURISTIC] = controller_heuristic,
+    [CONTROLLER_AIMD] = controller_aimd,
+    [CONTROLLER_GRADIENT] = controller_gradient,
+};
+
+static const char *controller_names[] = {
+    [CONTROLLER_HEURISTIC] = "heuristic",
+    [CONTROLLER_AIMD] = "aimd",
+    [CONTROLLER_GRADIENT] = "gradient",
+};
+
+const char *controller_name(enum controller_kind kind)
+{
+    ASSERT(kind < ARRAY_LEN(controller_names));
+    return controller_names[kind];
+}
+
+void controller_init(struct controller *ctl, enum controller_kind kind, __u32 max_depth, __u64 target_us)
+{
+    ASSERT(kind < ARRAY_LEN(controller_updates));
+
+    histogram_reset(&ctl->latency);
+    ctl->update = controller_updates[kind];
+    ctl->kind = kind;
+    ctl->target_us = target_us;
+    // the heuristic starts from an empty batch like it always did
+    ctl->min_depth = kind == CONTROLLER_HEURISTIC ? 0 : 1;
+    ctl->max_depth = max_depth;
+    ctl->depth = ctl->min_depth;
+    ctl->smoothed_depth = ctl->depth;
+    ctl->slow_start = 1;
+    ctl->decision = CONTROLLER_HOLD;
+    ctl->observed_us = 0;
+    ctl->decisions = 0;
+    ctl->min_latency_us = 0;
+}
+
+void controller_record(struct controller *ctl, __u64 latency_us)
+{
+    histogram_record(&ctl->latency, latency_us);
+}
+
+__u32 controller_update(struct controller *ctl, __u32 inflight)
+{
+    ctl->decision = ctl->update(ctl, inflight);
+    ctl->depth = max(ctl->min_depth, min(ctl->max_depth, ctl->depth));
+    ctl->smoothed_depth = max((double)ctl->min_depth, min((double)ctl->max_depth, ctl->smoothed_depth));
+    ctl->decisions++;
+
+    histogram_reset(&ctl->latency);
+
+    return ctl->depth;
+}
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "histogram.h"
+
+__u32 histogram_bucket_idx(__u64 val)
+{
+    if (val < HISTOGRAM_SUB_COUNT)
+        return val;
+
+    __u32 msb = 63 - __builtin_clzll(val);
+    if (msb >= HISTOGRAM_MAX_BITS)
+        return HISTOGRAM_BUCKETS - 1;
+
+    // bits right below the leading one select the sub bucket
+    __u32 sub = (val >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1);
+    return HISTOGRAM_SUB_COUNT + (msb - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_COUNT + sub;
+}
+
+__u64 histogram_bucket_value(__u32 idx)
+{
+    if (idx < HISTOGRAM_SUB_COUNT)
+        return idx;
+
+    __u32 msb = (idx - HISTOGRAM_SUB_COUNT) / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS;
+    __u64 sub = (idx - HISTOGRAM_SUB_COUNT) % HISTOGRAM_SUB_COUNT;
+    __u64 width = (__u64)1 << (msb - HISTOGRAM_SUB_BITS);
+
+    // highest value that falls in the bucket
+    return ((__u64)1 << msb) + sub * width + width - 1;
+}
+
+void histogram_reset(struct histogram *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+void histogram_record(struct histogram *histogram, __u64 val)
+{
+    histogram->counts[histogram_bucket_idx(val)]++;
+    histogram->total++;
+    if (val > histogram->max)
+        histogram->max = val;
+}
+
+void histogram_merge(struct histogram *dst, struct histogram *src)
+{
+    for (__u32 i = 0; i < HISTOGRAM_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->max = max(dst->max, src->max);
+}
+
+__u64 histogram_value_at(struct histogram *histogram, double percentile)
+{
+    if (!histogram->total)
+        return 0;
+
+    __u64 target = (__u64)(percentile / 100.0 * histogram->total + 0.5);
+    target = min(max(target, (__u64)1), histogram->total);
+
+    __u64 seen = 0;
+    for (__u32 i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= target)
+            return min(histogram_bucket_value(i), histogram->max);
+    }
+
+    return histogram->max;
+}
+
+void histogram_percentiles(struct histogram *histogram, struct histogram_percentiles *out)
+{
+    out->p50 = histogram_value_at(histogram, 50.0);
+    out->p90 = histogram_value_at(histogram, 90.0);
+    out->p99 = histogram_value_at(histogram, 99.0);
+    out->p999 = histogram_value_at(histogram, 99.9);
+    out->max = histogram->max;
+}
+
+void histogram_window_init(struct histogram_window *window, __u32 len)
+{
+    window->len = len;
+    window->idx = 0;
+    histogram_reset(&window->acc);
+    window->slots = calloc(len, sizeof(struct histogram));
+    ASSERT(window->slots);
+}
+
+void histogram_window_record(struct histogram_window *window, __u64 val)
+{
+    histogram_record(&window->slots[window->idx % window->len], val);
+    histogram_record(&window->acc, val);
+}
+
+void histogram_window_move(struct histogram_window *window)
+{
+    // same sliding semantic of stats_bucket_move: drop the oldest slot and reuse it
+    unsigned int next_idx = (++window->idx) % window->len;
+    struct histogram *next = &window->slots[next_idx];
+
+    for (__u32 i = 0; i < HISTOGRAM_BUCKETS; i++)
+        window->acc.counts[i] -= next->counts[i];
+    window->acc.total -= next->total;
+    histogram_reset(next);
+
+    window->acc.max = 0;
+    for (__u32 i = 0; i < window->len; i++)
+        window->acc.max = max(window->acc.max, window->slots[i].max);
+}
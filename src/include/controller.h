@@ -0,0 +1,64 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include <linux/types.h>
+#include "histogram.h"
+
+// heuristic: grow while inflight is low, shrink while it is high
+#define BATCH_INCREMENT_PERCENT (1)
+#define INFLIGHT_LOW_RANGE (8)
+#define INFLIGHT_HIGH_RANGE (32)
+
+// aimd: double until the first breach, then add a constant and cut on breach
+#define CONTROLLER_AIMD_INCREASE (4)
+#define CONTROLLER_AIMD_DECREASE_PERCENT (75)
+
+// gradient: latency may grow up to tolerance times the no-load latency
+// (lowest p50 seen) before the depth shrinks
+#define CONTROLLER_GRADIENT_TOLERANCE (1.5)
+#define CONTROLLER_GRADIENT_SMOOTHING (0.2)
+
+enum controller_kind
+{
+    CONTROLLER_HEURISTIC,
+    CONTROLLER_AIMD,
+    CONTROLLER_GRADIENT,
+};
+
+enum controller_decision
+{
+    CONTROLLER_HOLD,
+    CONTROLLER_INCREASE,
+    CONTROLLER_DECREASE,
+};
+
+struct controller;
+
+typedef enum controller_decision (*controller_update_fn)(struct controller *ctl, __u32 inflight);
+
+struct controller
+{
+    controller_update_fn update;
+    // completions since the last decision
+    struct histogram latency;
+    __u64 target_us;
+    __u32 depth;
+    __u32 min_depth;
+    __u32 max_depth;
+    __u8 kind;
+    __u8 slow_start;
+    // last decision, sampled by the tracing job
+    __u8 decision;
+    __u64 observed_us;
+    __u64 decisions;
+    // gradient state
+    __u64 min_latency_us;
+    double smoothed_depth;
+};
+
+void controller_init(struct controller *ctl, enum controller_kind kind, __u32 max_depth, __u64 target_us);
+void controller_record(struct controller *ctl, __u64 latency_us);
+__u32 controller_update(struct controller *ctl, __u32 inflight);
+const char *controller_name(enum controller_kind kind);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <linux/types.h>
+
+// values below HISTOGRAM_SUB_COUNT are exact, above that every power of two
+// range is split in HISTOGRAM_SUB_COUNT buckets (~3% relative error)
+#define HISTOGRAM_SUB_BITS (5)
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS (32)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_COUNT + (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_COUNT)
+
+struct histogram
+{
+    __u64 counts[HISTOGRAM_BUCKETS];
+    __u64 total;
+    __u64 max;
+};
+
+struct histogram_window
+{
+    struct histogram *slots;
+    struct histogram acc;
+    __u32 len;
+    __u32 idx;
+};
+
+struct histogram_percentiles
+{
+    __u64 p50;
+    __u64 p90;
+    __u64 p99;
+    __u64 p999;
+    __u64 max;
+};
+
+void histogram_reset(struct histogram *histogram);
+void histogram_record(struct histogram *histogram, __u64 val);
+void histogram_merge(struct histogram *dst, struct histogram *src);
+__u64 histogram_value_at(struct histogram *histogram, double percentile);
+void histogram_percentiles(struct histogram *histogram, struct histogram_percentiles *out);
+__u32 histogram_bucket_idx(__u64 val);
+__u64 histogram_bucket_value(__u32 idx);
+
+void histogram_window_init(struct histogram_window *window, __u32 len);
+void histogram_window_record(struct histogram_window *window, __u64 val);
+void histogram_window_move(struct histogram_window *window);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <linux/types.h>
+
+struct pool_item
+{
+    struct pool_item *next;
+};
+
+struct pool
+{
+    void *buf;
+    struct pool_item *free_list;
+    __u32 item_size;
+    __u32 len;
+    __u32 used;
+    __u32 high_water;
+    __u64 exhausted;
+};
+
+void pool_init(struct pool *pool, __u32 item_size, __u32 len);
+void *pool_get(struct pool *pool);
+void pool_put(struct pool *pool, void *item);
+__u32 pool_free_count(struct pool *pool);
+int pool_is_empty(struct pool *pool);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include <linux/types.h>
+#include <pthread.h>
+#include <liburing.h>
+#include "scheduler.h"
+#include "tree/btree.h"
+
+// log pages per read, each thread keeps RECOVERY_READ_DEPTH reads in flight
+#ifndef RECOVERY_READ_PAGES
+#define RECOVERY_READ_PAGES (16)
+#endif
+#ifndef RECOVERY_READ_DEPTH
+#define RECOVERY_READ_DEPTH (4)
+#endif
+#define RECOVERY_CHUNK_PAGES (RECOVERY_READ_PAGES * RECOVERY_READ_DEPTH)
+// tree pages cached during replay, split between the partitions
+#ifndef RECOVERY_TREE_BYTES
+#define RECOVERY_TREE_BYTES (BYTE_MB(512))
+#endif
+
+struct recovery_thread;
+
+struct recovery_read
+{
+    struct op inner;
+    struct recovery_thread *thread;
+    int res;
+};
+
+// one chunk of the log of a shard, read while the previous one is replayed
+struct recovery_chunk
+{
+    void *buf;
+    struct recovery_read reads[RECOVERY_READ_DEPTH];
+    __u32 pages;
+    __u64 first_page;
+    // valid pages, the log ends at the first page that does not check out
+    __u32 valid;
+};
+
+struct recovery_thread
+{
+    struct recovery *recovery;
+    pthread_t thread;
+    __u32 idx;
+    struct io_uring ring;
+    __u32 inflight;
+
+    // scan of the shard log
+    __u64 page_start;
+    __u64 page_end;
+    __u64 next_page;
+    __u64 epoch;
+    __u8 ended;
+    struct recovery_chunk chunks[2];
+
+    // replay of the key range partition
+    int tree_fd;
+    struct buffer_pool pool;
+    struct btree btree;
+
+    __u64 pages;
+    __u64 records;
+    __u64 replayed;
+    int err;
+};
+
+struct recovery
+{
+    // db file holding the logs, shard i is [shard_start[i], shard_start[i + 1])
+    int fd;
+    __u64 *shard_start;
+    __u32 threads_len;
+    // partition i of the tree is stored in "<tree_path>.<i>"
+    const char *tree_path;
+    // cpu of every thread, NULL leaves them unpinned
+    int *cpus;
+
+    pthread_barrier_t barrier;
+    struct recovery_thread *threads;
+
+    __u64 pages;
+    __u64 records;
+    __u64 replayed;
+    double elapsed_s;
+};
+
+int recovery_run(struct recovery *recovery);
+
+__u32 recovery_partition(__u8 *key, __u32 key_size, __u32 partitions);
+
+#endif
@@ -3,6 +3,9 @@
 
 #include <liburing.h>
 #include "cbuf.h"
+#include "pool.h"
+#include "histogram.h"
+#include "controller.h"
 #include "utils.h"
 
 #define ENTRIES (1 << 14)
@@ -14,11 +17,87 @@
 #define BACKGROUND_TRACING_MS (TIME_MS(10))
 #define BACKGROUND_FLUSH_MS (TIME_MS(100))
 #define SPEEDTEST_RANGE_MS (TIME_MS(1500))
-#define BATCH_INCREMENT_PERCENT (1)
-#define INFLIGHT_LOW_RANGE (8)
-#define INFLIGHT_HIGH_RANGE (32)
+// queue depth controllers, see controller.h
+#ifndef WRITE_CONTROLLER
+#define WRITE_CONTROLLER (CONTROLLER_AIMD)
+#endif
+#ifndef READ_CONTROLLER
+#define READ_CONTROLLER (CONTROLLER_AIMD)
+#endif
+// p99 latency the controllers steer to, 0 lets the gradient controller
+// settle on the throughput plateau alone
+#ifndef WRITE_TARGET_P99_US
+#define WRITE_TARGET_P99_US (1000)
+#endif
+#ifndef READ_TARGET_P99_US
+#define READ_TARGET_P99_US (1000)
+#endif
 #define TRACING_BUF_LEN (64)
+// sqes left for job timeouts and fsyncs when filling the queue with page ops
+#define SQE_RESERVED (16)
+// 0 to run one scheduler thread per allowed cpu
+#ifndef SCHEDULER_THREADS
+#define SCHEDULER_THREADS (0)
+#endif
+#define MAX_SCHEDULER_THREADS (64)
+// with ENABLE_SQPOLL the poller of thread i is pinned to the allowed cpu
+// threads + i + SQ_THREAD_CPU_OFFSET, it sleeps after SQ_THREAD_IDLE_MS idle
+#ifndef SQ_THREAD_CPU_OFFSET
+#define SQ_THREAD_CPU_OFFSET (0)
+#endif
+#ifndef SQ_THREAD_IDLE_MS
+#define SQ_THREAD_IDLE_MS (100)
+#endif
+// write ops are held until the next fsync, read ops only until completion
+#define PAGE_WRITE_POOL_LEN (ENTRIES << 2)
+#define PAGE_READ_POOL_LEN (ENTRIES)
 #define BYTES_TO_WRITE (BYTE_GB(2))
+// with ENABLE_WAL every scheduler thread log is filled by WAL_APPENDERS
+// threads, each with up to WAL_APPENDER_INFLIGHT records waiting for a sync,
+// records are tree inserts of a WAL_KEY_SIZE key replayed on the next start
+#ifndef WAL_APPENDERS
+#define WAL_APPENDERS (4)
+#endif
+#ifndef WAL_RECORD_SIZE
+#define WAL_RECORD_SIZE (240)
+#endif
+#define WAL_APPENDER_INFLIGHT (256)
+#define WAL_KEY_SIZE (16)
+
+// how written pages become durable:
+// FSYNC/FDATASYNC: the flusher syncs the file every BACKGROUND_FLUSH_MS
+// SYNC_FILE_RANGE: fdatasync plus writeback kicked every SYNC_FILE_RANGE_PAGES
+// DSYNC_WRITE: every write carries RWF_DSYNC, durable on completion
+// LINKED: every LINKED_COMMIT_PAGES writes are chained to their own fdatasync
+#define DURABILITY_FSYNC (0)
+#define DURABILITY_FDATASYNC (1)
+#define DURABILITY_SYNC_FILE_RANGE (2)
+#define DURABILITY_DSYNC_WRITE (3)
+#define DURABILITY_LINKED (4)
+#ifndef DURABILITY_MODE
+#define DURABILITY_MODE (DURABILITY_FSYNC)
+#endif
+#define SYNC_FILE_RANGE_PAGES (16)
+#define LINKED_COMMIT_PAGES (4)
+#define FSYNC_POOL_LEN (PAGE_WRITE_POOL_LEN / LINKED_COMMIT_PAGES + 1)
+
+// registered files and buffers indexes
+#define FIXED_FILE_DB (0)
+#define FIXED_BUF_WRITE (0)
+#define FIXED_BUF_READ (1)
+#define FIXED_BUFS_LEN (2)
+
+// adjacent pages are merged in single ops of up to COALESCE_MAX_PAGES pages,
+// must be a power of two not above 256
+#ifndef COALESCE_MAX_PAGES
+#define COALESCE_MAX_PAGES (8)
+#endif
+#define WRITE_BUF_LEN (BUF_SIZE * COALESCE_MAX_PAGES)
+#define READ_BUF_LEN (BUF_SIZE * COALESCE_MAX_PAGES)
+
+// provided buffers for reads, every read owns one until its completion is handled
+#define READ_BUF_GROUP (0)
+#define READ_BUF_RING_ENTRIES (256 / COALESCE_MAX_PAGES)
 
 struct op;
 typedef int (*op_callback_t)(struct op *op, struct io_uring_cqe *cqe);
@@ -28,19 +107,35 @@ struct op
     op_callback_t callback;
 };
 
+// op flags stored in the top 16 bits of user_data
+// OP_FLAG_ERRORS: the callback also runs for failed completions
+#define OP_FLAG_ERRORS (1 << 0)
+
 struct op_file_synced
 {
     struct op inner;
     struct timespec issued;
+    // pages below are durable once the sync completes
+    __u32 page_id_end;
+    // LINKED: chains in issue order, done once its own fsync completed
+    struct op_file_synced *next;
+    __u64 latency_us;
+    __u8 done;
+    // its fdatasync failed, the pages are left to the next chain
+    __u8 failed;
 };
 
 struct op_page_write
 {
     struct op inner;
     unsigned int page_id;
-    int (*user_fsync_callback)(void);
+    // called once the page is durable
+    int (*user_fsync_callback)(struct op_page_write *op);
+    void *user_data;
     struct op_page_write *next;
     struct timespec issued;
+    // pages covered by the sqe of the first op of a run, linked by next
+    __u32 pages;
 };
 
 struct page_write_node
@@ -55,6 +150,9 @@ struct op_page_read
     void *buf;
     struct timespec issued;
     unsigned int page_id;
+    // same as op_page_write
+    struct op_page_read *next;
+    __u32 pages;
 };
 
 struct op_job
@@ -73,7 +171,10 @@ struct writer_job
     __u32 batch_size;
     __u32 written_no_flush;
     __u32 write_done;
-    __u8 inflight;
+    __u32 inflight;
+    __u64 sqes;
+    __u8 refill;
+    struct controller ctl;
 };
 
 struct reader_job
@@ -83,7 +184,10 @@ struct reader_job
     __u32 page_id;
     __u32 batch_size;
     __u32 read_done;
-    __u8 inflight;
+    __u32 inflight;
+    __u64 sqes;
+    __u8 refill;
+    struct controller ctl;
 };
 
 struct flusher_job
@@ -91,9 +195,17 @@ struct flusher_job
     struct op_job inner;
     struct op_file_synced op_fsync;
     struct page_write_node write_list;
+    // LINKED: chains not yet synced, oldest first
+    struct op_file_synced *chain_first;
+    struct op_file_synced *chain_last;
+    struct op op_hint;
     int fd;
     __u32 page_id;
+    __u32 hint_page_id;
     __u8 inflight;
+    __u8 hint_inflight;
+    __u64 syncs;
+    __u64 sync_errors;
 };
 
 struct status_job
@@ -112,6 +224,12 @@ struct tracing_item
     __u32 read_inflight;
     __u32 read_page_id;
     __u32 read_batch_size;
+    __u32 write_decision;
+    __u32 read_decision;
+    __u64 write_observed_us;
+    __u64 read_observed_us;
+    __u64 write_decisions;
+    __u64 read_decisions;
 };
 
 struct tracing_dump_op
@@ -134,11 +252,20 @@ struct tracing_job
 };
 
 struct io_uring_sqe *io_prepare_sqe(struct io_uring *ring, struct op *op, op_callback_t callback);
+struct io_uring_sqe *io_prepare_sqe_flags(struct io_uring *ring, struct op *op, op_callback_t callback, __u16 op_flags);
 unsigned int io_tick(struct io_uring *ring);
 
+void io_prep_db_write(struct io_uring_sqe *sqe, int fd, void *buf, __u32 len, __u64 offset);
+void io_prep_db_read(struct io_uring_sqe *sqe, int fd, void *buf, __u32 len, __u64 offset);
+void read_buf_ring_init(void);
+void io_prep_db_fsync(struct io_uring_sqe *sqe, int fd, __u32 flags);
+void io_prep_db_sync_file_range(struct io_uring_sqe *sqe, int fd, __u32 len, __u64 offset, int flags);
+
 int page_written(struct op *base_op, struct io_uring_cqe *cqe);
 int page_read(struct op *base_op, struct io_uring_cqe *cqe);
 int file_synced(struct op *base_op, struct io_uring_cqe *cqe);
+int chain_synced(struct op *base_op, struct io_uring_cqe *cqe);
+int writeback_hinted(struct op *base_op, struct io_uring_cqe *cqe);
 int tracing_synced(struct op *base_op, struct io_uring_cqe *cqe);
 int tracing_writed(struct op *base_op, struct io_uring_cqe *cqe);
 
@@ -153,11 +280,15 @@ int background_flusher(struct op *base_op, struct io_uring_cqe *cqe);
 int background_status(struct op *base_op, struct io_uring_cqe *cqe);
 int background_tracing(struct op *base_op, struct io_uring_cqe *cqe);
 
-void background_writer_init(int fd);
-void background_reader_init(int fd);
-void background_flusher_init(int fd);
+__u32 writer_submit(struct writer_job *op, __u32 count);
+__u32 reader_submit(struct reader_job *op, __u32 count);
+void jobs_refill(void);
+
+void background_writer_init(int fd, __u32 page_start);
+void background_reader_init(int fd, __u32 page_start);
+void background_flusher_init(int fd, __u32 page_start);
 void background_status_init(void);
-void background_tracing_init(void);
+void background_tracing_init(__u32 thread_idx);
 
 struct stats_bucket_item
 {
@@ -179,14 +310,53 @@ void stats_bucket_move(struct stats_bucket *bucket, __u64 elapsed);
 void stats_bucket_add_one(struct stats_bucket *bucket);
 void stats_bucket_add(struct stats_bucket *bucket, __u64 val);
 
-extern unsigned int page_id_check_order;
+extern struct iovec fixed_bufs[FIXED_BUFS_LEN];
+
+struct thread_stats
+{
+    struct stats_bucket write_count;
+    struct stats_bucket read_count;
+    struct histogram_window write_latency;
+    struct histogram_window read_latency;
+    struct histogram_window fsync_latency;
+    struct stats_bucket fsync_count;
+};
 
-extern struct stats_bucket background_write_count_stats;
-extern struct stats_bucket background_read_count_stats;
-extern struct stats_bucket background_write_latency_stats;
-extern struct stats_bucket background_read_latency_stats;
-extern struct stats_bucket background_fsync_latency_stats;
-extern struct stats_bucket background_fsync_count_stats;
+void thread_stats_init(struct thread_stats *stats, __u32 len);
+void thread_stats_move(struct thread_stats *stats, __u64 elapsed);
+
+// snapshot of a thread status, handed to the leader ring with IORING_OP_MSG_RING
+struct status_report
+{
+    struct op inner;
+    __u32 seq;
+    __u32 thread_idx;
+    __u32 write_inflight;
+    __u32 read_inflight;
+    __u32 write_batch_size;
+    __u32 read_batch_size;
+    __u32 write_page_id;
+    __u32 read_page_id;
+    __u32 flush_page_id;
+    __u64 write_count;
+    __u64 read_count;
+    __u64 fsync_count;
+    struct histogram write_latency;
+    struct histogram read_latency;
+    struct histogram fsync_latency;
+    __u64 write_elapsed;
+    __u64 read_elapsed;
+    __u32 write_pool_high_water;
+    __u32 read_pool_high_water;
+    __u64 write_pool_exhausted;
+    __u64 read_pool_exhausted;
+    __u64 write_sqes;
+    __u64 read_sqes;
+};
+
+int status_reported(struct op *base_op, struct io_uring_cqe *cqe);
+
+struct wal;
 
 struct thread_context
 {
@@ -195,10 +365,41 @@ struct thread_context
     struct status_job status_job;
     struct tracing_job tracing_job;
     struct flusher_job flusher_job;
+    struct pool page_write_pool;
+    struct pool page_read_pool;
+    struct pool fsync_pool;
+    struct io_uring_buf_ring *read_buf_ring;
+    char *read_bufs;
+    __u32 read_bufs_free;
+    struct thread_stats stats;
+    struct status_report report;
+    // with ENABLE_WAL the writer job writes this log instead of write_buf
+    struct wal *wal;
+    __u32 idx;
+    __u32 page_start;
+    __u32 page_end;
+    __u32 page_id_check_order;
+    int cpu;
+    int sq_cpu;
     struct io_uring_params params;
     struct io_uring ring;
 };
 
-extern struct thread_context thread_ctx;
+struct scheduler
+{
+    struct thread_context *threads;
+    // latest report received by the leader from every thread
+    struct status_report *reports;
+    __u32 threads_len;
+    __u32 running;
+};
+
+extern struct scheduler scheduler;
+extern _Thread_local struct thread_context *thread_ctx;
+
+static inline int thread_is_leader(struct thread_context *ctx)
+{
+    return ctx->idx == 0;
+}
 
 #endif
@@ -2,21 +2,179 @@
 #define BTREE_H
 
 #include <linux/types.h>
+#include "tree/buffer.h"
+#include "tree/node.h"
 
+// page 0 of the db file, pid 0 is never a node so it also means "no page"
+#define BTREE_META_PID (0)
+// the slot layout differs with and without key prefixes
+#ifdef ENABLE_KEY_PREFIX
+#define BTREE_MAGIC (0x32656572746269ull)
+#else
+#define BTREE_MAGIC (0x31656572746269ull)
+#endif
+// pages pinned by an insert: the root to leaf path, a new node per level, a
+// new root and the right sibling of a split leaf
+#define BTREE_MAX_DEPTH (16)
+#define BTREE_MIN_FRAMES (BTREE_MAX_DEPTH * 2 + 3)
+
+// percent of a node filled by the bulk loader before it starts the next one
+#ifndef BTREE_LOAD_FILL
+#define BTREE_LOAD_FILL (90)
+#endif
+
+// longer values are spilled to overflow pages, the leaf keeps NODE_OVERFLOW_INLINE bytes of them
+#ifndef BTREE_INLINE_MAX
+#define BTREE_INLINE_MAX (NODE_SIZE / 4)
+#endif
+
+// longer keys are refused: a leaf takes two cells of such a key and an inline
+// value, an internal node more than two separators, so every split has room
+#ifndef BTREE_KEY_MAX
+#define BTREE_KEY_MAX (NODE_SIZE / 8)
+#endif
+
+// percent of a node kept on the left by a split on the right edge of the tree
+// taking a key past its last one: increasing keys leave nodes this full
+#ifndef BTREE_SPLIT_APPEND_FILL
+#define BTREE_SPLIT_APPEND_FILL (90)
+#endif
+
+// a node below this many live bytes after a delete is merged with a sibling
+// or takes cells from it
+#ifndef BTREE_UNDERFLOW_BYTES
+#define BTREE_UNDERFLOW_BYTES (NODE_CAPACITY / 4)
+#endif
+
+struct btree_meta
+{
+    __u64 magic;
+    __u64 root_pid;
+    __u64 next_pid;
+    __u64 count;
+    __u32 node_size;
+    __u32 free_count;
+    __u64 free_pid;
+};
+
+// inserts, updates, deletes and btree_get run from any number of threads:
+// they descend optimistically and latch only the nodes they write. root_pid is
+// written under root_latch, next_pid and count are atomic
 struct btree
 {
-    struct node *root;
+    struct buffer_pool *pool;
+    struct latch root_latch;
+    __u64 root_pid;
+    __u64 next_pid;
     __u32 count;
+    // pages of merged nodes, reused before next_pid grows
+    __u32 free_count;
+    __u64 free_pid;
+    pthread_mutex_t free_lock;
+    // last seen rightmost leaf, keys past its last key are appended to it
+    // without a descent. only a hint: the leaf is checked before it is used
+    __u64 tail_pid;
+    // leaves pinned by cursors and btree_search, writers assert there are none
+    __u32 readers;
+};
+
+// position in the leaf level, the current leaf stays pinned until the cursor
+// moves off it or is closed. a pin does not keep writers off the leaf: cursors,
+// btree_search, the loader and btree_flush need the tree to themselves, and
+// writers assert that no cursor or search result holds a leaf
+struct btree_cursor
+{
+    struct btree *btree;
+    struct node *node;
+    __u32 idx;
 };
 
-int btree_init(struct btree *btree);
+// builds an empty tree bottom-up out of keys appended in increasing order,
+// the open node of every level stays pinned: levels[0] is the current leaf
+struct btree_loader
+{
+    struct btree *btree;
+    __u32 fill_bytes;
+    __u32 height;
+    struct node *levels[BTREE_MAX_DEPTH];
+};
+
+int btree_init(struct btree *btree, struct buffer_pool *pool);
+
+int btree_open(struct btree *btree, struct buffer_pool *pool);
+
+int btree_flush(struct btree *btree);
 
-struct cell_ptr *btree_search(struct btree *btree, __u8 *key, __u32 key_size);
+// 0 with pointers into the pinned leaf, 1 if the key is not in the tree, -1 if a page could not be read
+int btree_search(struct btree *btree, __u8 *key, __u32 key_size, struct cell_pointers *pointers);
+
+void btree_search_release(struct btree *btree, struct cell_pointers *pointers);
+
+// copies the whole value_size bytes of the value to buf, reading its overflow pages, -1 on an io error.
+// 1 if the pages no longer hold the value, only when a writer freed them under btree_get
+int btree_value_read(struct btree *btree, struct cell_pointers *pointers, __u8 *buf);
+
+// copies the value of key to buf while writers run, value_size is set to its
+// size and nothing is copied if it is larger than buf_size.
+// 0 on success, 1 if the key is not in the tree, -1 if a page could not be read
+int btree_get(struct btree *btree, __u8 *key, __u32 key_size, __u8 *buf, __u32 buf_size, __u32 *value_size);
 
 int btree_insert_traverse(struct btree *btree, __u32 *ret_idx, struct node **ret_node, __u8 *key, __u32 key_size, __u32 value_size);
 
+// 0 on success, 1 if the key is already in the tree, -1 if a page could not be read or written
+// or the key is longer than BTREE_KEY_MAX
 int btree_insert(struct btree *btree, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size);
 
+// the value is overwritten in its cell when it fits, moved within the leaf otherwise.
+// 0 on success, 1 if the key is not in the tree, -1 on an io error or a key longer than BTREE_KEY_MAX
+int btree_update(struct btree *btree, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size);
+
+// btree_update, or btree_insert for a key not in the tree
+int btree_upsert(struct btree *btree, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size);
+
+// 0 if the key was deleted, 1 if it is not in the tree, -1 if a page could not be read.
+// underfull nodes on the path are merged with or refilled from a sibling
+int btree_delete(struct btree *btree, __u8 *key, __u32 key_size);
+
+// fill is a percent of the node size, the tree must be empty
+int btree_load_init(struct btree_loader *loader, struct btree *btree, __u32 fill);
+
+// 1 if the key is not greater than the previous one, -1 if a page could not be allocated
+// or the key is longer than BTREE_KEY_MAX
+int btree_load_append(struct btree_loader *loader, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size);
+
+// links the open nodes to their parents and sets the root, btree_flush persists the tree
+void btree_load_finish(struct btree_loader *loader);
+
+void btree_cursor_init(struct btree_cursor *cursor, struct btree *btree);
+
+// cursor moves return 0 on a cell, 1 past either end of the tree and -1 if a page could not be read
+
+// first key >= key, the first key of the tree without one
+int btree_cursor_seek(struct btree_cursor *cursor, __u8 *key, __u32 key_size);
+
+int btree_cursor_last(struct btree_cursor *cursor);
+
+int btree_cursor_next(struct btree_cursor *cursor);
+
+int btree_cursor_prev(struct btree_cursor *cursor);
+
+// pointers stay valid until the cursor moves
+int btree_cursor_get(struct btree_cursor *cursor, struct cell_pointers *pointers);
+
+void btree_cursor_close(struct btree_cursor *cursor);
+
+struct node *btree_node_fetch(struct btree *btree, __u64 pid);
+
+struct node *btree_node_new(struct btree *btree);
+
+// the page goes to the free list, it stays pinned until released
+void btree_node_free(struct btree *btree, struct node *node);
+
+void btree_node_release(struct btree *btree, struct node *node, int dirty);
+
+__u64 btree_node_pid(struct btree *btree, struct node *node);
+
 struct node *btree_node_alloc(void);
 
 #endif
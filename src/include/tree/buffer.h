@@ -0,0 +1,85 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <linux/types.h>
+#include <pthread.h>
+#include "scheduler.h"
+#include "tree/latch.h"
+#include "tree/node.h"
+
+#define BUFFER_PAGE_SIZE (NODE_SIZE)
+#define BUFFER_PID_NONE (~(__u64)0)
+// dirty pages in flight during buffer_pool_flush, bounded by the completion queue
+#ifndef BUFFER_FLUSH_BATCH
+#define BUFFER_FLUSH_BATCH (64)
+#endif
+
+enum frame_state
+{
+    FRAME_FREE,
+    FRAME_READY,
+    FRAME_IO,
+};
+
+struct buffer_pool;
+
+struct frame
+{
+    // page read/write completion
+    struct op inner;
+    struct buffer_pool *pool;
+    __u64 pid;
+    __u32 pin_count;
+    int res;
+    __u8 state;
+    __u8 dirty;
+    // CLOCK reference bit, set on every pin and optimistic access
+    __u8 referenced;
+    // guards the page for optimistic readers, held while the frame is loaded
+    // or evicted and by writers of the page
+    struct latch latch;
+};
+
+struct op_buffer_sync
+{
+    struct op inner;
+    struct buffer_pool *pool;
+    int res;
+};
+
+struct buffer_pool
+{
+    // frames, table and ring; optimistic lookups and unpins go without it
+    pthread_mutex_t lock;
+    void *buf;
+    struct frame *frames;
+    // open addressing pid -> frame index + 1, 0 is an empty slot
+    __u32 *table;
+    __u32 table_mask;
+    __u32 len;
+    __u32 clock_hand;
+    __u32 inflight;
+    struct op_buffer_sync op_sync;
+    struct op_buffer_sync op_extent;
+    struct io_uring *ring;
+    int fd;
+    __u64 hits;
+    __u64 misses;
+    __u64 evictions;
+    __u64 writebacks;
+};
+
+int buffer_pool_init(struct buffer_pool *pool, struct io_uring *ring, int fd, __u32 len);
+void buffer_pool_free(struct buffer_pool *pool);
+void *buffer_pool_fetch(struct buffer_pool *pool, __u64 pid);
+void *buffer_pool_new(struct buffer_pool *pool, __u64 pid);
+void buffer_pool_pin(struct buffer_pool *pool, void *page);
+void buffer_pool_unpin(struct buffer_pool *pool, void *page, int dirty);
+void buffer_pool_mark_dirty(struct buffer_pool *pool, void *page);
+void *buffer_pool_optimistic(struct buffer_pool *pool, __u64 pid, __u64 *version);
+struct latch *buffer_pool_latch(struct buffer_pool *pool, void *page);
+int buffer_pool_extent_io(struct buffer_pool *pool, __u64 pid, void *buf, __u32 pages, int write);
+__u64 buffer_pool_pid(struct buffer_pool *pool, void *page);
+int buffer_pool_flush(struct buffer_pool *pool);
+
+#endif
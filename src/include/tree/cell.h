@@ -3,9 +3,20 @@
 
 #include <linux/types.h>
 
+enum cell_flag
+{
+    // leaf value continued in overflow pages, see btree_overflowed_cell_suffix
+    CELL_FLAG_OVERFLOW = 1 << 0,
+};
+
 struct cell_ptr
 {
     __u32 offset;
+#ifdef ENABLE_KEY_PREFIX
+    // first key bytes as a zero padded big endian number, slots with different
+    // prefixes are ordered without reading their cells
+    __u32 prefix;
+#endif
 };
 
 struct __attribute__((packed)) cell
@@ -20,7 +31,7 @@ struct __attribute__((packed)) cell
         };
         struct
         {
-            // internal
+            // internal, page id of the child
             __u64 pid;
         };
         struct
@@ -41,6 +52,10 @@ __u8 *leaf_cell_get_value(struct cell *cell);
 
 __u8 *cell_get_key(struct cell *cell);
 
-struct node* internal_cell_child(struct cell *cell);
+__u64 internal_cell_child(struct cell *cell);
+
+__u32 cell_size(struct cell *cell);
+
+__u32 cell_key_prefix(__u8 *key, __u32 key_size);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,72 @@
+#ifndef LATCH_H
+#define LATCH_H
+
+#include <linux/types.h>
+
+// optimistic version latch: odd while a writer holds it, every release moves
+// the version on. readers take no lock, they read the version, read the data
+// and check the version has not moved
+struct latch
+{
+    __u64 version;
+};
+
+static inline void latch_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// waits out a writer
+static inline __u64 latch_read(struct latch *latch)
+{
+    __u64 version;
+    while ((version = __atomic_load_n(&latch->version, __ATOMIC_ACQUIRE)) & 1)
+        latch_pause();
+
+    return version;
+}
+
+// what was read since latch_read returned version is consistent
+static inline int latch_validate(struct latch *latch, __u64 version)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&latch->version, __ATOMIC_RELAXED) == version;
+}
+
+// exclusive if nobody wrote since version was read
+static inline int latch_upgrade(struct latch *latch, __u64 version)
+{
+    if (!__atomic_compare_exchange_n(&latch->version, &version, version + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+
+    // the odd version is visible before any write under it
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+static inline int latch_try_lock(struct latch *latch)
+{
+    __u64 version = __atomic_load_n(&latch->version, __ATOMIC_RELAXED);
+    return !(version & 1) && latch_upgrade(latch, version);
+}
+
+static inline void latch_lock(struct latch *latch)
+{
+    while (!latch_upgrade(latch, latch_read(latch)))
+        latch_pause();
+}
+
+static inline void latch_unlock(struct latch *latch)
+{
+    __atomic_store_n(&latch->version, latch->version + 1, __ATOMIC_RELEASE);
+}
+
+// nothing was written: readers that started before the lock stay valid
+static inline void latch_abort(struct latch *latch)
+{
+    __atomic_store_n(&latch->version, latch->version - 1, __ATOMIC_RELEASE);
+}
+
+#endif
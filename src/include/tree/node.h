@@ -10,6 +10,9 @@ enum node_flag
 {
     BTREE_NODE_FLAGS_LEAF = 1 << 0,
     BTREE_NODE_FLAGS_ROOT = 1 << 1,
+    BTREE_NODE_FLAGS_OVERFLOW = 1 << 2,
+    // on the free page list, chained through next_leaf_pid
+    BTREE_NODE_FLAGS_FREE = 1 << 3,
 };
 
 struct node
@@ -18,13 +21,21 @@ struct node
     __u64 last_overflow_pid;
     __u64 rightmost_pid;
     __u64 parent_pid;
+    // leaf siblings in key order, 0 at the ends
+    __u64 prev_leaf_pid;
+    __u64 next_leaf_pid;
     __u32 size;
     __u32 cell_offset;
     __u32 tombstone_offset;
+    // tombstones and the rests behind cells too short to be one
     __u32 tombstone_bytes;
     __u16 flags;
 };
 
+// bytes for slots and cells after the header
+#define NODE_CAPACITY (NODE_SIZE - sizeof(struct node))
+
+// header of every page of an overflow chain, value bytes follow it up to next_free_offset
 struct overflow_node
 {
     __u64 next_overflow_pid;
@@ -33,18 +44,26 @@ struct overflow_node
     __u16 flags;
 };
 
+// closes the inline part of an overflowed leaf cell: the first value bytes
+// stay in the leaf, the rest starts at offset of page overflow_pid
 struct btree_overflowed_cell_suffix
 {
     __u64 overflow_pid;
     __u32 offset;
 };
 
+#define NODE_OVERFLOW_PREFIX (64)
+#define NODE_OVERFLOW_INLINE (NODE_OVERFLOW_PREFIX + sizeof(struct btree_overflowed_cell_suffix))
+#define NODE_OVERFLOW_DATA (NODE_SIZE - sizeof(struct overflow_node))
+
 struct cell_pointers
 {
     __u8 *key;
     __u8 *value;
     __u32 key_size;
     __u32 value_size;
+    // first page of an overflowed value, value then only holds its first NODE_OVERFLOW_PREFIX bytes
+    __u64 overflow_pid;
 };
 
 void debug_node_cell(struct node *node, struct cell *cell);
@@ -53,15 +72,15 @@ void debug_node(struct node *node, int show_cells, int show_tombstones);
 
 void node_cell_pointers(struct node *node, struct cell_ptr *cell_ptr, struct cell_pointers *pointers);
 
-struct node *node_parent(struct node *node);
+__u64 node_parent(struct node *node);
 
-void node_set_parent(struct node *node, struct node *child);
+void node_set_parent(struct node *node, __u64 parent_pid);
 
 void node_set_root(struct node *node);
 
 void node_unset_root(struct node *node);
 
-void node_set_rightmost_child(struct node *node, struct node *child);
+void node_set_rightmost_child(struct node *node, __u64 child_pid);
 
 int node_delete_key(struct node *node, __u8 *key, __u32 key_size);
 
@@ -81,7 +100,7 @@ void internal_node_split(struct node *node, struct node *new_node, __u32 partiti
 
 void leaf_node_split(struct node *node, struct node *new_node, __u32 partition_idx);
 
-__u32 node_partition_idx(struct node *node);
+__u32 node_partition_idx(struct node *node, __u32 percent);
 
 struct cell_ptr *node_get_cell(struct node *node, __u8 *key, __u32 key_size);
 
@@ -101,6 +120,14 @@ int node_is_full(struct node *node, __u32 key_size, __u32 value_size);
 
 __u32 node_get_free_offset(struct node *node, __u32 key_size, __u32 value_size);
 
+void node_compact(struct node *node);
+
+__u32 node_live_bytes(struct node *node);
+
+void node_insert_cell(struct node *node, __u32 idx, struct cell *cell);
+
+void node_remove_cell(struct node *node, __u32 idx);
+
 int node_is_leaf(struct node *node);
 
 int node_is_root(struct node *node);
@@ -109,12 +136,16 @@ struct node *btree_split_node(struct node *node);
 
 void node_tuple_set_tombstone(struct node *node, __u32 idx);
 
+int node_update_leaf_cell(struct node *node, __u32 idx, __u8 *value, __u32 value_size);
+
+void node_cell_set_overflow(struct cell *cell, __u32 value_size);
+
 void node_insert_leaf_cell(struct node *node, __u32 offset, __u32 idx, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size);
 
-void node_insert_internal_cell(struct node *node, __u32 offset, __u32 idx, __u8 *key, __u32 key_size, struct node *child);
+void node_insert_internal_cell(struct node *node, __u32 offset, __u32 idx, __u8 *key, __u32 key_size, __u64 child_pid);
 
 void node_write_leaf_cell(struct node *node, struct cell_ptr *cell_ptr, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size, __u16 flags);
 
-void node_write_internal_cell(struct node *node, struct cell_ptr *cell_ptr, __u8 *key, __u32 key_size, struct node *child, __u16 flags);
+void node_write_internal_cell(struct node *node, struct cell_ptr *cell_ptr, __u8 *key, __u32 key_size, __u64 child_pid, __u16 flags);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,101 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <linux/types.h>
+#include "scheduler.h"
+
+// the log of a scheduler thread is its page shard of the db file, one log
+// page per write page
+#define WAL_PAGE_SIZE (BUF_SIZE)
+#define WAL_PAGE_MAGIC (0x4c41572d6f697363ull)
+#define WAL_RECORD_ALIGN (8)
+#define WAL_RECORD_MAX (WAL_PAGE_SIZE - sizeof(struct wal_page) - sizeof(struct wal_record))
+// pages buffered in memory between appenders and the writer job
+#ifndef WAL_BUF_PAGES
+#define WAL_BUF_PAGES (256)
+#endif
+
+// written when the page is sealed, records fill [sizeof(wal_page), used)
+struct wal_page
+{
+    __u64 magic;
+    // log generation, pages of an older run are left behind after a restart
+    __u64 epoch;
+    __u64 page_no;
+    __u32 used;
+    // crc32c of the header with crc zeroed
+    __u32 crc;
+};
+
+struct wal_record
+{
+    // crc32c of lsn, len and data
+    __u32 crc;
+    __u32 len;
+    // byte position of the record in the log
+    __u64 lsn;
+    __u8 data[];
+};
+
+// payload of a record replayed into the tree by recovery
+struct wal_insert
+{
+    __u16 key_size;
+    __u16 value_size;
+    __u8 data[];
+};
+
+struct wal_waiter;
+typedef void (*wal_durable_fn)(struct wal_waiter *waiter);
+
+// owned by the appender, called on the scheduler thread once the record is durable
+struct wal_waiter
+{
+    struct wal_waiter *next;
+    wal_durable_fn callback;
+    __u64 lsn;
+};
+
+struct wal_slot
+{
+    // bytes reserved and copied, the page is complete at WAL_PAGE_SIZE
+    __u32 filled;
+    // end of the records, the rest of a sealed page is padding
+    __u32 end;
+    struct wal_waiter *waiters;
+};
+
+struct wal
+{
+    void *buf;
+    struct wal_slot slots[WAL_BUF_PAGES];
+    __u64 epoch;
+    // log pages available in the shard
+    __u64 pages;
+    // next free byte, appenders race on it
+    __u64 reserved;
+    // pages handed to the writer, owned by the scheduler thread
+    __u64 submitted_page;
+    // pages whose buffer can be reused
+    __u64 written_page;
+    __u64 durable_lsn;
+    __u64 appended;
+    __u64 sealed;
+};
+
+int wal_init(struct wal *wal, __u64 pages, __u64 epoch);
+void wal_free(struct wal *wal);
+int wal_append(struct wal *wal, const void *data, __u32 len, struct wal_waiter *waiter, __u64 *ret_lsn);
+
+__u32 wal_pages_ready(struct wal *wal, __u32 count);
+void *wal_page_buf(struct wal *wal, __u64 page_no);
+struct wal_waiter *wal_page_submit(struct wal *wal, __u64 page_no);
+void wal_pages_written(struct wal *wal, __u32 pages);
+int wal_seal(struct wal *wal);
+int wal_page_synced(struct op_page_write *op);
+
+__u64 wal_page_epoch(void *buf);
+int wal_page_check(__u64 epoch, void *buf, __u64 page_no);
+__u32 wal_checksum(__u32 crc, const void *data, __u64 len);
+
+#endif
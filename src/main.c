@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include "configure.h"
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,32 +9,269 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include "utils.h"
 #include "scheduler.h"
+#include "wal.h"
+#include "recovery.h"
 
-unsigned int page_id_check_order = 0;
+#define STATS_BUF_LEN (SPEEDTEST_RANGE_MS / BACKGROUND_STATUS_MS)
 
-struct stats_bucket background_write_count_stats;
-struct stats_bucket background_read_count_stats;
-struct stats_bucket background_write_latency_stats;
-struct stats_bucket background_read_latency_stats;
-struct stats_bucket background_fsync_latency_stats;
-struct stats_bucket background_fsync_count_stats;
+static int db_fd;
 
-struct thread_context thread_ctx;
+#ifdef ENABLE_WAL
+struct appender_waiter
+{
+    struct wal_waiter inner;
+    struct wal_appender *appender;
+    __u8 done;
+};
 
-int main(int argc, char *argv[])
+struct wal_appender
 {
-    ASSERT(argc == 2);
+    pthread_t thread;
+    __u32 idx;
+    struct wal *wal;
+    __u64 appended;
+    __u64 durable;
+    __u64 retries;
+    struct appender_waiter waiters[WAL_APPENDER_INFLIGHT];
+};
+
+static struct wal_appender *appenders;
+static __u32 appenders_len;
+
+// runs on the scheduler thread of the log
+static void appender_durable(struct wal_waiter *base)
+{
+    struct appender_waiter *waiter = container_of(base, struct appender_waiter, inner);
+    __atomic_add_fetch(&waiter->appender->durable, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&waiter->done, 1, __ATOMIC_RELEASE);
+}
+
+// bijective, sequential ids are spread over the key range of every partition
+static __u64 key_mix(__u64 x)
+{
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static void *appender_main(void *arg)
+{
+    struct wal_appender *appender = arg;
+    __u8 record[WAL_RECORD_SIZE];
+    struct wal_insert *insert = (struct wal_insert *)record;
+    int ret;
+
+    // key: mixed appender and sequence number then the epoch, unique across runs
+    ASSERT(WAL_RECORD_SIZE > sizeof(*insert) + WAL_KEY_SIZE);
+    memset(record, 'w', sizeof(record));
+    insert->key_size = WAL_KEY_SIZE;
+    insert->value_size = WAL_RECORD_SIZE - sizeof(*insert) - WAL_KEY_SIZE;
+    __u64 epoch = __builtin_bswap64(appender->wal->epoch);
+    memcpy(insert->data + sizeof(__u64), &epoch, sizeof(epoch));
+
+    for (__u32 i = 0; i < WAL_APPENDER_INFLIGHT; i++)
+    {
+        appender->waiters[i].appender = appender;
+        appender->waiters[i].inner.callback = appender_durable;
+        appender->waiters[i].done = 1;
+    }
+
+    // append until the log is full, every record waits for its sync
+    for (;;)
+    {
+        struct appender_waiter *waiter = &appender->waiters[appender->appended % WAL_APPENDER_INFLIGHT];
+        while (!__atomic_load_n(&waiter->done, __ATOMIC_ACQUIRE))
+            sched_yield();
+
+        __u64 key = __builtin_bswap64(key_mix((__u64)appender->idx << 40 | appender->appended));
+        memcpy(insert->data, &key, sizeof(key));
+        waiter->done = 0;
+        ret = wal_append(appender->wal, record, sizeof(record), &waiter->inner, NULL);
+        if (ret == -EAGAIN)
+        {
+            // the log buffer is full until the writer catches up
+            waiter->done = 1;
+            appender->retries++;
+            sched_yield();
+            continue;
+        }
+        if (ret == -ENOSPC)
+        {
+            waiter->done = 1;
+            break;
+        }
+        ASSERT(!ret);
+        appender->appended++;
+    }
+
+    while (__atomic_load_n(&appender->durable, __ATOMIC_ACQUIRE) < appender->appended)
+        sched_yield();
+
+    return NULL;
+}
+
+static void appenders_start(void)
+{
+    int ret;
+
+    appenders_len = scheduler.threads_len * WAL_APPENDERS;
+    appenders = calloc(appenders_len, sizeof(struct wal_appender));
+    ASSERT(appenders);
+
+    for (__u32 i = 0; i < appenders_len; i++)
+    {
+        appenders[i].idx = i;
+        appenders[i].wal = scheduler.threads[i % scheduler.threads_len].wal;
+        ret = pthread_create(&appenders[i].thread, NULL, appender_main, &appenders[i]);
+        ASSERT(ret == 0);
+    }
+}
+
+// records per sync is the group commit factor
+static void appenders_join(double elapsed_s)
+{
+    __u64 records = 0, retries = 0, syncs = 0, sealed = 0;
+    int ret;
+
+    for (__u32 i = 0; i < appenders_len; i++)
+    {
+        ret = pthread_join(appenders[i].thread, NULL);
+        ASSERT(ret == 0);
+        records += appenders[i].appended;
+        retries += appenders[i].retries;
+    }
+    for (__u32 i = 0; i < scheduler.threads_len; i++)
+    {
+        syncs += scheduler.threads[i].flusher_job.syncs;
+        sealed += scheduler.threads[i].wal->sealed;
+    }
+
+    printf("bench wal appenders: %u record: %u B records: %llu records/s: %.0f syncs: %llu records/sync: %.1f sealed: %llu buffer full: %llu\n",
+           appenders_len, WAL_RECORD_SIZE, records, records / elapsed_s,
+           syncs, syncs ? (double)records / syncs : 0.0, sealed, retries);
+}
 
-    int fd;
+// replay the logs left by the previous run into the tree before they are
+// overwritten, the shards must match the ones of that run
+static void wal_recover(const char *db_path)
+{
+    __u64 shard_start[MAX_SCHEDULER_THREADS + 1];
+    int cpus[MAX_SCHEDULER_THREADS];
+    char tree_path[4096];
+    struct recovery recovery;
     int ret;
 
-    memset(&thread_ctx.params, 0, sizeof(thread_ctx.params));
+    for (__u32 i = 0; i < scheduler.threads_len; i++)
+    {
+        shard_start[i] = scheduler.threads[i].page_start;
+        cpus[i] = scheduler.threads[i].cpu;
+    }
+    shard_start[scheduler.threads_len] = scheduler.threads[scheduler.threads_len - 1].page_end;
+    snprintf(tree_path, sizeof(tree_path), "%s.tree", db_path);
+
+    memset(&recovery, 0, sizeof(recovery));
+    recovery.fd = db_fd;
+    recovery.shard_start = shard_start;
+    recovery.threads_len = scheduler.threads_len;
+    recovery.tree_path = tree_path;
+    recovery.cpus = cpus;
+
+    ret = recovery_run(&recovery);
+    ASSERT(ret == 0);
+
+    double log_mb = (double)recovery.pages * WAL_PAGE_SIZE / BYTE_MB(1);
+    printf("bench recovery threads: %u log: %.1f MB records: %llu replayed: %llu elapsed: %.3f s read mb/s: %.0f records/s: %.0f\n",
+           recovery.threads_len, log_mb, recovery.records, recovery.replayed, recovery.elapsed_s,
+           log_mb / recovery.elapsed_s, recovery.records / recovery.elapsed_s);
+}
+#endif
+
+static int nth_allowed_cpu(cpu_set_t *allowed, __u32 n)
+{
+    __u32 count = CPU_COUNT(allowed);
+    n %= count;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, allowed))
+            continue;
+        if (n == 0)
+            return cpu;
+        n--;
+    }
+
+    return -1;
+}
+
+static double timeval_s(struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+// submission cost summary, io threads (sqpoll, io-wq) are threads of this
+// process so their cpu time is part of RUSAGE_SELF, minus what was spent
+// before the run started
+static double bench_print(struct timespec *start_time, struct rusage *start_usage)
+{
+    struct timespec now;
+    struct rusage usage;
+    int ret;
+
+    ret = clock_gettime(CLOCK_REALTIME, &now);
+    ASSERT(!ret);
+    ret = getrusage(RUSAGE_SELF, &usage);
+    ASSERT(!ret);
+
+    double elapsed_s = (now.tv_sec - start_time->tv_sec) + (now.tv_nsec - start_time->tv_nsec) / 1e9;
+    double user_s = timeval_s(&usage.ru_utime) - timeval_s(&start_usage->ru_utime);
+    double sys_s = timeval_s(&usage.ru_stime) - timeval_s(&start_usage->ru_stime);
+    double written_gb = (double)BYTES_TO_WRITE / BYTE_GB(1);
+
+#ifdef ENABLE_SQPOLL
+    char *mode = "sqpoll";
+#else
+    char *mode = "syscall";
+#endif
+
+    printf("\nbench %s threads: %u written: %.2f GB elapsed: %.2f s write mb/s: %.0f cpu: %.2f s (user %.2f sys %.2f) cpu s/GB: %.3f\n",
+           mode, scheduler.threads_len, written_gb, elapsed_s,
+           BYTES_TO_WRITE / elapsed_s / BYTE_MB(1),
+           user_s + sys_s, user_s, sys_s, (user_s + sys_s) / written_gb);
+
+    return elapsed_s;
+}
+
+static void thread_setup(struct thread_context *ctx)
+{
+    int ret;
+    cpu_set_t cpu_set;
+
+    CPU_ZERO(&cpu_set);
+    CPU_SET(ctx->cpu, &cpu_set);
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    ASSERT(ret == 0);
 
-    thread_ctx.params.cq_entries = ENTRIES << 1;
-    thread_ctx.params.flags =
-        // IORING_SETUP_SQPOLL |
+    memset(&ctx->params, 0, sizeof(ctx->params));
+
+    ctx->params.cq_entries = ENTRIES << 1;
+#ifdef ENABLE_SQPOLL
+    // the kernel rejects the task run flags on SQPOLL rings, completions
+    // are not delivered through task work of this thread anyway
+    ctx->params.flags =
+        IORING_SETUP_SQPOLL |
+        IORING_SETUP_SQ_AFF |
+        IORING_SETUP_SINGLE_ISSUER |
+        IORING_SETUP_NO_SQARRAY |
+        IORING_SETUP_CQSIZE;
+    ctx->params.sq_thread_cpu = ctx->sq_cpu;
+    ctx->params.sq_thread_idle = SQ_THREAD_IDLE_MS;
+#else
+    ctx->params.flags =
         IORING_SETUP_COOP_TASKRUN |
         IORING_SETUP_TASKRUN_FLAG |
         IORING_SETUP_DEFER_TASKRUN |
@@ -41,67 +279,225 @@ int main(int argc, char *argv[])
         IORING_SETUP_NO_SQARRAY |
         IORING_SETUP_CQSIZE;
 
-    ret = io_uring_queue_init_params(ENTRIES, &thread_ctx.ring, &thread_ctx.params);
+    // workers share the leader io-wq instead of spawning a pool per ring,
+    // not done with SQPOLL as it would share the poller thread as well
+    if (!thread_is_leader(ctx))
+    {
+        ctx->params.flags |= IORING_SETUP_ATTACH_WQ;
+        ctx->params.wq_fd = scheduler.threads[0].ring.ring_fd;
+    }
+#endif
+
+    // DEFER_TASKRUN rings must be created by the thread submitting on them
+    ret = io_uring_queue_init_params(ENTRIES, &ctx->ring, &ctx->params);
     ASSERT(ret == 0);
 
-    fd = open(argv[1], O_DIRECT | O_RDWR | O_CREAT, 0644);
-    ASSERT(fd != -1);
+    int io_fd = db_fd;
+#ifdef ENABLE_FIXED_FILES
+    ret = io_uring_register_files(&ctx->ring, &db_fd, 1);
+    ASSERT(ret == 0);
+    io_fd = FIXED_FILE_DB;
+#endif
 
-    LOG("fd = %d\n", fd);
+#ifdef ENABLE_FIXED_BUFFERS
+    struct iovec bufs[FIXED_BUFS_LEN];
+    memcpy(bufs, fixed_bufs, sizeof(bufs));
+#ifdef ENABLE_WAL
+    // log pages are written straight from the append buffer
+    bufs[FIXED_BUF_WRITE].iov_base = ctx->wal->buf;
+    bufs[FIXED_BUF_WRITE].iov_len = (__u64)WAL_BUF_PAGES * WAL_PAGE_SIZE;
+#endif
+    ret = io_uring_register_buffers(&ctx->ring, bufs, ARRAY_LEN(bufs));
+    ASSERT(ret == 0);
+#endif
 
-    // ret = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (__u64)(16UL * (1UL << 30)));
-    // ASSERT(ret != -1);
+#ifdef ENABLE_READ_BUF_RING
+    read_buf_ring_init();
+#endif
 
-    ASSERT(INFLIGHT_LOW_RANGE <= INFLIGHT_HIGH_RANGE);
-    ASSERT(BACKGROUND_STATUS_MS <= SPEEDTEST_RANGE_MS);
-    ASSERT(BATCH_INCREMENT_PERCENT >= 0);
+    thread_stats_init(&ctx->stats, STATS_BUF_LEN);
+    ctx->page_id_check_order = ctx->page_start;
 
-#define STATS_BUF_LEN (SPEEDTEST_RANGE_MS / BACKGROUND_STATUS_MS)
-    stats_bucket_init(&background_write_count_stats, STATS_BUF_LEN);
-    stats_bucket_init(&background_read_count_stats, STATS_BUF_LEN);
-    stats_bucket_init(&background_write_latency_stats, STATS_BUF_LEN);
-    stats_bucket_init(&background_read_latency_stats, STATS_BUF_LEN);
-    stats_bucket_init(&background_fsync_latency_stats, STATS_BUF_LEN);
-    stats_bucket_init(&background_fsync_count_stats, STATS_BUF_LEN);
-
-    background_writer_init(fd);
-    background_reader_init(fd);
-    background_flusher_init(fd);
-    background_tracing_init();
+    background_writer_init(io_fd, ctx->page_start);
+    background_reader_init(io_fd, ctx->page_start);
+    background_flusher_init(io_fd, ctx->page_start);
+    background_tracing_init(ctx->idx);
     background_status_init();
 
-    run_job(&thread_ctx.ring, &thread_ctx.writer_job.inner);
+    run_job(&ctx->ring, &ctx->writer_job.inner);
 #ifdef ENABLE_READER
-    run_job(&thread_ctx.ring, &thread_ctx.reader_job.inner);
+    run_job(&ctx->ring, &ctx->reader_job.inner);
 #endif
 #ifdef ENABLE_FLUSHER
-    run_job(&thread_ctx.ring, &thread_ctx.flusher_job.inner);
+    run_job(&ctx->ring, &ctx->flusher_job.inner);
 #endif
 #ifdef ENABLE_TRACING
-    run_job(&thread_ctx.ring, &thread_ctx.tracing_job.inner);
+    run_job(&ctx->ring, &ctx->tracing_job.inner);
 #endif
-    run_job(&thread_ctx.ring, &thread_ctx.status_job.inner);
+    run_job(&ctx->ring, &ctx->status_job.inner);
 
-    LOG("setup done!\n");
+#ifdef ENABLE_SQPOLL
+    LOG("thread %u setup done! cpu: %d sq cpu: %d pages: [%u, %u)\n", ctx->idx, ctx->cpu, ctx->sq_cpu, ctx->page_start, ctx->page_end);
+#else
+    LOG("thread %u setup done! cpu: %d pages: [%u, %u)\n", ctx->idx, ctx->cpu, ctx->page_start, ctx->page_end);
+#endif
+}
+
+static int thread_jobs_running(struct thread_context *ctx)
+{
+    return ctx->writer_job.inner.running || ctx->flusher_job.inner.running || ctx->reader_job.inner.running || ctx->tracing_job.inner.running;
+}
 
+static void thread_loop(struct thread_context *ctx)
+{
+    int ret;
     int submitted;
     int consumed;
+    int running = 1;
     (void)submitted;
     (void)consumed;
 
     while (1)
     {
-        ret = io_uring_submit(&thread_ctx.ring);
+        ret = io_uring_submit(&ctx->ring);
         ASSERT(ret >= 0);
         submitted = ret;
 
-        ret = io_tick(&thread_ctx.ring);
+        ret = io_tick(&ctx->ring);
         ASSERT(ret >= 0);
         consumed = ret;
 
-        if (!thread_ctx.writer_job.inner.running && !thread_ctx.flusher_job.inner.running && !thread_ctx.reader_job.inner.running && !thread_ctx.tracing_job.inner.running)
+        if (running && !thread_jobs_running(ctx))
+        {
+            running = 0;
+            __atomic_sub_fetch(&scheduler.running, 1, __ATOMIC_RELEASE);
+        }
+
+        // the leader keeps collecting status reports until every thread is done
+        if (!running && (!thread_is_leader(ctx) || !__atomic_load_n(&scheduler.running, __ATOMIC_ACQUIRE)))
             break;
     }
+}
+
+static void *thread_main(void *arg)
+{
+    struct thread_context *ctx = arg;
+    thread_ctx = ctx;
+
+    thread_setup(ctx);
+    thread_loop(ctx);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    ASSERT(argc == 2);
+
+    int ret;
+
+    db_fd = open(argv[1], O_DIRECT | O_RDWR | O_CREAT, 0644);
+    ASSERT(db_fd != -1);
+
+    LOG("fd = %d\n", db_fd);
+
+    // ret = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (__u64)(16UL * (1UL << 30)));
+    // ASSERT(ret != -1);
+
+    ASSERT(INFLIGHT_LOW_RANGE <= INFLIGHT_HIGH_RANGE);
+    ASSERT(BACKGROUND_STATUS_MS <= SPEEDTEST_RANGE_MS);
+    ASSERT(BATCH_INCREMENT_PERCENT >= 0);
+
+    cpu_set_t allowed;
+    ret = sched_getaffinity(0, sizeof(allowed), &allowed);
+    ASSERT(ret == 0);
+
+#ifdef ENABLE_SQPOLL
+    // every ring gets its own poller, by default half of the cpus submit and half poll
+    __u32 threads_len = SCHEDULER_THREADS ? SCHEDULER_THREADS : max(1, CPU_COUNT(&allowed) / 2);
+#else
+    __u32 threads_len = SCHEDULER_THREADS ? SCHEDULER_THREADS : CPU_COUNT(&allowed);
+#endif
+    threads_len = min(threads_len, MAX_SCHEDULER_THREADS);
+    ASSERT(threads_len > 0);
+
+    scheduler.threads_len = threads_len;
+    scheduler.running = threads_len;
+    scheduler.threads = calloc(threads_len, sizeof(struct thread_context));
+    ASSERT(scheduler.threads);
+    scheduler.reports = calloc(threads_len, sizeof(struct status_report));
+    ASSERT(scheduler.reports);
+
+    // shard the page range, the last thread takes the remainder
+    __u32 pages = BYTES_TO_WRITE / BUF_SIZE;
+    __u32 shard_pages = pages / threads_len;
+    for (__u32 i = 0; i < threads_len; i++)
+    {
+        struct thread_context *ctx = &scheduler.threads[i];
+        ctx->idx = i;
+        ctx->cpu = nth_allowed_cpu(&allowed, i);
+        ctx->sq_cpu = nth_allowed_cpu(&allowed, i + threads_len + SQ_THREAD_CPU_OFFSET);
+        ctx->page_start = i * shard_pages;
+        ctx->page_end = i == threads_len - 1 ? pages : ctx->page_start + shard_pages;
+    }
+
+#ifdef ENABLE_WAL
+    wal_recover(argv[1]);
+#endif
+
+    struct timespec start_time;
+    struct rusage start_usage;
+    ret = clock_gettime(CLOCK_REALTIME, &start_time);
+    ASSERT(!ret);
+    ret = getrusage(RUSAGE_SELF, &start_usage);
+    ASSERT(!ret);
+
+#ifdef ENABLE_WAL
+    // the shard of every thread is its log, a new epoch tells this run pages
+    // from the ones of a previous run
+    __u64 epoch = TIME_S(start_time.tv_sec) + start_time.tv_nsec;
+    for (__u32 i = 0; i < threads_len; i++)
+    {
+        struct thread_context *ctx = &scheduler.threads[i];
+        ctx->wal = calloc(1, sizeof(struct wal));
+        ASSERT(ctx->wal);
+        ret = wal_init(ctx->wal, ctx->page_end - ctx->page_start, epoch);
+        ASSERT(ret == 0);
+    }
+#endif
+
+    LOG("scheduler threads: %u\n", threads_len);
+
+    // the leader ring must exist before the workers attach to its io-wq
+    thread_ctx = &scheduler.threads[0];
+    thread_setup(thread_ctx);
+
+    pthread_t *workers = calloc(threads_len, sizeof(pthread_t));
+    ASSERT(workers);
+    for (__u32 i = 1; i < threads_len; i++)
+    {
+        ret = pthread_create(&workers[i], NULL, thread_main, &scheduler.threads[i]);
+        ASSERT(ret == 0);
+    }
+
+#ifdef ENABLE_WAL
+    appenders_start();
+#endif
+
+    thread_loop(thread_ctx);
+
+    for (__u32 i = 1; i < threads_len; i++)
+    {
+        ret = pthread_join(workers[i], NULL);
+        ASSERT(ret == 0);
+    }
+
+    double elapsed_s = bench_print(&start_time, &start_usage);
+#ifdef ENABLE_WAL
+    appenders_join(elapsed_s);
+#else
+    (void)elapsed_s;
+#endif
 
     return 0;
 }
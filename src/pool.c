@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <sys/mman.h>
+#include "utils.h"
+#include "pool.h"
+
+void pool_init(struct pool *pool, __u32 item_size, __u32 len)
+{
+    // free items are linked through their first bytes
+    pool->item_size = ALIGN(max(item_size, (__u32)sizeof(struct pool_item)), sizeof(void *));
+    pool->len = len;
+    pool->used = 0;
+    pool->high_water = 0;
+    pool->exhausted = 0;
+    pool->free_list = NULL;
+
+    // populate upfront so the hot path never takes a page fault
+    pool->buf = mmap(NULL, PAGE_ALIGN((__u64)pool->item_size * len), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    ASSERT(pool->buf != MAP_FAILED);
+
+    // push in reverse so the first gets hand out the items in memory order
+    for (__u32 i = len; i > 0; i--)
+    {
+        struct pool_item *item = pool->buf + (__u64)pool->item_size * (i - 1);
+        item->next = pool->free_list;
+        pool->free_list = item;
+    }
+}
+
+void *pool_get(struct pool *pool)
+{
+    struct pool_item *item = pool->free_list;
+    if (!item)
+    {
+        pool->exhausted++;
+        return NULL;
+    }
+
+    pool->free_list = item->next;
+    pool->used++;
+    if (pool->used > pool->high_water)
+        pool->high_water = pool->used;
+
+    return item;
+}
+
+void pool_put(struct pool *pool, void *buf)
+{
+    struct pool_item *item = buf;
+    ASSERT(buf >= pool->buf && buf < pool->buf + (__u64)pool->item_size * pool->len);
+    ASSERT(pool->used > 0);
+
+    item->next = pool->free_list;
+    pool->free_list = item;
+    pool->used--;
+}
+
+__u32 pool_free_count(struct pool *pool)
+{
+    return pool->len - pool->used;
+}
+
+int pool_is_empty(struct pool *pool)
+{
+    return pool->free_list == NULL;
+}
@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "utils.h"
+#include "scheduler.h"
+#include "wal.h"
+#include "recovery.h"
+
+#define RECOVERY_RING_ENTRIES (64)
+#define RECOVERY_CHUNK_SIZE ((__u64)RECOVERY_CHUNK_PAGES * WAL_PAGE_SIZE)
+#define RECOVERY_TREE_PATH_LEN (4096)
+
+// keys are split in equal ranges of their first 8 bytes read as a big endian number
+__u32 recovery_partition(__u8 *key, __u32 key_size, __u32 partitions)
+{
+    __u64 prefix = 0;
+    for (__u32 i = 0; i < sizeof(prefix); i++)
+        prefix = prefix << 8 | (i < key_size ? key[i] : 0);
+
+    return (__u32)(((unsigned __int128)prefix * partitions) >> 64);
+}
+
+static int recovery_read_done(struct op *op, struct io_uring_cqe *cqe)
+{
+    container_of_op(read, struct recovery_read, op);
+
+    read->res = cqe->res;
+    read->thread->inflight--;
+
+    return 0;
+}
+
+// completions of the tree pool on the same ring are dispatched as well
+static void recovery_wait(struct recovery_thread *thread)
+{
+    while (thread->inflight)
+    {
+        int ret = (int)io_tick(&thread->ring);
+        ASSERT(ret >= 0 || ret == -EINTR);
+    }
+}
+
+// large sequential reads of the next pages of the shard
+static void recovery_chunk_read(struct recovery_thread *thread, struct recovery_chunk *chunk)
+{
+    struct io_uring_sqe *sqe;
+
+    chunk->first_page = thread->next_page;
+    chunk->pages = (__u32)min((__u64)RECOVERY_CHUNK_PAGES, thread->page_end - thread->next_page);
+    chunk->valid = 0;
+
+    for (__u32 i = 0; i * RECOVERY_READ_PAGES < chunk->pages; i++)
+    {
+        struct recovery_read *read = &chunk->reads[i];
+        __u32 first = i * RECOVERY_READ_PAGES;
+        __u32 pages = min((__u32)RECOVERY_READ_PAGES, chunk->pages - first);
+
+        sqe = io_prepare_sqe_flags(&thread->ring, &read->inner, recovery_read_done, OP_FLAG_ERRORS);
+        ASSERT(sqe);
+        io_uring_prep_read(sqe, thread->recovery->fd, chunk->buf + (__u64)first * WAL_PAGE_SIZE,
+                           pages * WAL_PAGE_SIZE, (chunk->first_page + first) * WAL_PAGE_SIZE);
+
+        read->thread = thread;
+        read->res = 0;
+        thread->inflight++;
+    }
+
+    thread->next_page += chunk->pages;
+    io_uring_submit(&thread->ring);
+}
+
+// the log is valid up to the first torn, unwritten or older epoch page
+static void recovery_chunk_check(struct recovery_thread *thread, struct recovery_chunk *chunk)
+{
+    for (__u32 i = 0; i < chunk->pages; i++)
+    {
+        struct recovery_read *read = &chunk->reads[i / RECOVERY_READ_PAGES];
+        __u32 read_end = (i % RECOVERY_READ_PAGES + 1) * WAL_PAGE_SIZE;
+        if (read->res < 0 || (__u32)read->res < read_end)
+            break;
+
+        void *buf = chunk->buf + (__u64)i * WAL_PAGE_SIZE;
+        __u64 page_no = chunk->first_page + i - thread->page_start;
+        if (page_no == 0)
+            thread->epoch = wal_page_epoch(buf);
+
+        int records = thread->epoch ? wal_page_check(thread->epoch, buf, page_no) : -1;
+        if (records < 0)
+            break;
+
+        thread->records += records;
+        chunk->valid++;
+    }
+
+    thread->pages += chunk->valid;
+    if (chunk->valid < chunk->pages || thread->next_page == thread->page_end)
+        thread->ended = 1;
+}
+
+// apply the records of a checked chunk that fall in the partition of the thread.
+// chunks of a shard come in log order and a key is only logged by one shard,
+// so the writes of a key are applied in lsn order and the last one stays
+static int recovery_replay(struct recovery_thread *thread, struct recovery_chunk *chunk)
+{
+    __u32 partitions = thread->recovery->threads_len;
+
+    for (__u32 i = 0; i < chunk->valid; i++)
+    {
+        void *buf = chunk->buf + (__u64)i * WAL_PAGE_SIZE;
+        struct wal_page *page = buf;
+
+        for (__u32 off = sizeof(struct wal_page); off < page->used;)
+        {
+            struct wal_record *record = buf + off;
+            off += ALIGN((__u32)sizeof(*record) + record->len, WAL_RECORD_ALIGN);
+
+            // records without a tree payload have nothing to replay
+            struct wal_insert *insert = (struct wal_insert *)record->data;
+            if (record->len < sizeof(*insert) || record->len != sizeof(*insert) + insert->key_size + insert->value_size)
+                continue;
+            if (recovery_partition(insert->data, insert->key_size, partitions) != thread->idx)
+                continue;
+
+            // a key already in the tree, from an earlier record or a replay
+            // that did not finish, takes the value of this one
+            int ret = btree_upsert(&thread->btree, insert->data, insert->key_size,
+                                   insert->data + insert->key_size, insert->value_size);
+            if (ret < 0)
+                return ret;
+            thread->replayed++;
+        }
+    }
+
+    return 0;
+}
+
+static int recovery_tree_open(struct recovery_thread *thread)
+{
+    char path[RECOVERY_TREE_PATH_LEN];
+    int ret;
+
+    snprintf(path, sizeof(path), "%s.%u", thread->recovery->tree_path, thread->idx);
+    thread->tree_fd = open(path, O_DIRECT | O_RDWR | O_CREAT, 0644);
+    if (thread->tree_fd < 0 && errno == EINVAL)
+        thread->tree_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (thread->tree_fd < 0)
+        return -errno;
+
+    __u32 frames = max((__u32)BTREE_MIN_FRAMES, (__u32)(RECOVERY_TREE_BYTES / BUFFER_PAGE_SIZE / thread->recovery->threads_len));
+    ret = buffer_pool_init(&thread->pool, &thread->ring, thread->tree_fd, frames);
+    if (ret)
+        return ret;
+
+    return btree_open(&thread->btree, &thread->pool);
+}
+
+static void *recovery_thread_main(void *arg)
+{
+    struct recovery_thread *thread = arg;
+    struct recovery *recovery = thread->recovery;
+    int ret;
+
+    if (recovery->cpus)
+    {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(recovery->cpus[thread->idx], &cpu_set);
+        ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+        ASSERT(ret == 0);
+    }
+
+    ret = io_uring_queue_init(RECOVERY_RING_ENTRIES, &thread->ring, 0);
+    ASSERT(ret == 0);
+
+    for (__u32 i = 0; i < ARRAY_LEN(thread->chunks); i++)
+    {
+        thread->chunks[i].buf = mmap(NULL, RECOVERY_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        ASSERT(thread->chunks[i].buf != MAP_FAILED);
+    }
+
+    // a thread that failed keeps joining the barriers with nothing to read or replay
+    thread->err = recovery_tree_open(thread);
+    if (thread->err || thread->page_start == thread->page_end)
+        thread->ended = 1;
+    else
+        recovery_chunk_read(thread, &thread->chunks[0]);
+
+    // every round the threads check the chunk of their shard and read the next
+    // one, then each thread replays its key range out of the chunks of all shards
+    for (__u32 cur = 0;; cur ^= 1)
+    {
+        recovery_wait(thread);
+        recovery_chunk_check(thread, &thread->chunks[cur]);
+
+        struct recovery_chunk *next = &thread->chunks[cur ^ 1];
+        next->pages = next->valid = 0;
+        if (!thread->ended)
+            recovery_chunk_read(thread, next);
+
+        pthread_barrier_wait(&recovery->barrier);
+
+        int running = 0;
+        for (__u32 i = 0; i < recovery->threads_len; i++)
+        {
+            struct recovery_thread *shard = &recovery->threads[i];
+            running |= !shard->ended;
+            if (!thread->err)
+                thread->err = recovery_replay(thread, &shard->chunks[cur]);
+        }
+
+        // chunks are refilled only after everyone is done with them
+        pthread_barrier_wait(&recovery->barrier);
+
+        if (!running)
+            break;
+    }
+
+    if (!thread->err)
+        thread->err = btree_flush(&thread->btree);
+
+    if (thread->tree_fd >= 0)
+    {
+        buffer_pool_free(&thread->pool);
+        close(thread->tree_fd);
+    }
+    for (__u32 i = 0; i < ARRAY_LEN(thread->chunks); i++)
+        munmap(thread->chunks[i].buf, RECOVERY_CHUNK_SIZE);
+    io_uring_queue_exit(&thread->ring);
+
+    return NULL;
+}
+
+// scan the log of every shard and replay it into the tree partitions, one
+// thread per shard and partition
+int recovery_run(struct recovery *recovery)
+{
+    struct timespec start, end;
+    int ret, err = 0;
+
+    recovery->threads = calloc(recovery->threads_len, sizeof(struct recovery_thread));
+    if (!recovery->threads)
+        return -ENOMEM;
+
+    ret = pthread_barrier_init(&recovery->barrier, NULL, recovery->threads_len);
+    ASSERT(ret == 0);
+
+    ret = clock_gettime(CLOCK_MONOTONIC, &start);
+    ASSERT(!ret);
+
+    for (__u32 i = 0; i < recovery->threads_len; i++)
+    {
+        struct recovery_thread *thread = &recovery->threads[i];
+        thread->recovery = recovery;
+        thread->idx = i;
+        thread->tree_fd = -1;
+        thread->page_start = recovery->shard_start[i];
+        thread->page_end = recovery->shard_start[i + 1];
+        thread->next_page = thread->page_start;
+
+        ret = pthread_create(&thread->thread, NULL, recovery_thread_main, thread);
+        ASSERT(ret == 0);
+    }
+
+    recovery->pages = recovery->records = recovery->replayed = 0;
+    for (__u32 i = 0; i < recovery->threads_len; i++)
+    {
+        struct recovery_thread *thread = &recovery->threads[i];
+        ret = pthread_join(thread->thread, NULL);
+        ASSERT(ret == 0);
+
+        LOG("recovery thread %u: log pages: %llu records: %llu replayed: %llu err: %d\n",
+            i, thread->pages, thread->records, thread->replayed, thread->err);
+        recovery->pages += thread->pages;
+        recovery->records += thread->records;
+        recovery->replayed += thread->replayed;
+        if (thread->err && !err)
+            err = thread->err;
+    }
+
+    ret = clock_gettime(CLOCK_MONOTONIC, &end);
+    ASSERT(!ret);
+    recovery->elapsed_s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    pthread_barrier_destroy(&recovery->barrier);
+    free(recovery->threads);
+    recovery->threads = NULL;
+
+    return err;
+}
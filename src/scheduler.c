@@ -7,16 +7,29 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/mman.h>
 #include <liburing.h>
 #include "scheduler.h"
 #include "utils.h"
 #include "cbuf.h"
+#include "pool.h"
+#include "wal.h"
 #include "configure.h"
 
 #define BUF_BYTE ('a')
 
-static char write_buf[BUF_SIZE] = {BUF_BYTE};
-static char read_buf[BUF_SIZE] = {BUF_BYTE};
+// O_DIRECT and buffer registration both need page aligned memory
+// every page of write_buf holds the same content, filled by the leader
+static char write_buf[WRITE_BUF_LEN] __attribute__((aligned(PAGE_SZ)));
+static char read_buf[READ_BUF_LEN] __attribute__((aligned(PAGE_SZ)));
+
+struct scheduler scheduler;
+_Thread_local struct thread_context *thread_ctx;
+
+struct iovec fixed_bufs[FIXED_BUFS_LEN] = {
+    [FIXED_BUF_WRITE] = {.iov_base = write_buf, .iov_len = WRITE_BUF_LEN},
+    [FIXED_BUF_READ] = {.iov_base = read_buf, .iov_len = READ_BUF_LEN},
+};
 
 unsigned int io_tick(struct io_uring *ring)
 {
@@ -41,8 +54,8 @@ unsigned int io_tick(struct io_uring *ring)
     io_uring_for_each_cqe(ring, head, cqe)
     {
         op_flags = cqe->user_data >> (64 - 16);
-        ASSERT(op_flags == 0);
-        op = (struct op *)cqe->user_data;
+        ASSERT((op_flags & ~OP_FLAG_ERRORS) == 0);
+        op = (struct op *)(cqe->user_data & (((__u64)1 << (64 - 16)) - 1));
         ASSERT(op);
         // LOG("cqe_res = %d | func = %p\n", cqe->res, op->callback);
 
@@ -53,7 +66,7 @@ unsigned int io_tick(struct io_uring *ring)
                    op->callback == background_reader ||
                    op->callback == background_tracing);
 
-        if (cqe->res >= 0 || cqe->res == -ETIME)
+        if (cqe->res >= 0 || cqe->res == -ETIME || (op_flags & OP_FLAG_ERRORS))
         {
             op->callback(op, cqe);
         }
@@ -66,10 +79,21 @@ unsigned int io_tick(struct io_uring *ring)
     }
     io_uring_cq_advance(ring, count);
 
+#ifdef ENABLE_EVENT_REARM
+    // rings driven outside of a scheduler thread have no jobs
+    if (thread_ctx)
+        jobs_refill();
+#endif
+
     return count;
 }
 
 struct io_uring_sqe *io_prepare_sqe(struct io_uring *ring, struct op *op, op_callback_t callback)
+{
+    return io_prepare_sqe_flags(ring, op, callback, 0);
+}
+
+struct io_uring_sqe *io_prepare_sqe_flags(struct io_uring *ring, struct op *op, op_callback_t callback, __u16 op_flags)
 {
     struct io_uring_sqe *sqe;
     sqe = io_uring_get_sqe(ring);
@@ -78,67 +102,261 @@ struct io_uring_sqe *io_prepare_sqe(struct io_uring *ring, struct op *op, op_cal
 
     op->callback = callback;
 
-    __u16 op_flags = 0;
     __u64 user_data = ((__u64)op & (((__u64)1 << (64 - 16)) - 1)) | ((__u64)op_flags << (64 - 16));
     io_uring_sqe_set_data64(sqe, user_data);
 
     return sqe;
 }
 
-int page_written(struct op *base_op, struct io_uring_cqe *cqe)
+static void io_sqe_set_db_file(struct io_uring_sqe *sqe)
 {
-    (void)cqe;
-    container_of_op(op, struct op_page_write, base_op);
-    ASSERT(op);
-    ASSERT(op->page_id == page_id_check_order);
-    page_id_check_order++;
+#ifdef ENABLE_FIXED_FILES
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+#else
+    (void)sqe;
+#endif
+}
+
+void io_prep_db_write(struct io_uring_sqe *sqe, int fd, void *buf, __u32 len, __u64 offset)
+{
+#ifdef ENABLE_FIXED_BUFFERS
+    io_uring_prep_write_fixed(sqe, fd, buf, len, offset, FIXED_BUF_WRITE);
+#else
+    io_uring_prep_write(sqe, fd, buf, len, offset);
+#endif
+#if DURABILITY_MODE == DURABILITY_DSYNC_WRITE
+    sqe->rw_flags |= RWF_DSYNC;
+#endif
+    io_sqe_set_db_file(sqe);
+}
+
+void io_prep_db_read(struct io_uring_sqe *sqe, int fd, void *buf, __u32 len, __u64 offset)
+{
+#if defined(ENABLE_READ_BUF_RING)
+    // the kernel picks the buffer from the ring, buf is unused. buffer select
+    // has no fixed variant, the pages are mapped for every read
+    (void)buf;
+    io_uring_prep_read(sqe, fd, NULL, len, offset);
+    io_sqe_set_db_file(sqe);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = READ_BUF_GROUP;
+#else
+#ifdef ENABLE_FIXED_BUFFERS
+    io_uring_prep_read_fixed(sqe, fd, buf, len, offset, FIXED_BUF_READ);
+#else
+    io_uring_prep_read(sqe, fd, buf, len, offset);
+#endif
+    io_sqe_set_db_file(sqe);
+#endif
+}
+
+#ifdef ENABLE_READ_BUF_RING
+void read_buf_ring_init(void)
+{
+    int ret;
+
+    thread_ctx->read_bufs = mmap(NULL, (__u64)READ_BUF_RING_ENTRIES * READ_BUF_LEN, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+    ASSERT(thread_ctx->read_bufs != MAP_FAILED);
+
+    thread_ctx->read_buf_ring = io_uring_setup_buf_ring(&thread_ctx->ring, READ_BUF_RING_ENTRIES, READ_BUF_GROUP, 0, &ret);
+    ASSERT(thread_ctx->read_buf_ring);
+
+    int mask = io_uring_buf_ring_mask(READ_BUF_RING_ENTRIES);
+    for (__u32 bid = 0; bid < READ_BUF_RING_ENTRIES; bid++)
+        io_uring_buf_ring_add(thread_ctx->read_buf_ring, thread_ctx->read_bufs + (__u64)bid * READ_BUF_LEN, READ_BUF_LEN, bid, mask, bid);
+    io_uring_buf_ring_advance(thread_ctx->read_buf_ring, READ_BUF_RING_ENTRIES);
+    thread_ctx->read_bufs_free = READ_BUF_RING_ENTRIES;
+}
+
+// hand the buffer back to the kernel once the read has been consumed
+static void read_buf_recycle(__u16 bid)
+{
+    io_uring_buf_ring_add(thread_ctx->read_buf_ring, thread_ctx->read_bufs + (__u64)bid * READ_BUF_LEN, READ_BUF_LEN, bid, io_uring_buf_ring_mask(READ_BUF_RING_ENTRIES), 0);
+    io_uring_buf_ring_advance(thread_ctx->read_buf_ring, 1);
+    thread_ctx->read_bufs_free++;
+}
+#endif
+
+void io_prep_db_fsync(struct io_uring_sqe *sqe, int fd, __u32 flags)
+{
+    io_uring_prep_fsync(sqe, fd, flags);
+    io_sqe_set_db_file(sqe);
+}
 
+void io_prep_db_sync_file_range(struct io_uring_sqe *sqe, int fd, __u32 len, __u64 offset, int flags)
+{
+    io_uring_prep_sync_file_range(sqe, fd, len, offset, flags);
+    io_sqe_set_db_file(sqe);
+}
+
+static __u64 elapsed_since_us(struct timespec *issued)
+{
     struct timespec now;
     int ret = clock_gettime(CLOCK_REALTIME, &now);
     ASSERT(!ret);
 
-    struct page_write_node *list = &thread_ctx.flusher_job.write_list;
+    return (TIME_S(now.tv_sec - issued->tv_sec) + (now.tv_nsec - issued->tv_nsec)) / TIME_US(1);
+}
+
+// run the callbacks of every written page below page_id_end and release them
+static void pages_synced(__u32 page_id_end, __u64 sync_latency_us)
+{
+    struct flusher_job *flusher = &thread_ctx->flusher_job;
+
+    flusher->syncs++;
+    stats_bucket_add_one(&thread_ctx->stats.fsync_count);
+    histogram_window_record(&thread_ctx->stats.fsync_latency, sync_latency_us);
+
+    // a sync also covers pages a later sync has already committed
+    if (page_id_end <= flusher->page_id)
+        return;
+
+    struct op_page_write *node = flusher->write_list.tail;
+    struct op_page_write *next;
+    while (node && node->page_id < page_id_end)
+    {
+        if (node->user_fsync_callback)
+            node->user_fsync_callback(node);
+        next = node->next;
+        pool_put(&thread_ctx->page_write_pool, node);
+        node = next;
+    }
+    flusher->write_list.tail = node;
+    if (!node)
+        flusher->write_list.head = NULL;
+
+    thread_ctx->writer_job.written_no_flush -= page_id_end - flusher->page_id;
+    flusher->page_id = page_id_end;
+    // synced pages become readable
+    thread_ctx->reader_job.refill = 1;
+}
+
+#if DURABILITY_MODE == DURABILITY_SYNC_FILE_RANGE
+// start writeback of the pages written since the last hint, the fdatasync
+// of the flusher then finds less to do
+static void writeback_hint(void)
+{
+    struct flusher_job *flusher = &thread_ctx->flusher_job;
+    struct io_uring_sqe *sqe;
+
+    __u32 pages = thread_ctx->page_id_check_order - flusher->hint_page_id;
+    if (flusher->hint_inflight || pages < SYNC_FILE_RANGE_PAGES)
+        return;
+
+    sqe = io_prepare_sqe(&thread_ctx->ring, &flusher->op_hint, writeback_hinted);
+    if (!sqe)
+        return;
+    io_prep_db_sync_file_range(sqe, flusher->fd, pages * BUF_SIZE, (__u64)BUF_SIZE * flusher->hint_page_id, SYNC_FILE_RANGE_WRITE);
+    flusher->hint_page_id = thread_ctx->page_id_check_order;
+    flusher->hint_inflight = 1;
+}
+#endif
+
+int page_written(struct op *base_op, struct io_uring_cqe *cqe)
+{
+    container_of_op(op, struct op_page_write, base_op);
+    ASSERT(op);
+    ASSERT(cqe->res == (int)(op->pages * BUF_SIZE));
+
+    __u64 elapsed_us = elapsed_since_us(&op->issued);
+    __u32 pages = op->pages;
+
+    // fan the completion out to every page of the run
+    struct op_page_write *node = op;
+    struct op_page_write *last = NULL;
+    for (__u32 i = 0; i < pages; i++)
+    {
+        ASSERT(node->page_id == thread_ctx->page_id_check_order);
+        thread_ctx->page_id_check_order++;
+        histogram_window_record(&thread_ctx->stats.write_latency, elapsed_us);
+        controller_record(&thread_ctx->writer_job.ctl, elapsed_us);
+        last = node;
+        node = node->next;
+    }
+    ASSERT(!last->next);
+
+    struct page_write_node *list = &thread_ctx->flusher_job.write_list;
     if (!list->tail)
-        list->tail = list->head = op;
+    {
+        list->tail = op;
+        list->head = last;
+    }
     else
     {
         list->head->next = op;
-        list->head = op;
+        list->head = last;
     }
 
-    thread_ctx.writer_job.written_no_flush++;
-    thread_ctx.writer_job.inflight--;
-    stats_bucket_add_one(&background_write_count_stats);
+#ifdef ENABLE_WAL
+    // the log buffer of these pages can take new records
+    wal_pages_written(thread_ctx->wal, pages);
+#endif
+
+    thread_ctx->writer_job.written_no_flush += pages;
+    thread_ctx->writer_job.inflight -= pages;
+    thread_ctx->writer_job.refill = 1;
+    stats_bucket_add(&thread_ctx->stats.write_count, pages);
 
-    __u64 elapsed_us = (TIME_S(now.tv_sec - op->issued.tv_sec) + (now.tv_nsec - op->issued.tv_nsec)) / TIME_US(1);
-    stats_bucket_add(&background_write_latency_stats, elapsed_us);
+#if DURABILITY_MODE == DURABILITY_DSYNC_WRITE
+    // the write is its own sync
+    pages_synced(thread_ctx->page_id_check_order, elapsed_us);
+#elif DURABILITY_MODE == DURABILITY_SYNC_FILE_RANGE
+    writeback_hint();
+#endif
 
     return 0;
 }
 
 int page_read(struct op *base_op, struct io_uring_cqe *cqe)
 {
-    (void)cqe;
     container_of_op(op, struct op_page_read, base_op);
     ASSERT(op);
+    ASSERT(cqe->res == (int)(op->pages * BUF_SIZE));
 
-    struct timespec now;
-    int ret = clock_gettime(CLOCK_REALTIME, &now);
-    ASSERT(!ret);
+    __u64 elapsed_us = elapsed_since_us(&op->issued);
+    __u32 pages = op->pages;
+    char *buf;
 
-    ASSERT(memcmp(write_buf, op->buf, 8) == 0);
-    // ASSERT(memcmp(write_buf, op->buf, BUF_SIZE) == 0);
-
-    thread_ctx.reader_job.inflight--;
-    stats_bucket_add_one(&background_read_count_stats);
+#ifdef ENABLE_READ_BUF_RING
+    ASSERT(cqe->flags & IORING_CQE_F_BUFFER);
+    __u16 bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    buf = thread_ctx->read_bufs + (__u64)bid * READ_BUF_LEN;
+#else
+    buf = read_buf;
+#endif
 
-    __u64 elapsed_us = (TIME_S(now.tv_sec - op->issued.tv_sec) + (now.tv_nsec - op->issued.tv_nsec)) / TIME_US(1);
-    stats_bucket_add(&background_read_latency_stats, elapsed_us);
+    // fan the completion out to every page of the run
+    struct op_page_read *node = op;
+    struct op_page_read *next;
+    for (__u32 i = 0; i < pages; i++)
+    {
+        node->buf = buf + (__u64)i * BUF_SIZE;
+#if defined(ENABLE_READ_BUF_RING) && defined(ENABLE_WAL)
+        // log pages are checked record by record
+        ASSERT(wal_page_check(thread_ctx->wal->epoch, node->buf, node->page_id - thread_ctx->page_start) >= 0);
+#elif defined(ENABLE_READ_BUF_RING)
+        // every read owns its buffer, so the whole page can be checked
+        ASSERT(memcmp(write_buf, node->buf, BUF_SIZE) == 0);
+#elif defined(ENABLE_WAL)
+        ASSERT(*(__u64 *)node->buf == WAL_PAGE_MAGIC);
+#else
+        // concurrent reads share read_buf, only the first bytes are meaningful
+        ASSERT(memcmp(write_buf, node->buf, 8) == 0);
+#endif
+        histogram_window_record(&thread_ctx->stats.read_latency, elapsed_us);
+        controller_record(&thread_ctx->reader_job.ctl, elapsed_us);
+        next = node->next;
+        pool_put(&thread_ctx->page_read_pool, node);
+        node = next;
+    }
 
-    if (op->buf != read_buf)
-        free(op->buf);
+#ifdef ENABLE_READ_BUF_RING
+    read_buf_recycle(bid);
+#endif
 
-    free(op);
+    thread_ctx->reader_job.inflight -= pages;
+    thread_ctx->reader_job.refill = 1;
+    stats_bucket_add(&thread_ctx->stats.read_count, pages);
 
     return 0;
 }
@@ -150,11 +368,11 @@ int tracing_writed(struct op *base_op, struct io_uring_cqe *cqe)
 
     ASSERT(cqe->res >= 0);
     ASSERT((__u32)cqe->res == op->to_write);
-    cbuf_advance_head(&thread_ctx.tracing_job.cbuf, op->items);
+    cbuf_advance_head(&thread_ctx->tracing_job.cbuf, op->items);
 
     struct io_uring_sqe *sqe;
 
-    sqe = io_prepare_sqe(&thread_ctx.ring, &op->inner, tracing_synced);
+    sqe = io_prepare_sqe(&thread_ctx->ring, &op->inner, tracing_synced);
     ASSERT(sqe);
     io_uring_prep_fsync(sqe, op->fd, 0);
 
@@ -167,11 +385,11 @@ int tracing_synced(struct op *base_op, struct io_uring_cqe *cqe)
     container_of_op(op, struct tracing_dump_op, base_op);
     ASSERT(op);
 
-    thread_ctx.tracing_job.trace_synced += op->to_write;
+    thread_ctx->tracing_job.trace_synced += op->to_write;
     op->inflight = 0;
 
-    if (!thread_ctx.writer_job.inner.running && !thread_ctx.flusher_job.inner.running && !thread_ctx.reader_job.inner.running)
-        job_set_stopped(&thread_ctx.tracing_job.inner);
+    if (!thread_ctx->writer_job.inner.running && !thread_ctx->flusher_job.inner.running && !thread_ctx->reader_job.inner.running)
+        job_set_stopped(&thread_ctx->tracing_job.inner);
 
     return 0;
 }
@@ -181,88 +399,370 @@ int file_synced(struct op *base_op, struct io_uring_cqe *cqe)
     (void)cqe;
     container_of_op(op, struct op_file_synced, base_op);
     ASSERT(op);
-    container_of_job_op(job, struct tracing_job, base_op);
-    ASSERT(job);
 
-    struct timespec now;
-    int ret = clock_gettime(CLOCK_REALTIME, &now);
-    ASSERT(!ret);
+    thread_ctx->flusher_job.inflight = 0;
+    pages_synced(op->page_id_end, elapsed_since_us(&op->issued));
 
-    thread_ctx.flusher_job.page_id += thread_ctx.writer_job.written_no_flush;
-    thread_ctx.writer_job.written_no_flush = 0;
+    return 0;
+}
 
-    struct op_page_write *node = thread_ctx.flusher_job.write_list.tail;
-    struct op_page_write *next;
-    thread_ctx.flusher_job.write_list.tail = thread_ctx.flusher_job.write_list.head = NULL;
-    while (node)
+int chain_synced(struct op *base_op, struct io_uring_cqe *cqe)
+{
+    container_of_op(op, struct op_file_synced, base_op);
+    ASSERT(op);
+    struct flusher_job *flusher = &thread_ctx->flusher_job;
+    struct io_uring_sqe *sqe;
+
+    if (cqe->res < 0)
     {
-        if (node->user_fsync_callback)
-            node->user_fsync_callback();
-        next = node->next;
-        free(node);
-        node = next;
+        flusher->sync_errors++;
+        LOG("chain sync below page %u failed: %d - %s\n", op->page_id_end, -cqe->res, strerror(-cqe->res));
+
+        // a write of the chain failed and cancelled the fdatasync linked to
+        // it: sync the file again on its own, which still covers the pages
+        // written before
+        if (cqe->res == -ECANCELED)
+        {
+            sqe = io_prepare_sqe_flags(&thread_ctx->ring, &op->inner, chain_synced, OP_FLAG_ERRORS);
+            if (sqe)
+            {
+                io_prep_db_fsync(sqe, flusher->fd, IORING_FSYNC_DATASYNC);
+                return 0;
+            }
+        }
+
+        // the fdatasync itself failed: the chain is dropped without releasing
+        // its pages, the next chain that syncs releases them
+        op->failed = 1;
     }
-    thread_ctx.flusher_job.inflight = 0;
 
-    stats_bucket_add_one(&background_fsync_count_stats);
-    __u64 elapsed_us = (TIME_S(now.tv_sec - op->issued.tv_sec) + (now.tv_nsec - op->issued.tv_nsec)) / TIME_US(1);
-    stats_bucket_add(&background_fsync_latency_stats, elapsed_us);
+    op->done = 1;
+    op->latency_us = elapsed_since_us(&op->issued);
+
+    // separate chains complete in any order, an fsync only makes its own
+    // chain durable: pages are released over the completed chains in front
+    while (flusher->chain_first && flusher->chain_first->done)
+    {
+        struct op_file_synced *chain = flusher->chain_first;
+        flusher->chain_first = chain->next;
+        if (!chain->next)
+            flusher->chain_last = NULL;
+
+        if (!chain->failed)
+            pages_synced(chain->page_id_end, chain->latency_us);
+        pool_put(&thread_ctx->fsync_pool, chain);
+    }
 
     return 0;
 }
 
-int background_reader(struct op *base_op, struct io_uring_cqe *cqe)
+int writeback_hinted(struct op *base_op, struct io_uring_cqe *cqe)
 {
+    (void)base_op;
     (void)cqe;
-    container_of_job_op(op, struct reader_job, base_op);
-    ASSERT(op);
+    thread_ctx->flusher_job.hint_inflight = 0;
+
+    return 0;
+}
+
+static __u32 io_sq_space(struct io_uring *ring)
+{
+    __u32 space = io_uring_sq_space_left(ring);
+    return space > SQE_RESERVED ? space - SQE_RESERVED : 0;
+}
 
+__u32 reader_submit(struct reader_job *op, __u32 count)
+{
     struct io_uring_sqe *sqe;
-    struct op_page_read *op_page_read;
+    struct op_page_read *op_page_read, *first, *last;
     int ret;
 
-    if (op->inflight <= INFLIGHT_LOW_RANGE && op->batch_size < (ENTRIES >> 1))
+    // never read past the last page made durable (or written)
+    __u64 limit_page_id;
+#ifdef ENABLE_FLUSHER
+    limit_page_id = thread_ctx->flusher_job.page_id;
+#else
+    limit_page_id = thread_ctx->writer_job.page_id;
+#endif
+
+    count = min(count, limit_page_id - op->page_id);
+    count = min(count, io_sq_space(&thread_ctx->ring) * COALESCE_MAX_PAGES);
+#ifdef ENABLE_READ_BUF_RING
+    // a read without a free buffer would fail with ENOBUFS
+    count = min(count, thread_ctx->read_bufs_free * COALESCE_MAX_PAGES);
+#endif
+
+    __u32 submitted = 0;
+    while (submitted < count)
     {
-        if (op->inflight == 0 && op->batch_size > 0)
-            op->batch_size *= 2;
-        else
-            op->batch_size += max(1, op->batch_size * BATCH_INCREMENT_PERCENT / 100);
+        __u32 run = min(count - submitted, COALESCE_MAX_PAGES);
+
+        // adjacent pages share one sqe, the first op carries the run
+        first = last = NULL;
+        __u32 pages = 0;
+        for (; pages < run; pages++)
+        {
+            // on pool exhaustion stop here, the rest is picked up later
+            op_page_read = pool_get(&thread_ctx->page_read_pool);
+            if (!op_page_read)
+                break;
+            op_page_read->buf = NULL;
+            op_page_read->page_id = op->page_id + submitted + pages;
+            op_page_read->next = NULL;
+            op_page_read->pages = 0;
+            if (last)
+                last->next = op_page_read;
+            else
+                first = op_page_read;
+            last = op_page_read;
+        }
+        if (!pages)
+            break;
+
+        first->pages = pages;
+        ret = clock_gettime(CLOCK_REALTIME, &first->issued);
+        ASSERT(!ret);
+        sqe = io_prepare_sqe(&thread_ctx->ring, &first->inner, page_read);
+        ASSERT(sqe);
+        io_prep_db_read(sqe, op->fd, read_buf, pages * BUF_SIZE, (__u64)(BUF_SIZE) * ((__u64)first->page_id));
+        // LOG("read op: %p pages: %u\n", first, pages);
+        op->sqes++;
+        submitted += pages;
+#ifdef ENABLE_READ_BUF_RING
+        thread_ctx->read_bufs_free--;
+#endif
+
+        if (pages < run)
+            break;
     }
-    else if (op->batch_size > 0 && op->inflight >= INFLIGHT_HIGH_RANGE)
-        op->batch_size -= max(1, op->batch_size * BATCH_INCREMENT_PERCENT / 100);
 
-    // limit batch of read to the last page id written
-    __u64 limit_page_id;
-#ifdef ENABLE_FLUSHER
-    limit_page_id = thread_ctx.flusher_job.page_id;
+    op->inflight += submitted;
+    op->page_id += submitted;
+
+    return submitted;
+}
+
+#if DURABILITY_MODE == DURABILITY_LINKED
+// close the chain of writes before it with an fdatasync
+static void writer_chain_sync(struct writer_job *op, struct op_file_synced *chain, __u32 page_id_end)
+{
+    struct flusher_job *flusher = &thread_ctx->flusher_job;
+    struct io_uring_sqe *sqe;
+
+    chain->page_id_end = page_id_end;
+    chain->next = NULL;
+    chain->done = 0;
+    chain->failed = 0;
+    if (flusher->chain_last)
+        flusher->chain_last->next = chain;
+    else
+        flusher->chain_first = chain;
+    flusher->chain_last = chain;
+
+    // a failed write cancels the fdatasync, the callback has to see that
+    sqe = io_prepare_sqe_flags(&thread_ctx->ring, &chain->inner, chain_synced, OP_FLAG_ERRORS);
+    ASSERT(sqe);
+    io_prep_db_fsync(sqe, op->fd, IORING_FSYNC_DATASYNC);
+}
+#endif
+
+__u32 writer_submit(struct writer_job *op, __u32 count)
+{
+    struct io_uring_sqe *sqe;
+    struct op_page_write *op_page_write, *first, *last;
+    int ret;
+
+    // never write past the end of this thread shard
+    count = min(count, thread_ctx->page_end - op->page_id);
+#if DURABILITY_MODE == DURABILITY_LINKED
+    struct op_file_synced *chain = NULL;
+    __u32 chained = 0;
+    // every chain of writes ends with its fsync
+    __u32 chain_sqes = (LINKED_COMMIT_PAGES + COALESCE_MAX_PAGES - 1) / COALESCE_MAX_PAGES + 1;
+    count = min(count, io_sq_space(&thread_ctx->ring) / chain_sqes * LINKED_COMMIT_PAGES);
 #else
-    limit_page_id = context.writer_job.page_id;
+    count = min(count, io_sq_space(&thread_ctx->ring) * COALESCE_MAX_PAGES);
 #endif
 
-    op->batch_size = min(op->batch_size, limit_page_id - op->page_id);
+#ifdef ENABLE_WAL
+    struct wal *wal = thread_ctx->wal;
+    // group commit: the open page is only sealed once the previous writes
+    // and sync are done, the records appended meanwhile share the next ones
+    if (!op->inflight && !thread_ctx->flusher_job.inflight && !wal_pages_ready(wal, 1))
+        wal_seal(wal);
+    count = wal_pages_ready(wal, count);
+#endif
 
-    for (__u32 i = 0; i < op->batch_size; i++)
+    __u32 submitted = 0;
+    while (submitted < count)
     {
-        op_page_read = malloc(sizeof(struct op_page_read));
-        ASSERT(op_page_read);
-        // op_page_read->buf = malloc(BUF_SIZE);
-        op_page_read->buf = read_buf;
-        // ASSERT(op_page_read->buf);
-        op_page_read->page_id = op->page_id + i;
-        ret = clock_gettime(CLOCK_REALTIME, &op_page_read->issued);
+        __u32 run = min(count - submitted, COALESCE_MAX_PAGES);
+        char *buf = op->buf;
+#ifdef ENABLE_WAL
+        // runs are written from the log buffer and cannot wrap around it
+        __u64 page_no = op->page_id + submitted - thread_ctx->page_start;
+        buf = wal_page_buf(wal, page_no);
+        run = min(run, WAL_BUF_PAGES - page_no % WAL_BUF_PAGES);
+#endif
+#if DURABILITY_MODE == DURABILITY_LINKED
+        if (!chain)
+        {
+            chain = pool_get(&thread_ctx->fsync_pool);
+            if (!chain)
+                break;
+            ret = clock_gettime(CLOCK_REALTIME, &chain->issued);
+            ASSERT(!ret);
+            chained = 0;
+        }
+        run = min(run, LINKED_COMMIT_PAGES - chained);
+#endif
+
+        // adjacent pages share one sqe, the first op carries the run
+        first = last = NULL;
+        __u32 pages = 0;
+        for (; pages < run; pages++)
+        {
+            // on pool exhaustion stop here, the rest is picked up later
+            op_page_write = pool_get(&thread_ctx->page_write_pool);
+            if (!op_page_write)
+                break;
+            op_page_write->page_id = op->page_id + submitted + pages;
+            op_page_write->next = NULL;
+            op_page_write->user_fsync_callback = NULL;
+            op_page_write->user_data = NULL;
+#ifdef ENABLE_WAL
+            op_page_write->user_fsync_callback = wal_page_synced;
+            op_page_write->user_data = wal_page_submit(wal, page_no + pages);
+#endif
+            op_page_write->pages = 0;
+            if (last)
+                last->next = op_page_write;
+            else
+                first = op_page_write;
+            last = op_page_write;
+        }
+        if (!pages)
+            break;
+
+        first->pages = pages;
+        ret = clock_gettime(CLOCK_REALTIME, &first->issued);
         ASSERT(!ret);
-        sqe = io_prepare_sqe(&thread_ctx.ring, &op_page_read->inner, page_read);
+        sqe = io_prepare_sqe(&thread_ctx->ring, &first->inner, page_written);
         ASSERT(sqe);
-        io_uring_prep_read(sqe, op->fd, op_page_read->buf, BUF_SIZE, (__u64)(BUF_SIZE) * ((__u64)op_page_read->page_id));
-        // LOG("read op: %p\n", op_page_read);
+        io_prep_db_write(sqe, op->fd, buf, pages * BUF_SIZE, (__u64)(BUF_SIZE) * ((__u64)first->page_id));
+        // LOG("write op: %p pages: %u\n", first, pages);
+        op->sqes++;
+        submitted += pages;
+
+#if DURABILITY_MODE == DURABILITY_LINKED
+        sqe->flags |= IOSQE_IO_LINK;
+        chained += pages;
+        if (chained == LINKED_COMMIT_PAGES || submitted == count)
+        {
+            writer_chain_sync(op, chain, op->page_id + submitted);
+            chain = NULL;
+        }
+#endif
+
+        if (pages < run)
+            break;
     }
 
-    op->inflight += op->batch_size;
-    op->page_id += op->batch_size;
+#if DURABILITY_MODE == DURABILITY_LINKED
+    // the write pool ran out in the middle of a chain
+    if (chain && chained)
+        writer_chain_sync(op, chain, op->page_id + submitted);
+    else if (chain)
+        pool_put(&thread_ctx->fsync_pool, chain);
+#endif
+
+    op->inflight += submitted;
+    op->page_id += submitted;
+
+    return submitted;
+}
+
+#if DURABILITY_MODE != DURABILITY_DSYNC_WRITE && DURABILITY_MODE != DURABILITY_LINKED
+// one sync in flight at a time, covering every page written before it
+static void flusher_sync(struct flusher_job *op)
+{
+    struct io_uring_sqe *sqe;
+    int ret;
+
+    if (!thread_ctx->writer_job.written_no_flush || op->inflight)
+        return;
+
+    ret = clock_gettime(CLOCK_REALTIME, &op->op_fsync.issued);
+    ASSERT(!ret);
+    // only pages already written are covered by this fsync
+    op->op_fsync.page_id_end = thread_ctx->page_id_check_order;
+    sqe = io_prepare_sqe(&thread_ctx->ring, &op->op_fsync.inner, file_synced);
+    ASSERT(sqe);
+#if DURABILITY_MODE == DURABILITY_FSYNC
+    io_prep_db_fsync(sqe, op->fd, 0);
+#else
+    io_prep_db_fsync(sqe, op->fd, IORING_FSYNC_DATASYNC);
+#endif
+    op->inflight = 1;
+}
+#endif
+
+void jobs_refill(void)
+{
+    struct writer_job *writer = &thread_ctx->writer_job;
+    struct reader_job *reader = &thread_ctx->reader_job;
+
+#ifdef ENABLE_WAL
+#if DURABILITY_MODE != DURABILITY_DSYNC_WRITE && DURABILITY_MODE != DURABILITY_LINKED
+    // log writers wait on the sync, start the next one as soon as possible
+    if (thread_ctx->flusher_job.inner.running)
+        flusher_sync(&thread_ctx->flusher_job);
+#endif
+    // appenders fill pages without any completion to wake the writer
+    writer->refill = 1;
+#endif
+
+    // top the queues back up to the depth picked by the last timer tick
+    if (writer->refill && writer->inner.running && writer->inflight < writer->batch_size)
+        writer_submit(writer, writer->batch_size - writer->inflight);
+    writer->refill = 0;
+
+    if (reader->refill && reader->inner.running && reader->inflight < reader->batch_size)
+        reader_submit(reader, reader->batch_size - reader->inflight);
+    reader->refill = 0;
+}
+
+int background_reader(struct op *base_op, struct io_uring_cqe *cqe)
+{
+    (void)cqe;
+    container_of_job_op(op, struct reader_job, base_op);
+    ASSERT(op);
+
+    int ret;
+
+    op->batch_size = controller_update(&op->ctl, op->inflight);
 
-    if (op->page_id * BUF_SIZE < BYTES_TO_WRITE)
+    // limit batch of read to the last page id written
+    __u64 limit_page_id;
+#ifdef ENABLE_FLUSHER
+    limit_page_id = thread_ctx->flusher_job.page_id;
+#else
+    limit_page_id = thread_ctx->writer_job.page_id;
+#endif
+
+    op->batch_size = min(op->batch_size, limit_page_id - op->page_id);
+
+#ifdef ENABLE_EVENT_REARM
+    // batch size is the target queue depth, completions keep it topped up
+    if (op->inflight < op->batch_size)
+        reader_submit(op, op->batch_size - op->inflight);
+#else
+    reader_submit(op, op->batch_size);
+#endif
+
+    if (op->page_id < thread_ctx->page_end)
     {
-        ret = resend_job(&thread_ctx.ring, &op->inner);
+        ret = resend_job(&thread_ctx->ring, &op->inner);
         ASSERT(!ret);
     }
     else
@@ -280,40 +780,21 @@ int background_writer(struct op *base_op, struct io_uring_cqe *cqe)
     container_of_job_op(op, struct writer_job, base_op);
     ASSERT(op);
 
-    struct io_uring_sqe *sqe;
-    struct op_page_write *op_page_write;
     int ret;
 
-    if (op->inflight <= INFLIGHT_LOW_RANGE && op->batch_size < (ENTRIES >> 1))
-    {
-        if (op->inflight == 0 && op->batch_size > 0)
-            op->batch_size *= 2;
-        else
-            op->batch_size += max(1, op->batch_size * BATCH_INCREMENT_PERCENT / 100);
-    }
-    else if (op->batch_size > 0 && op->inflight >= INFLIGHT_HIGH_RANGE)
-        op->batch_size -= max(1, op->batch_size * BATCH_INCREMENT_PERCENT / 100);
+    op->batch_size = controller_update(&op->ctl, op->inflight);
 
-    for (__u64 i = 0; i < op->batch_size; i++)
-    {
-        op_page_write = malloc(sizeof(struct op_page_write));
-        ASSERT(op_page_write);
-        op_page_write->page_id = op->page_id + i;
-        op_page_write->next = NULL;
-        op_page_write->user_fsync_callback = NULL;
-        ret = clock_gettime(CLOCK_REALTIME, &op_page_write->issued);
-        ASSERT(!ret);
-        sqe = io_prepare_sqe(&thread_ctx.ring, &op_page_write->inner, page_written);
-        ASSERT(sqe);
-        io_uring_prep_write(sqe, op->fd, op->buf, BUF_SIZE, (__u64)(BUF_SIZE) * ((__u64)op_page_write->page_id));
-        // LOG("write op: %p\n", op_page_write);
-    }
-    op->inflight += op->batch_size;
-    op->page_id += op->batch_size;
+#ifdef ENABLE_EVENT_REARM
+    // batch size is the target queue depth, completions keep it topped up
+    if (op->inflight < op->batch_size)
+        writer_submit(op, op->batch_size - op->inflight);
+#else
+    writer_submit(op, op->batch_size);
+#endif
 
-    if (op->page_id * BUF_SIZE < BYTES_TO_WRITE)
+    if (op->page_id < thread_ctx->page_end)
     {
-        ret = resend_job(&thread_ctx.ring, &op->inner);
+        ret = resend_job(&thread_ctx->ring, &op->inner);
         ASSERT(!ret);
     }
     else
@@ -331,22 +812,17 @@ int background_flusher(struct op *base_op, struct io_uring_cqe *cqe)
     container_of_job_op(op, struct flusher_job, base_op);
     ASSERT(op);
 
-    struct io_uring_sqe *sqe;
     int ret;
 
-    if (thread_ctx.writer_job.written_no_flush && !op->inflight)
-    {
-        ret = clock_gettime(CLOCK_REALTIME, &op->op_fsync.issued);
-        ASSERT(!ret);
-        sqe = io_prepare_sqe(&thread_ctx.ring, &op->op_fsync.inner, file_synced);
-        ASSERT(sqe);
-        io_uring_prep_fsync(sqe, op->fd, 0);
-        op->inflight = 1;
-    }
+#if DURABILITY_MODE == DURABILITY_DSYNC_WRITE || DURABILITY_MODE == DURABILITY_LINKED
+    // pages are made durable by the writes themselves
+#else
+    flusher_sync(op);
+#endif
 
-    if (op->page_id * BUF_SIZE < BYTES_TO_WRITE)
+    if (op->page_id < thread_ctx->page_end)
     {
-        ret = resend_job(&thread_ctx.ring, &op->inner);
+        ret = resend_job(&thread_ctx->ring, &op->inner);
         ASSERT(!ret);
     }
     else
@@ -375,7 +851,7 @@ void dump_tracing_items(struct tracing_job *op)
         op->dump_op.to_write = to_write;
         op->dump_op.inflight = 1;
 
-        sqe = io_prepare_sqe(&thread_ctx.ring, &op->dump_op.inner, tracing_writed);
+        sqe = io_prepare_sqe(&thread_ctx->ring, &op->dump_op.inner, tracing_writed);
         ASSERT(sqe);
         io_uring_prep_write(sqe, op->dump_op.fd, buf, to_write, op->trace_synced);
     }
@@ -392,7 +868,7 @@ int background_tracing(struct op *base_op, struct io_uring_cqe *cqe)
     struct tracing_item *item;
     __u32 free_space = cbuf_put(&op->cbuf, (void **)&item);
 
-    int finished = !thread_ctx.writer_job.inner.running && !thread_ctx.flusher_job.inner.running && !thread_ctx.reader_job.inner.running;
+    int finished = !thread_ctx->writer_job.inner.running && !thread_ctx->flusher_job.inner.running && !thread_ctx->reader_job.inner.running;
 
     if (free_space && !finished)
     {
@@ -403,13 +879,19 @@ int background_tracing(struct op *base_op, struct io_uring_cqe *cqe)
         __u64 elapsed = (TIME_S(now.tv_sec) - op->start_time.tv_sec) + (now.tv_nsec - op->start_time.tv_nsec);
 
         item->ts = elapsed;
-        item->flush_page_id = thread_ctx.flusher_job.page_id;
-        item->write_page_id = thread_ctx.writer_job.page_id;
-        item->write_batch_size = thread_ctx.writer_job.batch_size;
-        item->write_inflight = thread_ctx.writer_job.inflight;
-        item->read_inflight = thread_ctx.reader_job.inflight;
-        item->read_batch_size = thread_ctx.reader_job.batch_size;
-        item->read_page_id = thread_ctx.reader_job.page_id;
+        item->flush_page_id = thread_ctx->flusher_job.page_id;
+        item->write_page_id = thread_ctx->writer_job.page_id;
+        item->write_batch_size = thread_ctx->writer_job.batch_size;
+        item->write_inflight = thread_ctx->writer_job.inflight;
+        item->read_inflight = thread_ctx->reader_job.inflight;
+        item->read_batch_size = thread_ctx->reader_job.batch_size;
+        item->read_page_id = thread_ctx->reader_job.page_id;
+        item->write_decision = thread_ctx->writer_job.ctl.decision;
+        item->write_observed_us = thread_ctx->writer_job.ctl.observed_us;
+        item->write_decisions = thread_ctx->writer_job.ctl.decisions;
+        item->read_decision = thread_ctx->reader_job.ctl.decision;
+        item->read_observed_us = thread_ctx->reader_job.ctl.observed_us;
+        item->read_decisions = thread_ctx->reader_job.ctl.decisions;
         cbuf_advance_tail(&op->cbuf, 1);
         op->trace_done++;
     }
@@ -419,7 +901,7 @@ int background_tracing(struct op *base_op, struct io_uring_cqe *cqe)
 
     if (!finished || op->dump_op.inflight)
     {
-        ret = resend_job(&thread_ctx.ring, &op->inner);
+        ret = resend_job(&thread_ctx->ring, &op->inner);
         ASSERT(!ret);
     }
     else
@@ -428,6 +910,151 @@ int background_tracing(struct op *base_op, struct io_uring_cqe *cqe)
     return 0;
 }
 
+static __u64 status_mbs(__u64 count, __u64 elapsed)
+{
+    return elapsed ? (BUF_SIZE * count) * TIME_S(1) / elapsed / BYTE_MB(1) : 0;
+}
+
+static void status_print_latency(char *name, struct histogram *histogram)
+{
+    struct histogram_percentiles p;
+    histogram_percentiles(histogram, &p);
+    printf("%s(%llu/%llu/%llu/%llu/%llu)", name, p.p50, p.p90, p.p99, p.p999, p.max);
+}
+
+static void status_report_send(void)
+{
+    struct status_report *report = &thread_ctx->report;
+    struct thread_stats *stats = &thread_ctx->stats;
+    struct io_uring_sqe *sqe;
+
+    // odd sequence while the snapshot is being rewritten
+    __atomic_store_n(&report->seq, report->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    report->thread_idx = thread_ctx->idx;
+    report->write_inflight = thread_ctx->writer_job.inflight;
+    report->read_inflight = thread_ctx->reader_job.inflight;
+    report->write_batch_size = thread_ctx->writer_job.batch_size;
+    report->read_batch_size = thread_ctx->reader_job.batch_size;
+    report->write_page_id = thread_ctx->writer_job.page_id;
+    report->read_page_id = thread_ctx->reader_job.page_id;
+    report->flush_page_id = thread_ctx->flusher_job.page_id;
+    report->write_count = stats->write_count.acc_val;
+    report->read_count = stats->read_count.acc_val;
+    report->fsync_count = stats->fsync_count.acc_val;
+    report->write_latency = stats->write_latency.acc;
+    report->read_latency = stats->read_latency.acc;
+    report->fsync_latency = stats->fsync_latency.acc;
+    report->write_elapsed = stats->write_count.acc_time;
+    report->read_elapsed = stats->read_count.acc_time;
+    report->write_pool_high_water = thread_ctx->page_write_pool.high_water;
+    report->read_pool_high_water = thread_ctx->page_read_pool.high_water;
+    report->write_pool_exhausted = thread_ctx->page_write_pool.exhausted;
+    report->read_pool_exhausted = thread_ctx->page_read_pool.exhausted;
+    report->write_sqes = thread_ctx->writer_job.sqes;
+    report->read_sqes = thread_ctx->reader_job.sqes;
+
+    __atomic_store_n(&report->seq, report->seq + 1, __ATOMIC_RELEASE);
+
+    sqe = io_prepare_sqe(&thread_ctx->ring, &report->inner, status_reported);
+    ASSERT(sqe);
+    io_uring_prep_msg_ring(sqe, scheduler.threads[0].ring.ring_fd, thread_ctx->idx, (__u64)&report->inner, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_CQE_SKIP_SUCCESS);
+}
+
+int status_reported(struct op *base_op, struct io_uring_cqe *cqe)
+{
+    container_of_op(report, struct status_report, base_op);
+    ASSERT(report);
+    ASSERT(thread_is_leader(thread_ctx));
+    ASSERT((__u32)cqe->res < scheduler.threads_len);
+
+    struct status_report copy;
+    __u32 seq = __atomic_load_n(&report->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return 0;
+
+    copy = *report;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    // rewritten while copying, the next report replaces it anyway
+    if (__atomic_load_n(&report->seq, __ATOMIC_RELAXED) != seq)
+        return 0;
+
+    scheduler.reports[cqe->res] = copy;
+
+    return 0;
+}
+
+void status_print(void)
+{
+    struct status_report total;
+    struct status_report *report;
+    __u64 r_mbs_speed = 0, w_mbs_speed = 0;
+
+    memset(&total, 0, sizeof(total));
+    for (__u32 i = 0; i < scheduler.threads_len; i++)
+    {
+        report = &scheduler.reports[i];
+        total.write_inflight += report->write_inflight;
+        total.read_inflight += report->read_inflight;
+        total.write_batch_size += report->write_batch_size;
+        total.read_batch_size += report->read_batch_size;
+        total.write_page_id += report->write_page_id - scheduler.threads[i].page_start;
+        total.read_page_id += report->read_page_id - scheduler.threads[i].page_start;
+        total.flush_page_id += report->flush_page_id - scheduler.threads[i].page_start;
+        total.write_count += report->write_count;
+        total.read_count += report->read_count;
+        total.fsync_count += report->fsync_count;
+        histogram_merge(&total.write_latency, &report->write_latency);
+        histogram_merge(&total.read_latency, &report->read_latency);
+        histogram_merge(&total.fsync_latency, &report->fsync_latency);
+        total.write_elapsed = max(total.write_elapsed, report->write_elapsed);
+        total.read_elapsed = max(total.read_elapsed, report->read_elapsed);
+        total.write_pool_high_water = max(total.write_pool_high_water, report->write_pool_high_water);
+        total.read_pool_high_water = max(total.read_pool_high_water, report->read_pool_high_water);
+        total.write_pool_exhausted += report->write_pool_exhausted;
+        total.read_pool_exhausted += report->read_pool_exhausted;
+        total.write_sqes += report->write_sqes;
+        total.read_sqes += report->read_sqes;
+        w_mbs_speed += status_mbs(report->write_count, report->write_elapsed);
+        r_mbs_speed += status_mbs(report->read_count, report->read_elapsed);
+    }
+
+    printf("\33[2K\r inflight:r(%.4u)/w(%.4u) | iops:r(%.5llu)/w(%.5llu) mb/s:r(%.4llu)/w(%.4llu) | batch:r(%.5u)/w(%.5u) | pid:r(%.7u)/w(%.7u)/f(%.7u) | pool hw:r(%.5u)/w(%.5u) exh:r(%.5llu)/w(%.5llu) | elapsed:r(%.5llu)/w(%.5llu) ms",
+           total.read_inflight, total.write_inflight,
+           total.read_count, total.write_count,
+           r_mbs_speed, w_mbs_speed,
+           total.read_batch_size, total.write_batch_size,
+           total.read_page_id, total.write_page_id, total.flush_page_id,
+           total.read_pool_high_water, total.write_pool_high_water,
+           total.read_pool_exhausted, total.write_pool_exhausted,
+           total.read_elapsed / TIME_MS(1), total.write_elapsed / TIME_MS(1));
+
+    // pages per sqe
+    printf(" | coalesce:r(%.2f)/w(%.2f)",
+           total.read_sqes ? (double)total.read_page_id / total.read_sqes : 0.0,
+           total.write_sqes ? (double)total.write_page_id / total.write_sqes : 0.0);
+
+    printf(" | lat p50/p90/p99/p999/max us:");
+    status_print_latency("r", &total.read_latency);
+    status_print_latency("/w", &total.write_latency);
+    status_print_latency("/f", &total.fsync_latency);
+
+    if (scheduler.threads_len > 1)
+    {
+        for (__u32 i = 0; i < scheduler.threads_len; i++)
+        {
+            report = &scheduler.reports[i];
+            printf(" | t%u mb/s:r(%.4llu)/w(%.4llu)", i,
+                   status_mbs(report->read_count, report->read_elapsed),
+                   status_mbs(report->write_count, report->write_elapsed));
+        }
+    }
+    fflush(stdout);
+}
+
 int background_status(struct op *base_op, struct io_uring_cqe *cqe)
 {
     (void)cqe;
@@ -444,103 +1071,109 @@ int background_status(struct op *base_op, struct io_uring_cqe *cqe)
     __u64 drift_ns = (TIME_S(now.tv_sec - op->last_time.tv_sec - op->inner.ts.tv_sec) + (now.tv_nsec - op->last_time.tv_nsec - op->inner.ts.tv_nsec));
     (void)drift_ns;
 
+    status_report_send();
+
 #ifdef ENABLE_STATUS
-    __u64 w_mbs_speed = background_write_count_stats.acc_time ? (BUF_SIZE * background_write_count_stats.acc_val) * TIME_S(1) / background_write_count_stats.acc_time / BYTE_MB(1) : 0;
-    __u64 r_mbs_speed = background_read_count_stats.acc_time ? (BUF_SIZE * background_read_count_stats.acc_val) * TIME_S(1) / background_read_count_stats.acc_time / BYTE_MB(1) : 0;
-    __u64 r_latency = background_read_count_stats.acc_val ? background_read_latency_stats.acc_val / background_read_count_stats.acc_val * TIME_US(1) / TIME_MS(1) : 0;
-    __u64 w_latency = background_write_count_stats.acc_val ? background_write_latency_stats.acc_val / background_write_count_stats.acc_val * TIME_US(1) / TIME_MS(1) : 0;
-    __u64 f_latency = background_fsync_count_stats.acc_val ? background_fsync_latency_stats.acc_val / background_fsync_count_stats.acc_val * TIME_US(1) / TIME_MS(1) : 0;
-
-    printf("\33[2K\r inflight:r(%.4u)/w(%.4u) | iops:r(%.5llu)/w(%.5llu) mb/s:r(%.4llu)/w(%.4llu) | batch:r(%.5u)/w(%.5u) | pid:r(%.7u)/w(%.7u)/f(%.7u) | lat:r(%.3llu)/w(%.3llu)/f(%.3llu)ms | elapsed:r(%.5llu)/w(%.5llu) ms",
-           thread_ctx.reader_job.inflight, thread_ctx.writer_job.inflight,
-           background_read_count_stats.acc_val, background_write_count_stats.acc_val,
-           r_mbs_speed, w_mbs_speed,
-           thread_ctx.reader_job.batch_size, thread_ctx.writer_job.batch_size,
-           thread_ctx.reader_job.page_id, thread_ctx.writer_job.page_id, thread_ctx.flusher_job.page_id,
-           r_latency, w_latency, f_latency,
-           background_read_count_stats.acc_time / TIME_MS(1), background_write_count_stats.acc_time / TIME_MS(1));
-    fflush(stdout);
+    if (thread_is_leader(thread_ctx))
+        status_print();
 #endif
 
-    stats_bucket_move(&background_write_count_stats, elapsed);
-    stats_bucket_move(&background_read_count_stats, elapsed);
-    stats_bucket_move(&background_write_latency_stats, elapsed);
-    stats_bucket_move(&background_read_latency_stats, elapsed);
-    stats_bucket_move(&background_fsync_latency_stats, elapsed);
-    stats_bucket_move(&background_fsync_count_stats, elapsed);
+    thread_stats_move(&thread_ctx->stats, elapsed);
     op->last_time = now;
 
-    ret = resend_job(&thread_ctx.ring, &op->inner);
+    ret = resend_job(&thread_ctx->ring, &op->inner);
     ASSERT(!ret);
     return 0;
 }
 
-void background_writer_init(int fd)
+void background_writer_init(int fd, __u32 page_start)
 {
-    thread_ctx.writer_job.buf = write_buf;
-    thread_ctx.writer_job.fd = fd;
-    thread_ctx.writer_job.page_id = 0;
-    thread_ctx.writer_job.inflight = 0;
-    thread_ctx.writer_job.written_no_flush = 0;
-    thread_ctx.writer_job.batch_size = 0;
-    thread_ctx.writer_job.write_done = 0;
-
-    init_job(&thread_ctx.writer_job.inner, WRITE_TIMEOUT_MS, 0, background_writer);
-    LOG("created writed job: %p\n", background_writer);
+    // workers are started after the leader setup, nobody reads write_buf yet
+    if (thread_is_leader(thread_ctx))
+        memset(write_buf, BUF_BYTE, WRITE_BUF_LEN);
+
+    thread_ctx->writer_job.buf = write_buf;
+    thread_ctx->writer_job.sqes = 0;
+    thread_ctx->writer_job.fd = fd;
+    thread_ctx->writer_job.page_id = page_start;
+    thread_ctx->writer_job.inflight = 0;
+    thread_ctx->writer_job.written_no_flush = 0;
+    thread_ctx->writer_job.batch_size = 0;
+    controller_init(&thread_ctx->writer_job.ctl, WRITE_CONTROLLER, ENTRIES >> 1, WRITE_TARGET_P99_US);
+    thread_ctx->writer_job.write_done = 0;
+    thread_ctx->writer_job.refill = 0;
+    pool_init(&thread_ctx->page_write_pool, sizeof(struct op_page_write), PAGE_WRITE_POOL_LEN);
+
+    init_job(&thread_ctx->writer_job.inner, WRITE_TIMEOUT_MS, 0, background_writer);
+    LOG("created writed job: %p controller: %s\n", background_writer, controller_name(WRITE_CONTROLLER));
 }
 
-void background_reader_init(int fd)
+void background_reader_init(int fd, __u32 page_start)
 {
-    thread_ctx.reader_job.fd = fd;
-    thread_ctx.reader_job.batch_size = 0;
-    thread_ctx.reader_job.inflight = 0;
-    thread_ctx.reader_job.page_id = 0;
-    thread_ctx.reader_job.read_done = 0;
-
-    init_job(&thread_ctx.reader_job.inner, READ_TIMEOUT_MS, 0, background_reader);
-    LOG("created reader job: %p\n", background_reader);
+    thread_ctx->reader_job.fd = fd;
+    thread_ctx->reader_job.batch_size = 0;
+    controller_init(&thread_ctx->reader_job.ctl, READ_CONTROLLER, ENTRIES >> 1, READ_TARGET_P99_US);
+    thread_ctx->reader_job.inflight = 0;
+    thread_ctx->reader_job.page_id = page_start;
+    thread_ctx->reader_job.read_done = 0;
+    thread_ctx->reader_job.sqes = 0;
+    thread_ctx->reader_job.refill = 0;
+    pool_init(&thread_ctx->page_read_pool, sizeof(struct op_page_read), PAGE_READ_POOL_LEN);
+
+    init_job(&thread_ctx->reader_job.inner, READ_TIMEOUT_MS, 0, background_reader);
+    LOG("created reader job: %p controller: %s\n", background_reader, controller_name(READ_CONTROLLER));
 }
 
-void background_flusher_init(int fd)
+void background_flusher_init(int fd, __u32 page_start)
 {
-    thread_ctx.flusher_job.fd = fd;
-    thread_ctx.flusher_job.page_id = 0;
-    thread_ctx.flusher_job.inflight = 0;
-    thread_ctx.flusher_job.write_list.head = thread_ctx.flusher_job.write_list.tail = NULL;
-    job_set_stopped(&thread_ctx.flusher_job.inner);
+    thread_ctx->flusher_job.fd = fd;
+    thread_ctx->flusher_job.page_id = page_start;
+    thread_ctx->flusher_job.inflight = 0;
+    thread_ctx->flusher_job.hint_page_id = page_start;
+    thread_ctx->flusher_job.hint_inflight = 0;
+    thread_ctx->flusher_job.write_list.head = thread_ctx->flusher_job.write_list.tail = NULL;
+    thread_ctx->flusher_job.chain_first = thread_ctx->flusher_job.chain_last = NULL;
+    thread_ctx->flusher_job.syncs = 0;
+    thread_ctx->flusher_job.sync_errors = 0;
+#if DURABILITY_MODE == DURABILITY_LINKED
+    pool_init(&thread_ctx->fsync_pool, sizeof(struct op_file_synced), FSYNC_POOL_LEN);
+#endif
+    job_set_stopped(&thread_ctx->flusher_job.inner);
 
-    init_job(&thread_ctx.flusher_job.inner, BACKGROUND_FLUSH_MS, 0, background_flusher);
+    init_job(&thread_ctx->flusher_job.inner, BACKGROUND_FLUSH_MS, 0, background_flusher);
     LOG("created flusher job: %p\n", background_flusher);
 }
 
-void background_tracing_init(void)
+void background_tracing_init(__u32 thread_idx)
 {
     int ret;
-    ret = clock_gettime(CLOCK_REALTIME, &thread_ctx.tracing_job.start_time);
+    ret = clock_gettime(CLOCK_REALTIME, &thread_ctx->tracing_job.start_time);
     ASSERT(!ret);
 
-    int fd = open("trace.dat", O_RDWR | O_CREAT, 0644);
+    char path[32];
+    snprintf(path, sizeof(path), "trace.%u.dat", thread_idx);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
     ASSERT(fd > 0);
 
     ASSERT(TRACING_BUF_LEN % 2 == 0);
-    cbuf_init(&thread_ctx.tracing_job.cbuf, sizeof(struct tracing_item), TRACING_BUF_LEN);
+    cbuf_init(&thread_ctx->tracing_job.cbuf, sizeof(struct tracing_item), TRACING_BUF_LEN);
 
-    thread_ctx.tracing_job.dump_op.fd = fd;
-    thread_ctx.tracing_job.dump_op.inflight = 0;
-    thread_ctx.tracing_job.trace_done = 0;
-    thread_ctx.tracing_job.trace_synced = 0;
+    thread_ctx->tracing_job.dump_op.fd = fd;
+    thread_ctx->tracing_job.dump_op.inflight = 0;
+    thread_ctx->tracing_job.trace_done = 0;
+    thread_ctx->tracing_job.trace_synced = 0;
 
-    init_job(&thread_ctx.tracing_job.inner, BACKGROUND_TRACING_MS, 0, background_tracing);
+    init_job(&thread_ctx->tracing_job.inner, BACKGROUND_TRACING_MS, 0, background_tracing);
     LOG("created tracing job: %p\n", background_tracing);
 }
 
 void background_status_init(void)
 {
     int ret;
-    ret = clock_gettime(CLOCK_REALTIME, &thread_ctx.status_job.last_time);
+    ret = clock_gettime(CLOCK_REALTIME, &thread_ctx->status_job.last_time);
     ASSERT(!ret);
 
-    init_job(&thread_ctx.status_job.inner, BACKGROUND_STATUS_MS, 0, background_status);
+    init_job(&thread_ctx->status_job.inner, BACKGROUND_STATUS_MS, 0, background_status);
     LOG("created status job: %p\n", background_status);
 }
 
@@ -590,6 +1223,26 @@ void stats_bucket_init(struct stats_bucket *bucket, __u32 len)
     // TODO: check calloc error
 }
 
+void thread_stats_init(struct thread_stats *stats, __u32 len)
+{
+    stats_bucket_init(&stats->write_count, len);
+    stats_bucket_init(&stats->read_count, len);
+    histogram_window_init(&stats->write_latency, len);
+    histogram_window_init(&stats->read_latency, len);
+    histogram_window_init(&stats->fsync_latency, len);
+    stats_bucket_init(&stats->fsync_count, len);
+}
+
+void thread_stats_move(struct thread_stats *stats, __u64 elapsed)
+{
+    stats_bucket_move(&stats->write_count, elapsed);
+    stats_bucket_move(&stats->read_count, elapsed);
+    histogram_window_move(&stats->write_latency);
+    histogram_window_move(&stats->read_latency);
+    histogram_window_move(&stats->fsync_latency);
+    stats_bucket_move(&stats->fsync_count, elapsed);
+}
+
 void stats_bucket_add_one(struct stats_bucket *bucket)
 {
     stats_bucket_add(bucket, 1);
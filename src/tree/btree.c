@@ -1,248 +1,1473 @@
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "utils.h"
 #include "tree/btree.h"
+#include "tree/buffer.h"
 #include "tree/cell.h"
 #include "tree/node.h"
 
-int btree_init(struct btree *btree)
+int btree_init(struct btree *btree, struct buffer_pool *pool)
 {
-    struct node *node = btree_node_alloc();
+    ASSERT(pool->len >= BTREE_MIN_FRAMES);
+
+    btree->pool = pool;
+    btree->count = 0;
+    btree->next_pid = BTREE_META_PID + 1;
+    btree->free_count = 0;
+    btree->free_pid = 0;
+    btree->root_latch.version = 0;
+    btree->tail_pid = 0;
+    btree->readers = 0;
+    pthread_mutex_init(&btree->free_lock, NULL);
+
+    struct btree_meta *meta = buffer_pool_new(pool, BTREE_META_PID);
+    if (!meta)
+        return -1;
+    buffer_pool_unpin(pool, meta, 1);
+
+    struct node *node = btree_node_new(btree);
     if (!node)
         return -1;
 
-    btree->count = 0;
-    btree->root = node;
-    node_init(btree->root, BTREE_NODE_FLAGS_ROOT | BTREE_NODE_FLAGS_LEAF);
-    return 0;
+    node_init(node, BTREE_NODE_FLAGS_ROOT | BTREE_NODE_FLAGS_LEAF);
+    btree->root_pid = btree_node_pid(btree, node);
+    btree_node_release(btree, node, 1);
+
+    return btree_flush(btree);
 }
 
-struct cell_ptr *btree_search(struct btree *btree, __u8 *key, __u32 key_size)
+int btree_open(struct btree *btree, struct buffer_pool *pool)
 {
-    struct cell_ptr *tuple_hdr = node_get_cell(btree->root, key, key_size);
-    if (!tuple_hdr)
-        return NULL;
+    struct stat st;
+    if (fstat(pool->fd, &st))
+        return -1;
+
+    // empty file: start a new tree
+    if (st.st_size == 0)
+        return btree_init(btree, pool);
+
+    ASSERT(pool->len >= BTREE_MIN_FRAMES);
 
-    return NULL;
+    struct btree_meta *meta = buffer_pool_fetch(pool, BTREE_META_PID);
+    if (!meta)
+        return -1;
+
+    int ret = 0;
+    if (meta->magic != BTREE_MAGIC || meta->node_size != NODE_SIZE)
+    {
+        LOG("btree: bad meta page (magic %llx, node size %u)\n", meta->magic, meta->node_size);
+        ret = -1;
+    }
+    else
+    {
+        btree->pool = pool;
+        btree->root_pid = meta->root_pid;
+        btree->next_pid = meta->next_pid;
+        btree->count = meta->count;
+        btree->free_count = meta->free_count;
+        btree->free_pid = meta->free_pid;
+        btree->root_latch.version = 0;
+        btree->tail_pid = 0;
+        btree->readers = 0;
+        pthread_mutex_init(&btree->free_lock, NULL);
+    }
+    buffer_pool_unpin(pool, meta, 0);
+
+    return ret;
 }
 
-struct node_breadcrumb
+int btree_flush(struct btree *btree)
 {
+    struct btree_meta *meta = buffer_pool_fetch(btree->pool, BTREE_META_PID);
+    if (!meta)
+        return -1;
+
+    meta->magic = BTREE_MAGIC;
+    meta->node_size = NODE_SIZE;
+    meta->root_pid = btree->root_pid;
+    meta->next_pid = btree->next_pid;
+    meta->count = btree->count;
+    meta->free_count = btree->free_count;
+    meta->free_pid = btree->free_pid;
+    buffer_pool_unpin(btree->pool, meta, 1);
+
+    return buffer_pool_flush(btree->pool);
+}
+
+// nodes of an optimistic descent with the versions they were read at: nothing
+// read from them is trusted before latch_validate, they are written only once
+// latch_upgrade took the latch at that version
+struct btree_descent
+{
+    struct node *parent;
     struct node *node;
-    struct node *new_node;
-    struct node *f_node;
-    __u32 partition_idx;
-    __u8 is_full;
+    __u64 parent_pid;
+    __u64 pid;
+    __u64 root_version;
+    __u64 parent_version;
+    __u64 version;
+    // slot of parent followed to node
+    __u32 pos;
+    // only rightmost children were followed
+    int right_edge;
 };
 
-int btree_insert(struct btree *btree, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size)
+// stop_pid of a descent to the first node to rebalance on the path: a non-root
+// node under BTREE_UNDERFLOW_BYTES or a root left with a single child
+#define BTREE_STOP_UNDERFLOW (~0ull)
+
+static struct latch *btree_latch(struct btree *btree, struct node *node)
 {
-    int ret;
-    struct node_breadcrumb breadcrumbs[16];
-    struct node *node = btree->root;
-    __s16 bc_len = 0;
-    breadcrumbs[bc_len].node = node;
-    bc_len++;
+    return buffer_pool_latch(btree->pool, node);
+}
 
-    while (!node_is_leaf(node))
+// the page of pid with the version to validate reads against, without a pin: a
+// page the pool does not hold is read in first. NULL if it could not be read
+static struct node *btree_node_optimistic(struct btree *btree, __u64 pid, __u64 *version)
+{
+    struct node *node = buffer_pool_optimistic(btree->pool, pid, version);
+    if (node)
+        return node;
+
+    node = btree_node_fetch(btree, pid);
+    if (!node)
+        return NULL;
+    *version = latch_read(btree_latch(btree, node));
+    btree_node_release(btree, node, 0);
+
+    return node;
+}
+
+// a torn read of a node being written may see any slot, the child it gives is
+// never followed as the version check fails
+static __u64 btree_child_at(struct node *node, __u32 pos)
+{
+    if (pos >= node->size)
+        return node->rightmost_pid;
+
+    struct cell_ptr *cell_ptr = node_get_cell_ptr(node, pos);
+    if (cell_ptr->offset >= NODE_SIZE)
+        return 0;
+
+    return internal_cell_child(node_cell_from_ptr(node, cell_ptr));
+}
+
+static void btree_child_set(struct node *node, __u32 pos, __u64 child_pid)
+{
+    if (pos < node->size)
+        node_cell_from_idx(node, pos)->pid = child_pid;
+    else
+        node_set_rightmost_child(node, child_pid);
+}
+
+// optimistic descent to the leaf holding key, or to the first or last leaf
+// without a key, stopping early at page stop_pid. a child pid is followed only
+// once its node validates, and the node validates again after the child
+// version is taken: the child was its child at that version.
+// 0 at the stop, 1 if a writer got in the way and the descent has to restart,
+// -1 if a page could not be read
+static int btree_descend(struct btree *btree, __u8 *key, __u32 key_size, int last, __u64 stop_pid, struct btree_descent *d)
+{
+    d->root_version = latch_read(&btree->root_latch);
+    d->parent = NULL;
+    d->parent_pid = 0;
+    d->parent_version = 0;
+    d->pos = 0;
+    d->right_edge = 1;
+    d->pid = __atomic_load_n(&btree->root_pid, __ATOMIC_RELAXED);
+    d->node = btree_node_optimistic(btree, d->pid, &d->version);
+    if (!d->node)
+        return -1;
+    if (!latch_validate(&btree->root_latch, d->root_version))
+        return 1;
+
+    while (d->pid != stop_pid)
     {
-        __u32 idx;
-        ret = node_bin_search(node, key, key_size, &idx);
-        if (ret) {
-            LOG("key %.*s already exists\n", key_size, key);
+        struct latch *latch = btree_latch(btree, d->node);
+
+        if (stop_pid == BTREE_STOP_UNDERFLOW && (d->parent ? node_live_bytes(d->node) < BTREE_UNDERFLOW_BYTES : !node_is_leaf(d->node) && !d->node->size))
+            break;
+        if (node_is_leaf(d->node))
+            break;
+
+        // separators may outlive their keys, only the leaf tells if the key exists
+        __u32 pos;
+        if (!key)
+            pos = last ? d->node->size : 0;
+        else if (node_bin_search(d->node, key, key_size, &pos))
+            pos++;
+
+        __u64 child_pid = btree_child_at(d->node, pos);
+        int rightmost = pos >= d->node->size;
+        if (!latch_validate(latch, d->version))
             return 1;
+
+        __u64 child_version;
+        struct node *child = btree_node_optimistic(btree, child_pid, &child_version);
+        if (!child)
+            return -1;
+        if (!latch_validate(latch, d->version))
+            return 1;
+
+        d->parent = d->node;
+        d->parent_pid = d->pid;
+        d->parent_version = d->version;
+        d->pos = pos;
+        d->right_edge &= rightmost;
+        d->node = child;
+        d->pid = child_pid;
+        d->version = child_version;
+    }
+
+    return 0;
+}
+
+// the leaf holding key, or the first or last leaf without a key, pinned once
+// the descent is checked against it
+static struct node *btree_leaf_fetch(struct btree *btree, __u8 *key, __u32 key_size, int last)
+{
+    struct btree_descent d;
+
+    for (;;)
+    {
+        int ret = btree_descend(btree, key, key_size, last, 0, &d);
+        if (ret < 0)
+            return NULL;
+        if (ret)
+            continue;
+
+        struct node *node = btree_node_fetch(btree, d.pid);
+        if (!node)
+            return NULL;
+        if (node == d.node && latch_validate(btree_latch(btree, node), d.version))
+            return node;
+        btree_node_release(btree, node, 0);
+    }
+}
+
+// cursors and btree_search hand out pointers into pinned leaves that are
+// never validated, they count themselves so that writers can assert they
+// have the tree to themselves
+static void btree_reader_pin(struct btree *btree)
+{
+    __atomic_add_fetch(&btree->readers, 1, __ATOMIC_RELAXED);
+}
+
+static void btree_reader_unpin(struct btree *btree)
+{
+    __atomic_sub_fetch(&btree->readers, 1, __ATOMIC_RELAXED);
+}
+
+static void btree_writer_check(struct btree *btree)
+{
+    ASSERT(!__atomic_load_n(&btree->readers, __ATOMIC_RELAXED));
+}
+
+int btree_search(struct btree *btree, __u8 *key, __u32 key_size, struct cell_pointers *pointers)
+{
+    struct node *node = btree_leaf_fetch(btree, key, key_size, 0);
+    if (!node)
+        return -1;
+
+    struct cell_ptr *cell_ptr = node_get_cell(node, key, key_size);
+    if (!cell_ptr)
+    {
+        btree_node_release(btree, node, 0);
+        return 1;
+    }
+
+    // the leaf stays pinned until btree_search_release
+    node_cell_pointers(node, cell_ptr, pointers);
+    btree_reader_pin(btree);
+    return 0;
+}
+
+void btree_search_release(struct btree *btree, struct cell_pointers *pointers)
+{
+    // any pointer into the page finds its frame
+    buffer_pool_unpin(btree->pool, pointers->key, 0);
+    btree_reader_unpin(btree);
+}
+
+static __u32 btree_overflow_pages(__u32 value_size)
+{
+    return (value_size - NODE_OVERFLOW_PREFIX + NODE_OVERFLOW_DATA - 1) / NODE_OVERFLOW_DATA;
+}
+
+// the value past its prefix goes to fresh pages contiguous in the file, written
+// with a single request. inline_value gets the prefix and the suffix to them
+static int btree_overflow_write(struct btree *btree, __u8 *value, __u32 value_size, __u8 *inline_value)
+{
+    __u32 pages = btree_overflow_pages(value_size);
+    void *buf = aligned_alloc(BUFFER_PAGE_SIZE, (__u64)pages * BUFFER_PAGE_SIZE);
+    if (!buf)
+        return -1;
+
+    __u64 pid = __atomic_fetch_add(&btree->next_pid, pages, __ATOMIC_RELAXED);
+    __u8 *data = value + NODE_OVERFLOW_PREFIX;
+    __u32 rest = value_size - NODE_OVERFLOW_PREFIX;
+    for (__u32 i = 0; i < pages; i++)
+    {
+        struct overflow_node *page = buf + (__u64)i * BUFFER_PAGE_SIZE;
+        __u32 len = min(rest, (__u32)NODE_OVERFLOW_DATA);
+
+        memset(page, 0, BUFFER_PAGE_SIZE);
+        page->next_overflow_pid = i + 1 < pages ? pid + i + 1 : 0;
+        page->next_free_offset = sizeof(*page) + len;
+        page->flags = BTREE_NODE_FLAGS_OVERFLOW;
+        memcpy((__u8 *)page + sizeof(*page), data, len);
+        data += len;
+        rest -= len;
+    }
+
+    // pages lost to a failed write stay a hole in the file
+    int ret = buffer_pool_extent_io(btree->pool, pid, buf, pages, 1);
+    free(buf);
+    if (ret)
+        return -1;
+
+    struct btree_overflowed_cell_suffix suffix = {
+        .overflow_pid = pid,
+        .offset = sizeof(struct overflow_node),
+    };
+    memcpy(inline_value, value, NODE_OVERFLOW_PREFIX);
+    memcpy(inline_value + NODE_OVERFLOW_PREFIX, &suffix, sizeof(suffix));
+
+    return 0;
+}
+
+// the pages of a value no cell points to any more go to the free list, after
+// the leaf latch it left under was released: readers of the chain fail their
+// check of the leaf. they are written free with a single request and no frame,
+// only a failed write leaves them a hole in the file
+static void btree_overflow_free(struct btree *btree, __u64 pid, __u32 value_size)
+{
+    __u32 pages = btree_overflow_pages(value_size);
+    void *buf = aligned_alloc(BUFFER_PAGE_SIZE, (__u64)pages * BUFFER_PAGE_SIZE);
+    if (!buf)
+    {
+        LOG("btree: overflow pages %llu+%u lost, no buffer\n", pid, pages);
+        return;
+    }
+
+    pthread_mutex_lock(&btree->free_lock);
+    for (__u32 i = 0; i < pages; i++)
+    {
+        struct node *node = buf + (__u64)i * BUFFER_PAGE_SIZE;
+        memset(node, 0, BUFFER_PAGE_SIZE);
+        node_init(node, BTREE_NODE_FLAGS_FREE);
+        node->next_leaf_pid = i + 1 < pages ? pid + i + 1 : btree->free_pid;
+    }
+
+    int ret = buffer_pool_extent_io(btree->pool, pid, buf, pages, 1);
+    if (!ret)
+    {
+        btree->free_pid = pid;
+        btree->free_count += pages;
+    }
+    pthread_mutex_unlock(&btree->free_lock);
+    free(buf);
+
+    if (ret)
+        LOG("btree: overflow pages %llu+%u lost: %d\n", pid, pages, ret);
+}
+
+// chain of the overflowed leaf cell at idx, 0 for an inline value
+static __u64 btree_overflow_pid(struct node *node, __u32 idx, __u32 *value_size)
+{
+    struct cell_pointers pointers;
+    node_cell_pointers(node, node_get_cell_ptr(node, idx), &pointers);
+    *value_size = pointers.value_size;
+    return pointers.overflow_pid;
+}
+
+int btree_value_read(struct btree *btree, struct cell_pointers *pointers, __u8 *buf)
+{
+    if (!pointers->overflow_pid)
+    {
+        memcpy(buf, pointers->value, pointers->value_size);
+        return 0;
+    }
+
+    __u32 pages = btree_overflow_pages(pointers->value_size);
+    void *extent = aligned_alloc(BUFFER_PAGE_SIZE, (__u64)pages * BUFFER_PAGE_SIZE);
+    if (!extent)
+        return -1;
+
+    // a page of a freed chain reused as a node is in the pool
+    int ret = buffer_pool_extent_io(btree->pool, pointers->overflow_pid, extent, pages, 0);
+    if (ret)
+    {
+        free(extent);
+        return ret < 0 ? -1 : 1;
+    }
+
+    memcpy(buf, pointers->value, NODE_OVERFLOW_PREFIX);
+    __u8 *data = buf + NODE_OVERFLOW_PREFIX;
+    __u32 rest = pointers->value_size - NODE_OVERFLOW_PREFIX;
+    for (__u32 i = 0; i < pages; i++)
+    {
+        struct overflow_node *page = extent + (__u64)i * BUFFER_PAGE_SIZE;
+        __u32 len = page->next_free_offset - sizeof(*page);
+
+        // freed and reused under btree_get, which reads the chain unlatched
+        if (!(page->flags & BTREE_NODE_FLAGS_OVERFLOW) || page->next_overflow_pid != (i + 1 < pages ? pointers->overflow_pid + i + 1 : 0) ||
+            page->next_free_offset < sizeof(*page) || len > rest)
+        {
+            ret = 1;
+            break;
         }
-        ASSERT(idx >= 0);
 
-        if (idx < node->size)
+        memcpy(data, (__u8 *)page + sizeof(*page), len);
+        data += len;
+        rest -= len;
+    }
+    free(extent);
+
+    return ret || rest ? 1 : 0;
+}
+
+int btree_get(struct btree *btree, __u8 *key, __u32 key_size, __u8 *buf, __u32 buf_size, __u32 *value_size)
+{
+    struct btree_descent d;
+    struct cell_pointers pointers;
+    __u8 inline_value[NODE_OVERFLOW_INLINE];
+
+    for (;;)
+    {
+        int ret = btree_descend(btree, key, key_size, 0, 0, &d);
+        if (ret < 0)
+            return -1;
+        if (ret)
+            continue;
+
+        struct latch *latch = btree_latch(btree, d.node);
+        __u32 idx;
+        int found = node_bin_search(d.node, key, key_size, &idx);
+        if (!latch_validate(latch, d.version))
+            continue;
+        if (!found)
+            return 1;
+
+        // the header is copied and checked before anything is read through
+        // it: a writer may have moved the cell since
+        struct cell_ptr slot = *node_get_cell_ptr(d.node, idx);
+        if (slot.offset > NODE_SIZE - sizeof(struct cell))
+            continue;
+        struct cell *cell = node_cell_from_offset(d.node, slot.offset);
+        struct cell header = *cell;
+        if (!latch_validate(latch, d.version))
+            continue;
+
+        __u8 *value = cell->content + header.key_size;
+        *value_size = header.value_size;
+        if (header.value_size > buf_size)
+            return 0;
+        if (!(header.flags & CELL_FLAG_OVERFLOW))
         {
-            node = internal_cell_child(node_cell_from_idx(node, idx));
+            memcpy(buf, value, header.value_size);
+            if (!latch_validate(latch, d.version))
+                continue;
+            return 0;
         }
-        else
+
+        // overflow pages are never written again, only the inline part can change
+        memcpy(inline_value, value, sizeof(inline_value));
+        if (!latch_validate(latch, d.version))
+            continue;
+
+        struct btree_overflowed_cell_suffix suffix;
+        memcpy(&suffix, inline_value + NODE_OVERFLOW_PREFIX, sizeof(suffix));
+        pointers.value = inline_value;
+        pointers.value_size = header.value_size;
+        pointers.overflow_pid = suffix.overflow_pid;
+
+        // the chain is freed once its cell left the leaf, the leaf version
+        // tells if what was read is still the value
+        ret = btree_value_read(btree, &pointers, buf);
+        if (ret < 0)
+            return -1;
+        if (!latch_validate(latch, d.version))
+            continue;
+        ASSERT(!ret);
+        return 0;
+    }
+}
+
+// a page of the free list or a fresh one, latched: readers that still find a
+// reused page fail until the caller has built and linked it
+static struct node *__btree_node_new(struct btree *btree)
+{
+    struct node *node;
+
+    pthread_mutex_lock(&btree->free_lock);
+    if (btree->free_pid)
+    {
+        node = btree_node_fetch(btree, btree->free_pid);
+        if (!node)
         {
-            ASSERT(node->rightmost_pid);
-            node = (struct node *)node->rightmost_pid;
+            pthread_mutex_unlock(&btree->free_lock);
+            return NULL;
         }
 
-        breadcrumbs[bc_len].node = node;
-        // LOG("followed node %p\n", node);
-        bc_len++;
+        ASSERT(node->flags & BTREE_NODE_FLAGS_FREE);
+        btree->free_pid = node->next_leaf_pid;
+        btree->free_count--;
+        pthread_mutex_unlock(&btree->free_lock);
+
+        // waits for the writer that freed it, readers left on the page fail
+        latch_lock(buffer_pool_latch(btree->pool, node));
+        memset(node, 0, NODE_SIZE);
+        buffer_pool_mark_dirty(btree->pool, node);
+        return node;
     }
+    pthread_mutex_unlock(&btree->free_lock);
 
-    // LOG("len of breadcrumbs: %d\n", bc_len);
-    __s16 bc_idx = bc_len - 1;
+    node = buffer_pool_new(btree->pool, __atomic_fetch_add(&btree->next_pid, 1, __ATOMIC_RELAXED));
+    if (node)
+        latch_lock(buffer_pool_latch(btree->pool, node));
+    return node;
+}
+
+static __u32 btree_cell_bytes(struct cell *cell)
+{
+    return sizeof(struct cell_ptr) + cell_size(cell);
+}
+
+// the leaf cell at idx can be replaced with one of key_size and value_size bytes
+static int btree_leaf_fits(struct node *node, __u32 idx, __u32 key_size, __u32 value_size)
+{
+    __u32 old_bytes = btree_cell_bytes(node_cell_from_idx(node, idx));
+    __u32 new_bytes = sizeof(struct cell_ptr) + ALIGN(sizeof(struct cell) + key_size + value_size, sizeof(__u32));
+    return node_live_bytes(node) - old_bytes + new_bytes <= NODE_CAPACITY;
+}
 
-    struct node *leaf_node, *new_node;
-    struct cell *partition;
-    breadcrumbs[bc_idx].is_full = node_is_full(node, key_size, value_size);
-    __u32 partition_idx;
+// d->node keeps its lower half and a new right sibling takes the rest, with
+// the separator going to the parent or to a new root. the parent, or the root
+// latch for the root, is taken with the node and the right leaf sibling: a
+// leaf has to be split first when its parent has no room for the separator,
+// its pid goes to *split_pid. a node on the right edge split for a key past
+// its last one keeps BTREE_SPLIT_APPEND_FILL percent, the keys that follow go
+// right as well. 0 on a split, 1 if the caller has to descend again, -1 if a
+// page could not be read or allocated
+static int btree_split(struct btree *btree, struct btree_descent *d, __u8 *key, __u32 key_size, __u64 *split_pid)
+{
+    struct node *node = d->node, *parent = d->parent, *next = NULL;
+    struct latch *parent_latch = parent ? btree_latch(btree, parent) : &btree->root_latch;
+    struct latch *latch = btree_latch(btree, node);
+    struct latch *next_latch = NULL;
+    int leaf = node_is_leaf(node);
+    __u8 separator[NODE_SIZE];
+    __u32 separator_size;
 
-    if (breadcrumbs[bc_idx].is_full)
+    if (!latch_upgrade(parent_latch, parent ? d->parent_version : d->root_version))
+        return 1;
+    if (!latch_upgrade(latch, d->version))
     {
-        // LOG("need split on leaf node %p\n", node);
-        partition_idx = node_partition_idx(node);
-        partition = node_cell_from_idx(node, partition_idx);
+        latch_abort(parent_latch);
+        return 1;
+    }
 
-        new_node = btree_node_alloc();
-        ASSERT(new_node);
-        node_init(new_node, BTREE_NODE_FLAGS_LEAF);
+    int append = d->right_edge && node->size && key_compare(node, node_get_cell_ptr(node, node->size - 1), key, key_size) < 0;
 
-        if (key_compare_cell(partition, key, key_size) < 0)
-            leaf_node = new_node;
-        else
-            leaf_node = node;
+    // the first key of the new node for a leaf, the key moving up for an internal node
+    __u32 partition_idx = node_partition_idx(node, append ? BTREE_SPLIT_APPEND_FILL : 50);
+    struct cell *partition = node_cell_from_idx(node, partition_idx);
+    separator_size = partition->key_size;
+    memcpy(separator, cell_get_key(partition), separator_size);
 
-        breadcrumbs[bc_idx].f_node = leaf_node;
-        breadcrumbs[bc_idx].new_node = new_node;
-        breadcrumbs[bc_idx].partition_idx = partition_idx;
+    if (parent && node_is_full(parent, separator_size, 0))
+    {
+        *split_pid = d->parent_pid;
+        latch_abort(latch);
+        latch_abort(parent_latch);
+        return 1;
+    }
+
+    if (leaf && node->next_leaf_pid)
+    {
+        __u64 next_version;
+        next = btree_node_optimistic(btree, node->next_leaf_pid, &next_version);
+        next_latch = next ? btree_latch(btree, next) : NULL;
+        if (!next || !latch_upgrade(next_latch, next_version))
+        {
+            latch_abort(latch);
+            latch_abort(parent_latch);
+            return next ? 1 : -1;
+        }
+    }
+
+    // the new nodes stay latched until they are linked in: a stale tail_pid
+    // or a reader left on a reused page can not take them half built
+    struct node *new_node = __btree_node_new(btree);
+    struct node *new_root = new_node && !parent ? __btree_node_new(btree) : NULL;
+    struct latch *new_latch = new_node ? btree_latch(btree, new_node) : NULL;
+    if (!new_node || (!parent && !new_root))
+    {
+        if (new_node)
+        {
+            btree_node_free(btree, new_node);
+            latch_unlock(new_latch);
+            btree_node_release(btree, new_node, 1);
+        }
+        if (next)
+            latch_abort(next_latch);
+        latch_abort(latch);
+        latch_abort(parent_latch);
+        return -1;
+    }
 
-        bc_idx--;
+    __u64 new_pid = btree_node_pid(btree, new_node);
+    if (leaf)
+    {
+        node_init(new_node, BTREE_NODE_FLAGS_LEAF);
+        leaf_node_split(node, new_node, partition_idx);
 
-        // handle internal nodes including root
-        for (; bc_idx >= 0 && breadcrumbs[bc_idx + 1].is_full; bc_idx--)
+        // the new node goes right after the split one
+        new_node->prev_leaf_pid = d->pid;
+        new_node->next_leaf_pid = node->next_leaf_pid;
+        node->next_leaf_pid = new_pid;
+        if (!next)
+            __atomic_store_n(&btree->tail_pid, new_pid, __ATOMIC_RELAXED);
+        if (next)
         {
-            node = breadcrumbs[bc_idx].node;
-            // LOG("handling propagation for node %p idx: %d \n", node, bc_idx);
-            partition_idx = node_partition_idx(node);
-            partition = node_cell_from_idx(node, partition_idx);
+            next->prev_leaf_pid = new_pid;
+            buffer_pool_mark_dirty(btree->pool, next);
+            latch_unlock(next_latch);
+        }
+    }
+    else
+    {
+        node_init(new_node, 0);
+        internal_node_split(node, new_node, partition_idx);
+    }
 
-            struct cell *child_partition = node_cell_from_idx(breadcrumbs[bc_idx + 1].node, breadcrumbs[bc_idx + 1].partition_idx);
-            // LOG("child partition key: %.*s\n", child_partition->key_size, cell_get_key(child_partition));
-            breadcrumbs[bc_idx].is_full = node_is_full(node, child_partition->key_size, 0);
+    if (parent)
+    {
+        // the slot followed to the node leads to the new one, the separator
+        // before it to the node
+        btree_child_set(parent, d->pos, new_pid);
+        __u32 off = node_get_free_offset(parent, separator_size, 0);
+        ASSERT(off > 0);
+        node_insert_internal_cell(parent, off, d->pos, separator, separator_size, d->pid);
+        buffer_pool_mark_dirty(btree->pool, parent);
+    }
+    else
+    {
+        node_init(new_root, BTREE_NODE_FLAGS_ROOT);
+        __u32 off = node_get_free_offset(new_root, separator_size, 0);
+        ASSERT(off > 0);
+        node_insert_internal_cell(new_root, off, 0, separator, separator_size, d->pid);
+        node_set_rightmost_child(new_root, new_pid);
+        node_unset_root(node);
+        __atomic_store_n(&btree->root_pid, btree_node_pid(btree, new_root), __ATOMIC_RELAXED);
+        latch_unlock(btree_latch(btree, new_root));
+        btree_node_release(btree, new_root, 1);
+    }
 
-            struct node *f_node;
-            if (breadcrumbs[bc_idx].is_full)
-            {
-                new_node = btree_node_alloc();
-                ASSERT(new_node);
-                node_init(new_node, 0);
+    buffer_pool_mark_dirty(btree->pool, node);
+    latch_unlock(new_latch);
+    btree_node_release(btree, new_node, 1);
+    latch_unlock(latch);
+    latch_unlock(parent_latch);
+
+    return 0;
+}
+
+// a key past the last one of the rightmost leaf goes at its end: no descent,
+// no search and no shift of the slots. 1 if the hint is stale, the key is not
+// past the leaf or the leaf is full, the insert then takes the descent
+static int btree_append(struct btree *btree, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size)
+{
+    __u64 pid = __atomic_load_n(&btree->tail_pid, __ATOMIC_RELAXED);
+    __u64 version;
+    struct node *node = pid ? buffer_pool_optimistic(btree->pool, pid, &version) : NULL;
+    if (!node)
+        return 1;
+
+    // a freed page is no leaf, a leaf with a next one no longer the tail
+    struct latch *latch = btree_latch(btree, node);
+    __u32 size = node->size;
+    int append = node_is_leaf(node) && !node->next_leaf_pid && size && !node_is_full(node, key_size, value_size) &&
+                 key_compare(node, node_get_cell_ptr(node, size - 1), key, key_size) < 0;
+    if (!append || !latch_upgrade(latch, version))
+        return 1;
+
+    __u32 off = node_get_free_offset(node, key_size, value_size);
+    ASSERT(off > 0);
+    node_insert_leaf_cell(node, off, node->size, key, key_size, value, value_size);
+    __atomic_add_fetch(&btree->count, 1, __ATOMIC_RELAXED);
+    buffer_pool_mark_dirty(btree->pool, node);
+    latch_unlock(latch);
+
+    return 0;
+}
+
+enum btree_put
+{
+    BTREE_PUT_INSERT = 1 << 0,
+    BTREE_PUT_UPDATE = 1 << 1,
+};
 
-                if (key_compare_cell(partition, cell_get_key(child_partition), child_partition->key_size) < 0)
-                    f_node = new_node;
-                else
-                    f_node = node;
+// one descent for inserts and updates, 1 if the key is in the tree and may not
+// be updated or is not and may not be inserted. only the leaf is latched,
+// unless it has to be split first
+static int btree_put(struct btree *btree, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size, enum btree_put mode)
+{
+    struct btree_descent d;
+    __u8 inline_value[NODE_OVERFLOW_INLINE];
+    __u32 overflow_size = 0;
+    __u64 split_pid = 0;
+    int ret;
+
+    btree_writer_check(btree);
+    if (key_size > BTREE_KEY_MAX)
+        return -1;
+    if (mode & BTREE_PUT_INSERT && value_size <= BTREE_INLINE_MAX && !btree_append(btree, key, key_size, value, value_size))
+        return 0;
 
-                breadcrumbs[bc_idx].new_node = new_node;
-                // LOG("allocated new node %p\n", new_node);
+    for (;;)
+    {
+        ret = btree_descend(btree, key, key_size, 0, split_pid, &d);
+        if (ret < 0)
+            break;
+        if (ret)
+            continue;
+
+        // an internal node on the path that had no room for a separator,
+        // BTREE_KEY_MAX leaves it more than two to split around
+        if (!node_is_leaf(d.node))
+        {
+            ASSERT(d.node->size > 2);
+            split_pid = 0;
+            if (btree_split(btree, &d, key, key_size, &split_pid) < 0)
+            {
+                ret = -1;
+                break;
             }
-            else
+            continue;
+        }
+
+        struct latch *latch = btree_latch(btree, d.node);
+        __u32 idx;
+        int found = node_bin_search(d.node, key, key_size, &idx);
+        if (!latch_validate(latch, d.version))
+            continue;
+        if (!(mode & (found ? BTREE_PUT_UPDATE : BTREE_PUT_INSERT)))
+        {
+            ret = 1;
+            break;
+        }
+
+        // a large value leaves only its prefix and the suffix in the leaf, it
+        // is written once whatever the restarts
+        if (value_size > BTREE_INLINE_MAX)
+        {
+            if (btree_overflow_write(btree, value, value_size, inline_value))
+                return -1;
+            overflow_size = value_size;
+            value = inline_value;
+            value_size = sizeof(inline_value);
+        }
+
+        int fits = found ? btree_leaf_fits(d.node, idx, key_size, value_size) : !node_is_full(d.node, key_size, value_size);
+        if (!latch_validate(latch, d.version))
+            continue;
+        if (!fits)
+        {
+            if (btree_split(btree, &d, key, key_size, &split_pid) < 0)
             {
-                f_node = node;
+                ret = -1;
+                break;
             }
+            continue;
+        }
+
+        if (!latch_upgrade(latch, d.version))
+            continue;
+        break;
+    }
+
+    // the pages written for a cell that is not coming, as when the key was
+    // inserted by another writer since the first descent
+    if (ret)
+    {
+        if (overflow_size)
+        {
+            struct btree_overflowed_cell_suffix suffix;
+            memcpy(&suffix, inline_value + NODE_OVERFLOW_PREFIX, sizeof(suffix));
+            btree_overflow_free(btree, suffix.overflow_pid, overflow_size);
+        }
+        return ret;
+    }
+
+    // the value is overwritten if the cell holds it, otherwise the cell goes and
+    // the new one is inserted into the tombstone space it leaves
+    struct node *node = d.node;
+    __u64 old_pid = 0;
+    __u32 old_size, idx;
+    int found = node_bin_search(node, key, key_size, &idx);
+    if (found)
+        old_pid = btree_overflow_pid(node, idx, &old_size);
+    if (found && !node_update_leaf_cell(node, idx, value, value_size))
+    {
+        if (overflow_size)
+            node_cell_set_overflow(node_cell_from_idx(node, idx), overflow_size);
+    }
+    else
+    {
+        if (found)
+            node_remove_cell(node, idx);
+        else
+            __atomic_add_fetch(&btree->count, 1, __ATOMIC_RELAXED);
+
+        __u32 off = node_get_free_offset(node, key_size, value_size);
+        ASSERT(off > 0);
+        node_insert_leaf_cell(node, off, idx, key, key_size, value, value_size);
+        if (overflow_size)
+            node_cell_set_overflow(node_cell_from_idx(node, idx), overflow_size);
+    }
+    if (!node->next_leaf_pid)
+        __atomic_store_n(&btree->tail_pid, d.pid, __ATOMIC_RELAXED);
+
+    buffer_pool_mark_dirty(btree->pool, node);
+    latch_unlock(btree_latch(btree, node));
+
+    // the replaced value's pages, no cell points to them any more
+    if (old_pid)
+        btree_overflow_free(btree, old_pid, old_size);
+
+    return 0;
+}
+
+int btree_insert(struct btree *btree, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size)
+{
+    return btree_put(btree, key, key_size, value, value_size, BTREE_PUT_INSERT);
+}
+
+int btree_update(struct btree *btree, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size)
+{
+    return btree_put(btree, key, key_size, value, value_size, BTREE_PUT_UPDATE);
+}
 
-            breadcrumbs[bc_idx].f_node = f_node;
-            breadcrumbs[bc_idx].partition_idx = partition_idx;
+int btree_upsert(struct btree *btree, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size)
+{
+    return btree_put(btree, key, key_size, value, value_size, BTREE_PUT_INSERT | BTREE_PUT_UPDATE);
+}
+
+// the separator at slot idx of the parent fits once it holds key_size bytes
+static int btree_separator_fits(struct node *parent, __u32 idx, __u32 key_size)
+{
+    __u32 old_size = cell_size(node_cell_from_idx(parent, idx));
+    return node_live_bytes(parent) - old_size + ALIGN(sizeof(struct cell) + key_size, sizeof(__u32)) <= NODE_CAPACITY;
+}
+
+static void btree_separator_set(struct node *parent, __u32 idx, __u8 *key, __u32 key_size)
+{
+    __u64 child_pid = internal_cell_child(node_cell_from_idx(parent, idx));
+
+    node_remove_cell(parent, idx);
+    __u32 off = node_get_free_offset(parent, key_size, 0);
+    ASSERT(off > 0);
+    node_insert_internal_cell(parent, off, idx, key, key_size, child_pid);
+}
+
+// right goes into left, the separator at idx and right leave the parent. next
+// is the leaf after a right leaf, if any
+static void btree_merge(struct btree *btree, struct node *parent, __u32 idx, struct node *left, struct node *right, struct node *next)
+{
+    if (node_is_leaf(left))
+    {
+        if (next)
+            next->prev_leaf_pid = btree_node_pid(btree, left);
+        else
+            __atomic_store_n(&btree->tail_pid, btree_node_pid(btree, left), __ATOMIC_RELAXED);
+        left->next_leaf_pid = right->next_leaf_pid;
+    }
+    else
+    {
+        // the separator comes down over the rightmost child of left
+        struct cell *separator = node_cell_from_idx(parent, idx);
+        __u32 off = node_get_free_offset(left, separator->key_size, 0);
+        ASSERT(off > 0);
+        node_insert_internal_cell(left, off, left->size, cell_get_key(separator), separator->key_size, left->rightmost_pid);
+        node_set_rightmost_child(left, right->rightmost_pid);
+    }
+
+    for (__u32 i = 0; i < right->size; i++)
+        node_insert_cell(left, left->size, node_cell_from_idx(right, i));
+
+    btree_child_set(parent, idx + 1, btree_node_pid(btree, left));
+    node_remove_cell(parent, idx);
+    btree_node_free(btree, right);
+}
+
+// moves cells over the separator at idx from the fuller node until the two
+// are about even, as long as the new separator fits in the parent
+static void btree_borrow(struct node *parent, __u32 idx, struct node *left, struct node *right)
+{
+    __u8 key[NODE_SIZE];
+    __u32 key_size;
+    int leaf = node_is_leaf(left);
+
+    while (node_live_bytes(left) < node_live_bytes(right) && right->size > 1)
+    {
+        struct cell *cell = node_cell_from_idx(right, 0);
+        struct cell *separator = node_cell_from_idx(parent, idx);
+        // a leaf separator is the first key left in right, an internal one the key moving up
+        struct cell *next = leaf ? node_cell_from_idx(right, 1) : cell;
+        __u32 moved = btree_cell_bytes(leaf ? cell : separator);
+
+        if (moved >= node_live_bytes(right) - node_live_bytes(left) || !btree_separator_fits(parent, idx, next->key_size))
+            break;
+
+        if (leaf)
+        {
+            node_insert_cell(left, left->size, cell);
+        }
+        else
+        {
+            __u32 off = node_get_free_offset(left, separator->key_size, 0);
+            ASSERT(off > 0);
+            node_insert_internal_cell(left, off, left->size, cell_get_key(separator), separator->key_size, left->rightmost_pid);
+            node_set_rightmost_child(left, internal_cell_child(cell));
         }
-        bc_idx++;
 
-        // need split on root
-        if (bc_idx == 0 && breadcrumbs[0].is_full)
+        key_size = next->key_size;
+        memcpy(key, cell_get_key(next), key_size);
+        node_remove_cell(right, 0);
+        btree_separator_set(parent, idx, key, key_size);
+    }
+
+    while (node_live_bytes(right) < node_live_bytes(left) && left->size > 1)
+    {
+        struct cell *cell = node_cell_from_idx(left, left->size - 1);
+        struct cell *separator = node_cell_from_idx(parent, idx);
+        __u32 moved = btree_cell_bytes(leaf ? cell : separator);
+
+        if (moved >= node_live_bytes(left) - node_live_bytes(right) || !btree_separator_fits(parent, idx, cell->key_size))
+            break;
+
+        if (leaf)
         {
-            // LOG("splitting root node %p\n", node);
-            node = breadcrumbs[0].node;
-            new_node = breadcrumbs[0].new_node;
-            partition_idx = breadcrumbs[0].partition_idx;
+            node_insert_cell(right, 0, cell);
+        }
+        else
+        {
+            __u32 off = node_get_free_offset(right, separator->key_size, 0);
+            ASSERT(off > 0);
+            node_insert_internal_cell(right, off, 0, cell_get_key(separator), separator->key_size, left->rightmost_pid);
+            node_set_rightmost_child(left, internal_cell_child(cell));
+        }
 
-            struct node *new_root = btree_node_alloc();
-            ASSERT(new_root);
-            node_init(new_root, BTREE_NODE_FLAGS_ROOT);
+        key_size = cell->key_size;
+        memcpy(key, cell_get_key(cell), key_size);
+        node_remove_cell(left, left->size - 1);
+        btree_separator_set(parent, idx, key, key_size);
+    }
+}
 
-            partition = node_cell_from_idx(node, partition_idx);
-            __u32 root_offset = node_get_free_offset(new_root, partition->key_size, 0);
-            ASSERT(root_offset > 0);
+// pages latched by a rebalance, let go in reverse
+struct btree_latched
+{
+    struct latch *latches[4];
+    __u32 len;
+};
 
-            node_insert_internal_cell(new_root, root_offset, 0, cell_get_key(partition), partition->key_size, node);
-            node_set_rightmost_child(new_root, new_node);
+static int btree_latched_upgrade(struct btree_latched *latched, struct latch *latch, __u64 version)
+{
+    if (!latch_upgrade(latch, version))
+        return 0;
+    latched->latches[latched->len++] = latch;
+    return 1;
+}
+
+static void btree_latched_release(struct btree_latched *latched, int written)
+{
+    while (latched->len--)
+    {
+        if (written)
+            latch_unlock(latched->latches[latched->len]);
+        else
+            latch_abort(latched->latches[latched->len]);
+    }
+}
+
+// d->node is merged with or refilled from its right sibling, or its left one
+// when it is the rightmost child, with the parent, both nodes and the leaf
+// after them latched. 0 when done, 1 if the caller has to descend again, 2 if
+// the node stays underfull, -1 if a page could not be read
+static int btree_rebalance(struct btree *btree, struct btree_descent *d)
+{
+    struct btree_latched latched = {.len = 0};
+    struct node *parent = d->parent, *node = d->node;
+    struct node *sibling, *next = NULL;
+    __u64 version;
+
+    if (!btree_latched_upgrade(&latched, btree_latch(btree, parent), d->parent_version))
+        return 1;
+    // a single child has no sibling, it goes with the root collapse or the
+    // rebalance of its parent
+    if (!parent->size)
+    {
+        btree_latched_release(&latched, 0);
+        return 2;
+    }
+
+    __u32 pos = d->pos;
+    __u32 idx = pos < parent->size ? pos : pos - 1;
+    sibling = btree_node_optimistic(btree, btree_child_at(parent, idx == pos ? pos + 1 : idx), &version);
+    if (!sibling)
+    {
+        btree_latched_release(&latched, 0);
+        return -1;
+    }
+    if (!btree_latched_upgrade(&latched, btree_latch(btree, sibling), version) || !btree_latched_upgrade(&latched, btree_latch(btree, node), d->version))
+    {
+        btree_latched_release(&latched, 0);
+        return 1;
+    }
+
+    struct node *left = idx == pos ? node : sibling;
+    struct node *right = idx == pos ? sibling : node;
+    struct cell *separator = node_cell_from_idx(parent, idx);
+
+    // an internal merge also takes the separator
+    __u32 merged = node_live_bytes(left) + node_live_bytes(right);
+    if (!node_is_leaf(node))
+        merged += btree_cell_bytes(separator);
+
+    if (merged > NODE_CAPACITY)
+    {
+        btree_borrow(parent, idx, left, right);
+        int ret = node_live_bytes(node) < BTREE_UNDERFLOW_BYTES ? 2 : 0;
+        buffer_pool_mark_dirty(btree->pool, parent);
+        buffer_pool_mark_dirty(btree->pool, left);
+        buffer_pool_mark_dirty(btree->pool, right);
+        btree_latched_release(&latched, 1);
+        return ret;
+    }
 
-            btree->root = new_root;
-            node_set_parent(new_node, new_root);
-            node_set_parent(node, new_root);
-            node_unset_root(node);
-            // LOG("set new root node %p\n", new_root);
+    if (node_is_leaf(node) && right->next_leaf_pid)
+    {
+        next = btree_node_optimistic(btree, right->next_leaf_pid, &version);
+        if (!next || !btree_latched_upgrade(&latched, btree_latch(btree, next), version))
+        {
+            btree_latched_release(&latched, 0);
+            return next ? 1 : -1;
         }
+        buffer_pool_mark_dirty(btree->pool, next);
+    }
+
+    // right goes to the free list under its latch: readers still on it fail
+    btree_merge(btree, parent, idx, left, right, next);
+    buffer_pool_mark_dirty(btree->pool, parent);
+    buffer_pool_mark_dirty(btree->pool, left);
+    buffer_pool_mark_dirty(btree->pool, right);
+    btree_latched_release(&latched, 1);
+
+    return 0;
+}
 
-        // LOG("current bc idx: %d len: %d\n", bc_idx, bc_len);
-        // write all the way down to the leaf
-        for (__s16 i = bc_idx; i < bc_len; i++)
+// a root left with a single child hands the root over to it
+static int btree_collapse(struct btree *btree, struct btree_descent *d)
+{
+    struct btree_latched latched = {.len = 0};
+    struct node *root = d->node;
+    __u64 version;
+
+    if (!btree_latched_upgrade(&latched, &btree->root_latch, d->root_version) || !btree_latched_upgrade(&latched, btree_latch(btree, root), d->version))
+    {
+        btree_latched_release(&latched, 0);
+        return 1;
+    }
+
+    __u64 child_pid = root->rightmost_pid;
+    struct node *child = btree_node_optimistic(btree, child_pid, &version);
+    if (!child || !btree_latched_upgrade(&latched, btree_latch(btree, child), version))
+    {
+        btree_latched_release(&latched, 0);
+        return child ? 1 : -1;
+    }
+
+    node_set_root(child);
+    __atomic_store_n(&btree->root_pid, child_pid, __ATOMIC_RELAXED);
+    btree_node_free(btree, root);
+    buffer_pool_mark_dirty(btree->pool, child);
+    buffer_pool_mark_dirty(btree->pool, root);
+    btree_latched_release(&latched, 1);
+
+    return 0;
+}
+
+// underfull nodes on the path to key are fixed from the top one down. best
+// effort: the tree stays valid with a node left underfull, as when a sibling
+// could not be read or the locks keep being lost to other writers
+static void btree_shrink(struct btree *btree, __u8 *key, __u32 key_size)
+{
+    struct btree_descent d;
+
+    for (__u32 attempt = 0; attempt < BTREE_MAX_DEPTH * 4; attempt++)
+    {
+        int ret = btree_descend(btree, key, key_size, 0, BTREE_STOP_UNDERFLOW, &d);
+        if (ret < 0)
+            return;
+        if (ret)
+            continue;
+
+        if (d.parent)
         {
-            // LOG("propagating in node %p bc_idx: %d\n", breadcrumbs[i].node, i);
-            node = breadcrumbs[i].node;
-            __u32 before_len = node->size;
-            if (breadcrumbs[i].is_full)
-            {
-                new_node = breadcrumbs[i].new_node;
-                partition_idx = breadcrumbs[i].partition_idx;
-                ASSERT(partition_idx <= node->size && partition_idx >= 0);
-
-                if (node_is_leaf(node))
-                {
-                    // LOG("splitting leaf node %p\n", node);
-                    ASSERT((new_node->flags & BTREE_NODE_FLAGS_LEAF) != 0);
-                    leaf_node_split(node, new_node, partition_idx);
-                    ASSERT(leaf_node == node || leaf_node == new_node);
-                    ASSERT((before_len) == (node->size + new_node->size));
-                }
-                else
-                {
-                    // LOG("splitting internal node %p\n", node);
-                    ASSERT((new_node->flags & BTREE_NODE_FLAGS_LEAF) == 0);
-                    internal_node_split(node, new_node, partition_idx);
-                    ASSERT((before_len - 1) == (node->size + new_node->size));
-                }
-            }
-            if (!node_is_leaf(node))
-            {
-                struct node *f_node = breadcrumbs[i].f_node;
-                // LOG("selected %s node\n", f_node == node ? "original" : "new");
-                // ASSERT(f_node == new_node || f_node == node);
-
-                struct node *child_new_node = breadcrumbs[i + 1].new_node;
-                struct node *child_node = breadcrumbs[i + 1].node;
-                struct cell *child_partition = node_cell_from_idx(child_node, breadcrumbs[i + 1].partition_idx);
-                // LOG("child partition key: %.*s\n", child_partition->key_size, cell_get_key(child_partition));
-                // LOG("child old node: %p\n", child_node);
-                // LOG("child new node: %p\n", child_new_node);
-
-                __u32 idx;
-                ret = node_bin_search(f_node, cell_get_key(child_partition), child_partition->key_size, &idx);
-                ASSERT(idx >= 0);
-                // LOG("writing partion key at idx %d in node %p with size: %d\n", idx, f_node, f_node->size);
-
-                if (idx < f_node->size)
-                    node_cell_from_idx(f_node, idx)->pid = (__u64)child_new_node;
-                else
-                    node_set_rightmost_child(f_node, child_new_node);
-
-                __u32 off = node_get_free_offset(f_node, child_partition->key_size, 0);
-                if (off == 0)
-                    debug_node(f_node, 1, 1);
-                ASSERT(off > 0);
-                node_insert_internal_cell(f_node, off, idx, cell_get_key(child_partition), child_partition->key_size, child_node);
-            }
+            if (node_live_bytes(d.node) >= BTREE_UNDERFLOW_BYTES)
+                return;
+            ret = btree_rebalance(btree, &d);
+        }
+        else
+        {
+            if (node_is_leaf(d.node) || d.node->size)
+                return;
+            ret = btree_collapse(btree, &d);
         }
+
+        if (ret < 0 || ret == 2)
+            return;
     }
-    else
+}
+
+int btree_delete(struct btree *btree, __u8 *key, __u32 key_size)
+{
+    struct btree_descent d;
+    __u64 overflow_pid;
+    __u32 overflow_size;
+    int underflow;
+
+    btree_writer_check(btree);
+    for (;;)
     {
-        leaf_node = node;
+        int ret = btree_descend(btree, key, key_size, 0, 0, &d);
+        if (ret < 0)
+            return -1;
+        if (ret)
+            continue;
+
+        struct latch *latch = btree_latch(btree, d.node);
+        __u32 idx;
+        int found = node_bin_search(d.node, key, key_size, &idx);
+        if (!latch_validate(latch, d.version))
+            continue;
+        if (!found)
+            return 1;
+        if (!latch_upgrade(latch, d.version))
+            continue;
+
+        overflow_pid = btree_overflow_pid(d.node, idx, &overflow_size);
+        node_remove_cell(d.node, idx);
+        underflow = d.parent && node_live_bytes(d.node) < BTREE_UNDERFLOW_BYTES;
+        buffer_pool_mark_dirty(btree->pool, d.node);
+        latch_unlock(latch);
+        __atomic_sub_fetch(&btree->count, 1, __ATOMIC_RELAXED);
+        break;
+    }
+
+    if (overflow_pid)
+        btree_overflow_free(btree, overflow_pid, overflow_size);
+    if (underflow)
+        btree_shrink(btree, key, key_size);
+
+    return 0;
+}
+
+int btree_load_init(struct btree_loader *loader, struct btree *btree, __u32 fill)
+{
+    ASSERT(fill > 0 && fill <= 100);
+    btree_writer_check(btree);
+
+    struct node *root = btree_node_fetch(btree, btree->root_pid);
+    if (!root)
+        return -1;
+    if (btree->count || !node_is_leaf(root) || root->size)
+    {
+        btree_node_release(btree, root, 0);
+        return -1;
+    }
+
+    // the empty root is the first leaf, the root flag goes to the top node on finish
+    node_unset_root(root);
+    loader->btree = btree;
+    loader->fill_bytes = NODE_SIZE * fill / 100;
+    loader->height = 0;
+    loader->levels[0] = root;
+
+    return 0;
+}
+
+// a node takes at least one cell, then cells up to the fill factor
+static int btree_load_fits(struct btree_loader *loader, struct node *node, __u32 key_size, __u32 value_size)
+{
+    if (!node->size)
+        return 1;
+
+    __u32 used = sizeof(struct node) + sizeof(struct cell_ptr) * (node->size + 1) + (NODE_SIZE - node->cell_offset) +
+                 ALIGN(key_size + value_size + sizeof(struct cell), sizeof(__u32));
+    return used <= loader->fill_bytes;
+}
+
+// a new node at level - 1 starts at key: its left sibling, still the open node
+// of level - 1, gets key as separator in the node above
+static int btree_load_push(struct btree_loader *loader, __u32 level, __u8 *key, __u32 key_size)
+{
+    struct btree *btree = loader->btree;
+    __u64 child_pid = btree_node_pid(btree, loader->levels[level - 1]);
+    struct node *node;
+    int ret;
+
+    if (level > loader->height)
+    {
+        ASSERT(level < BTREE_MAX_DEPTH);
+        node = btree_node_new(btree);
+        if (!node)
+            return -1;
+        node_init(node, 0);
+        loader->levels[level] = node;
+        loader->height = level;
     }
 
-    // LOG("selected %s leaf node\n", leaf_node == breadcrumbs[bc_len - 1].node ? "original" : "new");
+    node = loader->levels[level];
+    if (!btree_load_fits(loader, node, key_size, 0))
+    {
+        // the child becomes the rightmost of the full node and the key moves
+        // up as the separator of the next one
+        struct node *next = btree_node_new(btree);
+        if (!next)
+            return -1;
+        node_init(next, 0);
+        node_set_rightmost_child(node, child_pid);
+
+        ret = btree_load_push(loader, level + 1, key, key_size);
+        btree_node_release(btree, node, 1);
+        loader->levels[level] = next;
+        return ret;
+    }
 
-    // happy path leaf insert
-    __u32 off = node_get_free_offset(leaf_node, key_size, value_size);
+    __u32 off = node_get_free_offset(node, key_size, 0);
     ASSERT(off > 0);
+    node_insert_internal_cell(node, off, node->size, key, key_size, child_pid);
+
+    return 0;
+}
+
+int btree_load_append(struct btree_loader *loader, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size)
+{
+    struct btree *btree = loader->btree;
+    struct node *leaf = loader->levels[0];
+    int ret;
+
+    if (key_size > BTREE_KEY_MAX)
+        return -1;
+    if (leaf->size && key_compare(leaf, node_get_cell_ptr(leaf, leaf->size - 1), key, key_size) >= 0)
+        return 1;
+
+    // the leaf is settled before a large value is written, nothing fails
+    // between writing its pages and the cell pointing to them
+    __u8 inline_value[NODE_OVERFLOW_INLINE];
+    __u32 overflow_size = value_size > BTREE_INLINE_MAX ? value_size : 0;
+    if (overflow_size)
+        value_size = sizeof(inline_value);
+
+    if (!btree_load_fits(loader, leaf, key_size, value_size))
+    {
+        struct node *next = btree_node_new(btree);
+        if (!next)
+            return -1;
+        node_init(next, BTREE_NODE_FLAGS_LEAF);
+        next->prev_leaf_pid = btree_node_pid(btree, leaf);
+        leaf->next_leaf_pid = btree_node_pid(btree, next);
+
+        ret = btree_load_push(loader, 1, key, key_size);
+        btree_node_release(btree, leaf, 1);
+        loader->levels[0] = leaf = next;
+        if (ret)
+            return ret;
+    }
 
-    __u32 idx;
-    ret = node_bin_search(leaf_node, key, key_size, &idx);
-    ASSERT(idx >= 0);
-    // LOG("inserting key %.*s at idx %d offset %d in node %p\n", key_size, key, idx, off, leaf_node);
+    if (overflow_size)
+    {
+        if (btree_overflow_write(btree, value, overflow_size, inline_value))
+            return -1;
+        value = inline_value;
+    }
 
-    node_insert_leaf_cell(leaf_node, off, idx, key, key_size, value, value_size);
+    // cells are appended in key order, no search and no shift of the cell_ptrs
+    __u32 off = node_get_free_offset(leaf, key_size, value_size);
+    ASSERT(off > 0);
+    node_insert_leaf_cell(leaf, off, leaf->size, key, key_size, value, value_size);
+    if (overflow_size)
+        node_cell_set_overflow(node_cell_from_idx(leaf, leaf->size - 1), overflow_size);
     btree->count++;
 
     return 0;
 }
 
+void btree_load_finish(struct btree_loader *loader)
+{
+    struct btree *btree = loader->btree;
+
+    // the open node below is the last child of every level
+    for (__u32 level = 1; level <= loader->height; level++)
+        node_set_rightmost_child(loader->levels[level], btree_node_pid(btree, loader->levels[level - 1]));
+
+    struct node *root = loader->levels[loader->height];
+    node_set_root(root);
+    btree->root_pid = btree_node_pid(btree, root);
+
+    for (__u32 level = 0; level <= loader->height; level++)
+        btree_node_release(btree, loader->levels[level], 1);
+}
+
+// follow the sibling links until a leaf with cells, the cursor keeps it pinned
+static int btree_cursor_step_leaf(struct btree_cursor *cursor, int forward)
+{
+    struct btree *btree = cursor->btree;
+
+    for (;;)
+    {
+        __u64 pid = forward ? cursor->node->next_leaf_pid : cursor->node->prev_leaf_pid;
+        btree_cursor_close(cursor);
+        if (!pid)
+            return 1;
+
+        cursor->node = btree_node_fetch(btree, pid);
+        if (!cursor->node)
+            return -1;
+        btree_reader_pin(btree);
+        if (cursor->node->size)
+        {
+            cursor->idx = forward ? 0 : cursor->node->size - 1;
+            return 0;
+        }
+    }
+}
+
+static int btree_cursor_position(struct btree_cursor *cursor, __u8 *key, __u32 key_size, int last)
+{
+    btree_cursor_close(cursor);
+
+    cursor->node = btree_leaf_fetch(cursor->btree, key, key_size, last);
+    if (!cursor->node)
+        return -1;
+    btree_reader_pin(cursor->btree);
+
+    if (key)
+        node_bin_search(cursor->node, key, key_size, &cursor->idx);
+    else
+        cursor->idx = last ? cursor->node->size - 1 : 0;
+
+    // past the end of the leaf, or an empty one
+    if (cursor->idx >= cursor->node->size)
+        return btree_cursor_step_leaf(cursor, !last);
+
+    return 0;
+}
+
+void btree_cursor_init(struct btree_cursor *cursor, struct btree *btree)
+{
+    cursor->btree = btree;
+    cursor->node = NULL;
+    cursor->idx = 0;
+}
+
+int btree_cursor_seek(struct btree_cursor *cursor, __u8 *key, __u32 key_size)
+{
+    return btree_cursor_position(cursor, key, key_size, 0);
+}
+
+int btree_cursor_last(struct btree_cursor *cursor)
+{
+    return btree_cursor_position(cursor, NULL, 0, 1);
+}
+
+int btree_cursor_next(struct btree_cursor *cursor)
+{
+    if (!cursor->node)
+        return 1;
+
+    if (++cursor->idx < cursor->node->size)
+        return 0;
+
+    return btree_cursor_step_leaf(cursor, 1);
+}
+
+int btree_cursor_prev(struct btree_cursor *cursor)
+{
+    if (!cursor->node)
+        return 1;
+
+    if (cursor->idx-- > 0)
+        return 0;
+
+    return btree_cursor_step_leaf(cursor, 0);
+}
+
+int btree_cursor_get(struct btree_cursor *cursor, struct cell_pointers *pointers)
+{
+    if (!cursor->node)
+        return 1;
+
+    node_cell_pointers(cursor->node, node_get_cell_ptr(cursor->node, cursor->idx), pointers);
+    return 0;
+}
+
+void btree_cursor_close(struct btree_cursor *cursor)
+{
+    if (cursor->node)
+    {
+        btree_node_release(cursor->btree, cursor->node, 0);
+        btree_reader_unpin(cursor->btree);
+    }
+    cursor->node = NULL;
+}
+
+struct node *btree_node_fetch(struct btree *btree, __u64 pid)
+{
+    ASSERT(pid != BTREE_META_PID);
+    return buffer_pool_fetch(btree->pool, pid);
+}
+
+struct node *btree_node_new(struct btree *btree)
+{
+    struct node *node = __btree_node_new(btree);
+    if (node)
+        latch_unlock(buffer_pool_latch(btree->pool, node));
+    return node;
+}
+
+// by the holder of the page latch or of the only pin
+void btree_node_free(struct btree *btree, struct node *node)
+{
+    // a freed tail is no hint for btree_append once the page is reused
+    __u64 pid = btree_node_pid(btree, node), tail = pid;
+    __atomic_compare_exchange_n(&btree->tail_pid, &tail, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    node_init(node, BTREE_NODE_FLAGS_FREE);
+
+    pthread_mutex_lock(&btree->free_lock);
+    node->next_leaf_pid = btree->free_pid;
+    btree->free_pid = pid;
+    btree->free_count++;
+    pthread_mutex_unlock(&btree->free_lock);
+}
+
+void btree_node_release(struct btree *btree, struct node *node, int dirty)
+{
+    buffer_pool_unpin(btree->pool, node, dirty);
+}
+
+__u64 btree_node_pid(struct btree *btree, struct node *node)
+{
+    return buffer_pool_pid(btree->pool, node);
+}
+
+// detached node outside of the buffer pool
 struct node *btree_node_alloc(void)
 {
     void *mem = malloc(NODE_SIZE);
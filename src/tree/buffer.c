@@ -0,0 +1,531 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <liburing.h>
+#include "utils.h"
+#include "scheduler.h"
+#include "tree/buffer.h"
+
+static inline void *frame_page(struct buffer_pool *pool, struct frame *frame)
+{
+    return pool->buf + (__u64)(frame - pool->frames) * BUFFER_PAGE_SIZE;
+}
+
+static inline struct frame *page_frame(struct buffer_pool *pool, void *page)
+{
+    __u64 idx = (__u64)(page - pool->buf) / BUFFER_PAGE_SIZE;
+    ASSERT(idx < pool->len);
+    return &pool->frames[idx];
+}
+
+static inline __u32 table_home(struct buffer_pool *pool, __u64 pid)
+{
+    // fibonacci hashing, sequential pids spread over the table
+    return (__u32)((pid * 0x9E3779B97F4A7C15ull) >> 32) & pool->table_mask;
+}
+
+static __u32 *table_slot(struct buffer_pool *pool, __u64 pid)
+{
+    __u32 i = table_home(pool, pid);
+    for (;;)
+    {
+        __u32 *slot = &pool->table[i];
+        if (!*slot || pool->frames[*slot - 1].pid == pid)
+            return slot;
+        i = (i + 1) & pool->table_mask;
+    }
+}
+
+// table writes are atomic stores for buffer_pool_optimistic, that probes
+// without the pool lock
+static void table_insert(struct buffer_pool *pool, struct frame *frame)
+{
+    __u32 *slot = table_slot(pool, frame->pid);
+    ASSERT(!*slot);
+    __atomic_store_n(slot, (__u32)(frame - pool->frames) + 1, __ATOMIC_RELAXED);
+}
+
+static void table_remove(struct buffer_pool *pool, __u64 pid)
+{
+    __u32 i = (__u32)(table_slot(pool, pid) - pool->table);
+    ASSERT(pool->table[i]);
+    __atomic_store_n(&pool->table[i], 0, __ATOMIC_RELAXED);
+
+    // backward shift: pull up every entry of the run that can no longer
+    // reach its slot past the hole
+    __u32 j = i;
+    for (;;)
+    {
+        j = (j + 1) & pool->table_mask;
+        if (!pool->table[j])
+            break;
+
+        __u32 home = table_home(pool, pool->frames[pool->table[j] - 1].pid);
+        if (((j - home) & pool->table_mask) < ((j - i) & pool->table_mask))
+            continue;
+
+        __atomic_store_n(&pool->table[i], pool->table[j], __ATOMIC_RELAXED);
+        __atomic_store_n(&pool->table[j], 0, __ATOMIC_RELAXED);
+        i = j;
+    }
+}
+
+static int frame_io_done(struct op *op, struct io_uring_cqe *cqe)
+{
+    container_of_op(frame, struct frame, op);
+
+    ASSERT(frame->state == FRAME_IO);
+    frame->res = cqe->res;
+    frame->state = FRAME_READY;
+    frame->pool->inflight--;
+
+    return 0;
+}
+
+static int buffer_sync_done(struct op *op, struct io_uring_cqe *cqe)
+{
+    container_of_op(sync, struct op_buffer_sync, op);
+
+    sync->res = cqe->res;
+    sync->pool->inflight--;
+
+    return 0;
+}
+
+static struct io_uring_sqe *buffer_pool_sqe(struct buffer_pool *pool, struct op *op, op_callback_t callback)
+{
+    struct io_uring_sqe *sqe = io_prepare_sqe_flags(pool->ring, op, callback, OP_FLAG_ERRORS);
+    if (sqe)
+        return sqe;
+
+    // sq full: push what is queued and retry once
+    io_uring_submit(pool->ring);
+    return io_prepare_sqe_flags(pool->ring, op, callback, OP_FLAG_ERRORS);
+}
+
+static int frame_submit(struct buffer_pool *pool, struct frame *frame, int write)
+{
+    struct io_uring_sqe *sqe = buffer_pool_sqe(pool, &frame->inner, frame_io_done);
+    if (!sqe)
+        return -EBUSY;
+
+    __u64 offset = frame->pid * BUFFER_PAGE_SIZE;
+    if (write)
+        io_uring_prep_write(sqe, pool->fd, frame_page(pool, frame), BUFFER_PAGE_SIZE, offset);
+    else
+        io_uring_prep_read(sqe, pool->fd, frame_page(pool, frame), BUFFER_PAGE_SIZE, offset);
+
+    frame->state = FRAME_IO;
+    frame->res = 0;
+    pool->inflight++;
+
+    return 0;
+}
+
+static int buffer_pool_wait(struct buffer_pool *pool)
+{
+    // completions of other ops on the same ring are dispatched as well
+    while (pool->inflight)
+    {
+        int ret = (int)io_tick(pool->ring);
+        if (ret < 0 && ret != -EINTR)
+            return ret;
+    }
+
+    return 0;
+}
+
+static int frame_res(struct frame *frame)
+{
+    if (frame->res < 0)
+        return frame->res;
+    // short transfer: a read past the end of the file or a full device
+    return frame->res == BUFFER_PAGE_SIZE ? 0 : -EIO;
+}
+
+static int frame_io(struct buffer_pool *pool, struct frame *frame, int write)
+{
+    int ret = frame_submit(pool, frame, write);
+    if (ret)
+        return ret;
+
+    ret = buffer_pool_wait(pool);
+    if (ret)
+        return ret;
+
+    return frame_res(frame);
+}
+
+// CLOCK: sweep the frames clearing reference bits, the first unpinned frame
+// found without one is the victim. two full turns clear every bit, a third
+// only finds pinned frames. frames latched by a writer are passed over, the
+// victim is returned latched: optimistic readers of the old page fail their
+// validation and the caller unlatches once the new page is in
+static struct frame *buffer_pool_victim(struct buffer_pool *pool)
+{
+    for (__u32 i = 0; i < pool->len * 2 + 1; i++)
+    {
+        struct frame *frame = &pool->frames[pool->clock_hand];
+        pool->clock_hand = pool->clock_hand + 1 == pool->len ? 0 : pool->clock_hand + 1;
+
+        if (__atomic_load_n(&frame->pin_count, __ATOMIC_ACQUIRE) || (frame->state != FRAME_READY && frame->state != FRAME_FREE))
+            continue;
+        if (frame->state == FRAME_READY && __atomic_load_n(&frame->referenced, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&frame->referenced, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (!latch_try_lock(&frame->latch))
+            continue;
+        if (frame->state == FRAME_FREE)
+            return frame;
+
+        if (frame->dirty)
+        {
+            if (frame_io(pool, frame, 1))
+            {
+                latch_abort(&frame->latch);
+                return NULL;
+            }
+            frame->dirty = 0;
+            pool->writebacks++;
+        }
+
+        table_remove(pool, frame->pid);
+        __atomic_store_n(&frame->pid, BUFFER_PID_NONE, __ATOMIC_RELAXED);
+        frame->state = FRAME_FREE;
+        pool->evictions++;
+
+        return frame;
+    }
+
+    return NULL;
+}
+
+static void *frame_pin(struct buffer_pool *pool, struct frame *frame)
+{
+    __atomic_add_fetch(&frame->pin_count, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&frame->referenced, 1, __ATOMIC_RELAXED);
+    return frame_page(pool, frame);
+}
+
+int buffer_pool_init(struct buffer_pool *pool, struct io_uring *ring, int fd, __u32 len)
+{
+    ASSERT(len);
+
+    pool->len = len;
+    pool->ring = ring;
+    pool->fd = fd;
+    pool->clock_hand = 0;
+    pool->inflight = 0;
+    pool->hits = 0;
+    pool->misses = 0;
+    pool->evictions = 0;
+    pool->writebacks = 0;
+    pool->op_sync.pool = pool;
+    pool->op_sync.res = 0;
+    pool->op_extent.pool = pool;
+    pool->op_extent.res = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    // at most half full so probe runs stay short
+    __u32 table_len = 1;
+    while (table_len < len * 2)
+        table_len <<= 1;
+    pool->table_mask = table_len - 1;
+
+    // mmap is page aligned: every frame is usable for O_DIRECT. the page past
+    // the last frame catches optimistic reads of a torn cell running off it
+    pool->buf = mmap(NULL, (__u64)BUFFER_PAGE_SIZE * (len + 1), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (pool->buf == MAP_FAILED)
+        return -ENOMEM;
+
+    pool->frames = calloc(len, sizeof(struct frame));
+    pool->table = calloc(table_len, sizeof(__u32));
+    if (!pool->frames || !pool->table)
+    {
+        buffer_pool_free(pool);
+        return -ENOMEM;
+    }
+
+    for (__u32 i = 0; i < len; i++)
+    {
+        pool->frames[i].pool = pool;
+        pool->frames[i].pid = BUFFER_PID_NONE;
+        pool->frames[i].state = FRAME_FREE;
+    }
+
+    return 0;
+}
+
+void buffer_pool_free(struct buffer_pool *pool)
+{
+    ASSERT(!pool->inflight);
+
+    if (pool->buf != MAP_FAILED)
+        munmap(pool->buf, (__u64)BUFFER_PAGE_SIZE * (pool->len + 1));
+    free(pool->frames);
+    free(pool->table);
+    pthread_mutex_destroy(&pool->lock);
+
+    pool->buf = MAP_FAILED;
+    pool->frames = NULL;
+    pool->table = NULL;
+}
+
+static void *__buffer_pool_fetch(struct buffer_pool *pool, __u64 pid)
+{
+    __u32 *slot = table_slot(pool, pid);
+    if (*slot)
+    {
+        pool->hits++;
+        return frame_pin(pool, &pool->frames[*slot - 1]);
+    }
+
+    pool->misses++;
+
+    struct frame *frame = buffer_pool_victim(pool);
+    if (!frame)
+        return NULL;
+
+    __atomic_store_n(&frame->pid, pid, __ATOMIC_RELAXED);
+    frame->dirty = 0;
+    table_insert(pool, frame);
+
+    if (frame_io(pool, frame, 0))
+    {
+        table_remove(pool, pid);
+        __atomic_store_n(&frame->pid, BUFFER_PID_NONE, __ATOMIC_RELAXED);
+        frame->state = FRAME_FREE;
+        latch_unlock(&frame->latch);
+        return NULL;
+    }
+
+    void *page = frame_pin(pool, frame);
+    latch_unlock(&frame->latch);
+
+    return page;
+}
+
+void *buffer_pool_fetch(struct buffer_pool *pool, __u64 pid)
+{
+    ASSERT(pid != BUFFER_PID_NONE);
+
+    pthread_mutex_lock(&pool->lock);
+    void *page = __buffer_pool_fetch(pool, pid);
+    pthread_mutex_unlock(&pool->lock);
+
+    return page;
+}
+
+void *buffer_pool_new(struct buffer_pool *pool, __u64 pid)
+{
+    ASSERT(pid != BUFFER_PID_NONE);
+
+    pthread_mutex_lock(&pool->lock);
+    ASSERT(!*table_slot(pool, pid));
+
+    struct frame *frame = buffer_pool_victim(pool);
+    if (!frame)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    __atomic_store_n(&frame->pid, pid, __ATOMIC_RELAXED);
+    frame->state = FRAME_READY;
+    frame->dirty = 1;
+    table_insert(pool, frame);
+
+    void *page = frame_pin(pool, frame);
+    memset(page, 0, BUFFER_PAGE_SIZE);
+    latch_unlock(&frame->latch);
+    pthread_mutex_unlock(&pool->lock);
+
+    return page;
+}
+
+// the page of pid without pinning it, or NULL when it is not in the pool. the
+// page is only read: the reader checks version with latch_validate before
+// trusting what it read, eviction moves the version on
+void *buffer_pool_optimistic(struct buffer_pool *pool, __u64 pid, __u64 *version)
+{
+    __u32 i = table_home(pool, pid);
+    for (__u32 probes = 0; probes <= pool->table_mask; probes++)
+    {
+        __u32 slot = __atomic_load_n(&pool->table[i], __ATOMIC_RELAXED);
+        if (!slot)
+            return NULL;
+
+        struct frame *frame = &pool->frames[slot - 1];
+        if (__atomic_load_n(&frame->pid, __ATOMIC_RELAXED) == pid)
+        {
+            *version = latch_read(&frame->latch);
+            // loaded with another page since the probe
+            if (__atomic_load_n(&frame->pid, __ATOMIC_RELAXED) != pid)
+                return NULL;
+            if (!__atomic_load_n(&frame->referenced, __ATOMIC_RELAXED))
+                __atomic_store_n(&frame->referenced, 1, __ATOMIC_RELAXED);
+
+            return frame_page(pool, frame);
+        }
+        i = (i + 1) & pool->table_mask;
+    }
+
+    return NULL;
+}
+
+struct latch *buffer_pool_latch(struct buffer_pool *pool, void *page)
+{
+    return &page_frame(pool, page)->latch;
+}
+
+void buffer_pool_pin(struct buffer_pool *pool, void *page)
+{
+    struct frame *frame = page_frame(pool, page);
+    ASSERT(frame->pin_count);
+    frame_pin(pool, frame);
+}
+
+void buffer_pool_unpin(struct buffer_pool *pool, void *page, int dirty)
+{
+    struct frame *frame = page_frame(pool, page);
+    ASSERT(frame->pin_count);
+    if (dirty)
+        __atomic_store_n(&frame->dirty, 1, __ATOMIC_RELAXED);
+    // the dirty bit is seen by the victim sweep that sees the frame unpinned
+    __atomic_sub_fetch(&frame->pin_count, 1, __ATOMIC_RELEASE);
+}
+
+// by a holder of a pin or of the page latch
+void buffer_pool_mark_dirty(struct buffer_pool *pool, void *page)
+{
+    struct frame *frame = page_frame(pool, page);
+    ASSERT(frame->pin_count || frame->latch.version & 1);
+    __atomic_store_n(&frame->dirty, 1, __ATOMIC_RELAXED);
+}
+
+// one read or write of pages contiguous in the file, around the frames: none
+// of them may be cached in the pool. a read that finds one returns 1, the
+// pages were given to the pool after the caller looked them up. buf is page
+// aligned for O_DIRECT
+static int __buffer_pool_extent_io(struct buffer_pool *pool, __u64 pid, void *buf, __u32 pages, int write)
+{
+    for (__u32 i = 0; i < pages; i++)
+    {
+        if (!write && *table_slot(pool, pid + i))
+            return 1;
+        ASSERT(!*table_slot(pool, pid + i));
+    }
+
+    struct io_uring_sqe *sqe = buffer_pool_sqe(pool, &pool->op_extent.inner, buffer_sync_done);
+    if (!sqe)
+        return -EBUSY;
+
+    __u64 len = (__u64)pages * BUFFER_PAGE_SIZE;
+    if (write)
+        io_uring_prep_write(sqe, pool->fd, buf, len, pid * BUFFER_PAGE_SIZE);
+    else
+        io_uring_prep_read(sqe, pool->fd, buf, len, pid * BUFFER_PAGE_SIZE);
+    pool->op_extent.res = 0;
+    pool->inflight++;
+
+    int ret = buffer_pool_wait(pool);
+    if (ret)
+        return ret;
+    if (pool->op_extent.res < 0)
+        return pool->op_extent.res;
+
+    return (__u64)pool->op_extent.res == len ? 0 : -EIO;
+}
+
+int buffer_pool_extent_io(struct buffer_pool *pool, __u64 pid, void *buf, __u32 pages, int write)
+{
+    pthread_mutex_lock(&pool->lock);
+    int ret = __buffer_pool_extent_io(pool, pid, buf, pages, write);
+    pthread_mutex_unlock(&pool->lock);
+
+    return ret;
+}
+
+__u64 buffer_pool_pid(struct buffer_pool *pool, void *page)
+{
+    return page_frame(pool, page)->pid;
+}
+
+// with no writer running: a page written while it goes out could lose its
+// dirty bit
+static int __buffer_pool_flush(struct buffer_pool *pool)
+{
+    int ret = 0;
+
+    // dirty pages go out in batches that fit the completion queue, then a
+    // single fsync makes them durable
+    for (__u32 start = 0; start < pool->len && !ret;)
+    {
+        __u32 end = start;
+        __u32 submitted = 0;
+        for (; end < pool->len && submitted < BUFFER_FLUSH_BATCH; end++)
+        {
+            struct frame *frame = &pool->frames[end];
+            if (frame->state != FRAME_READY || !frame->dirty)
+                continue;
+
+            ret = frame_submit(pool, frame, 1);
+            if (ret)
+                break;
+            submitted++;
+        }
+
+        int wait_ret = buffer_pool_wait(pool);
+        if (!ret)
+            ret = wait_ret;
+
+        // the batch is the submitted dirty frames of [start, end)
+        for (__u32 i = start; i < end && submitted; i++)
+        {
+            struct frame *frame = &pool->frames[i];
+            if (frame->state != FRAME_READY || !frame->dirty)
+                continue;
+            submitted--;
+
+            int res = frame_res(frame);
+            if (res)
+            {
+                if (!ret)
+                    ret = res;
+                continue;
+            }
+
+            frame->dirty = 0;
+            pool->writebacks++;
+        }
+
+        start = end;
+    }
+
+    if (ret)
+        return ret;
+
+    struct io_uring_sqe *sqe = buffer_pool_sqe(pool, &pool->op_sync.inner, buffer_sync_done);
+    if (!sqe)
+        return -EBUSY;
+    io_uring_prep_fsync(sqe, pool->fd, 0);
+    pool->inflight++;
+
+    ret = buffer_pool_wait(pool);
+    if (ret)
+        return ret;
+
+    return pool->op_sync.res;
+}
+
+int buffer_pool_flush(struct buffer_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    int ret = __buffer_pool_flush(pool);
+    pthread_mutex_unlock(&pool->lock);
+
+    return ret;
+}
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "tree/cell.h"
 #include "utils.h"
 
@@ -19,7 +20,28 @@ __u8 *cell_get_key(struct cell *cell)
     return &cell->content[0];
 }
 
-struct node *internal_cell_child(struct cell *cell)
+__u64 internal_cell_child(struct cell *cell)
 {
-    return (struct node *)cell->pid;
-}
\ No newline at end of file
+    return cell->pid;
+}
+
+// bytes taken in the node, cells start 4 byte aligned
+__u32 cell_size(struct cell *cell)
+{
+    return ALIGN((__u32)sizeof(*cell) + cell->total_size, sizeof(__u32));
+}
+
+// orders as the keys do: shorter keys pad with zeros and sort first on ties
+__u32 cell_key_prefix(__u8 *key, __u32 key_size)
+{
+    __u32 prefix = 0;
+    if (key_size >= sizeof(prefix))
+    {
+        memcpy(&prefix, key, sizeof(prefix));
+        return __builtin_bswap32(prefix);
+    }
+
+    for (__u32 i = 0; i < sizeof(prefix); i++)
+        prefix = prefix << 8 | (i < key_size ? key[i] : 0);
+    return prefix;
+}
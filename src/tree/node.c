@@ -1,5 +1,9 @@
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(ENABLE_SIMD_SEARCH) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "utils.h"
 
 #include "tree/node.h"
@@ -14,7 +18,9 @@ void node_init(struct node *node, __u32 flags)
     node->last_overflow_pid = 0;
     node->next_overflow_pid = 0;
     node->parent_pid = 0;
-    node_set_rightmost_child(node, NULL);
+    node->prev_leaf_pid = 0;
+    node->next_leaf_pid = 0;
+    node_set_rightmost_child(node, 0);
     node->tombstone_bytes = 0;
     node->cell_offset = NODE_SIZE;
     node->flags = flags;
@@ -30,11 +36,11 @@ void debug_node_cell(struct node *node, struct cell *cell)
         {
             LOG("flags: %u\n", cell->flags);
             LOG("value_size: %u\n", cell->value_size);
-            LOG("value: %.*s\n", cell->value_size, leaf_cell_get_value(cell));
+            LOG("value: %.*s\n", cell->flags & CELL_FLAG_OVERFLOW ? NODE_OVERFLOW_PREFIX : cell->value_size, leaf_cell_get_value(cell));
         }
         else
         {
-            LOG("pid: %p\n", (struct node *)cell->pid);
+            LOG("pid: %llu\n", cell->pid);
         }
         LOG("offset: %u\n", offset_from_cell(node, cell));
     }
@@ -61,10 +67,11 @@ void debug_node(struct node *node, int show_cells, int show_tombstones)
     LOG("size: %u\n", node->size);
     LOG("tombstone_offset: %u\n", node->tombstone_offset);
     LOG("flags: %u\n", node->flags);
-    LOG("last_overflow_pid: %p\n", (struct node *)node->last_overflow_pid);
-    LOG("next_overflow_pid: %p\n", (struct node *)node->next_overflow_pid);
-    LOG("parent_pid: %p\n", node_parent(node));
-    LOG("rightmost_pid: %p\n", (struct node *)node->rightmost_pid);
+    LOG("last_overflow_pid: %llu\n", node->last_overflow_pid);
+    LOG("next_overflow_pid: %llu\n", node->next_overflow_pid);
+    LOG("parent_pid: %llu\n", node_parent(node));
+    LOG("rightmost_pid: %llu\n", node->rightmost_pid);
+    LOG("prev_leaf_pid: %llu next_leaf_pid: %llu\n", node->prev_leaf_pid, node->next_leaf_pid);
     LOG("tombstone_bytes: %u\n", node->tombstone_bytes);
     LOG("cell_offset: %u\n", node->cell_offset);
     LOG("free_bytes: %lu\n", node->cell_offset - (sizeof(struct node) + sizeof(struct cell_ptr) * node->size));
@@ -99,6 +106,13 @@ void node_cell_pointers(struct node *node, struct cell_ptr *cell_ptr, struct cel
         pointers->key_size = cell->key_size;
         pointers->value = leaf_cell_get_value(cell);
         pointers->value_size = cell->value_size;
+        pointers->overflow_pid = 0;
+        if (cell->flags & CELL_FLAG_OVERFLOW)
+        {
+            struct btree_overflowed_cell_suffix suffix;
+            memcpy(&suffix, pointers->value + NODE_OVERFLOW_PREFIX, sizeof(suffix));
+            pointers->overflow_pid = suffix.overflow_pid;
+        }
     }
     else
     {
@@ -106,22 +120,23 @@ void node_cell_pointers(struct node *node, struct cell_ptr *cell_ptr, struct cel
         pointers->key_size = cell->key_size;
         pointers->value = NULL;
         pointers->value_size = 0;
+        pointers->overflow_pid = 0;
     }
 }
 
-struct node *node_parent(struct node *node)
+__u64 node_parent(struct node *node)
 {
-    return (struct node *)node->parent_pid;
+    return node->parent_pid;
 }
 
-void node_set_parent(struct node *node, struct node *parent)
+void node_set_parent(struct node *node, __u64 parent_pid)
 {
-    node->parent_pid = (__u64)parent;
+    node->parent_pid = parent_pid;
 }
 
-void node_set_rightmost_child(struct node *node, struct node *child)
+void node_set_rightmost_child(struct node *node, __u64 child_pid)
 {
-    node->rightmost_pid = (__u64)child;
+    node->rightmost_pid = child_pid;
 }
 
 void node_set_root(struct node *node)
@@ -165,6 +180,10 @@ struct cell *node_cell_from_idx(struct node *node, __u32 idx)
 
 int key_compare(struct node *node, struct cell_ptr *cell_p, __u8 *key, __u32 key_size)
 {
+    // a stale slot of an optimistic read, the reader does not trust the result
+    if (cell_p->offset >= NODE_SIZE)
+        return 0;
+
     struct cell *cell = node_cell_from_ptr(node, cell_p);
 
     return key_compare_cell(cell, key, key_size);
@@ -178,12 +197,84 @@ int key_compare_cell(struct cell *cell, __u8 *key, __u32 key_size)
 int __key_compare(__u8 *cell_key, __u32 cell_key_size, __u8 *key, __u32 key_size)
 {
     int cmp = memcmp(cell_key, key, min(key_size, cell_key_size));
+    // a key sorts after its own prefixes, as the slot prefixes do
     if (cmp == 0)
-        cmp = key_size - cell_key_size;
+        cmp = (int)cell_key_size - (int)key_size;
 
     return cmp;
 }
 
+#ifdef ENABLE_KEY_PREFIX
+// slots left to the prefix counter once halving on prefixes narrowed them down
+#ifndef NODE_SEARCH_WINDOW
+#define NODE_SEARCH_WINDOW (32)
+#endif
+
+typedef __u32 (*node_prefix_count_fn)(struct cell_ptr *slots, __u32 len, __u32 prefix);
+
+// slots with a prefix below prefix
+static __u32 node_prefix_count_scalar(struct cell_ptr *slots, __u32 len, __u32 prefix)
+{
+    __u32 count = 0;
+    for (__u32 i = 0; i < len; i++)
+        count += slots[i].prefix < prefix;
+
+    return count;
+}
+
+#if defined(ENABLE_SIMD_SEARCH) && defined(__x86_64__)
+// four (offset, prefix) slots per compare, the prefixes are the odd lanes and
+// are biased to signed as avx2 only compares signed integers; lanes past len
+// still lie in the node page and are masked out
+__attribute__((target("avx2"))) static __u32 node_prefix_count_avx2(struct cell_ptr *slots, __u32 len, __u32 prefix)
+{
+    __m256i bias = _mm256_set1_epi32(INT_MIN);
+    __m256i key = _mm256_set1_epi32((int)(prefix ^ (__u32)INT_MIN));
+    __u32 count = 0;
+
+    for (__u32 i = 0; i < len; i += 4)
+    {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)&slots[i]), bias);
+        __u32 bits = (__u32)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(key, v)));
+        __u32 lanes = min(len - i, 4u);
+
+        count += __builtin_popcount(bits & 0xAA & ((1u << (lanes * 2)) - 1));
+    }
+
+    return count;
+}
+#endif
+
+static node_prefix_count_fn node_prefix_count = node_prefix_count_scalar;
+
+// picked once for the cpu the process runs on
+__attribute__((constructor)) static void node_prefix_count_select(void)
+{
+#if defined(ENABLE_SIMD_SEARCH) && defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+        node_prefix_count = node_prefix_count_avx2;
+#endif
+}
+
+// first slot with a prefix not below prefix, prefixes are sorted as the keys
+static __u32 node_prefix_lower_bound(struct node *node, __u32 prefix)
+{
+    struct cell_ptr *cell_ptrs = node_cells(node);
+    __u32 low = 0, mid, high = node->size;
+
+    while (high - low > NODE_SEARCH_WINDOW)
+    {
+        mid = (low + high) / 2;
+        if (cell_ptrs[mid].prefix < prefix)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low + node_prefix_count(&cell_ptrs[low], high - low, prefix);
+}
+#endif
+
 int node_bin_search(struct node *node, __u8 *key, __u32 key_size, __u32 *idx)
 {
     struct cell_ptr *cell_ptrs = node_cells(node);
@@ -191,6 +282,19 @@ int node_bin_search(struct node *node, __u8 *key, __u32 key_size, __u32 *idx)
 
     int cmp;
     __u32 low = 0, mid = 0, high = node->size;
+#ifdef ENABLE_KEY_PREFIX
+    __u32 prefix = cell_key_prefix(key, key_size);
+
+    // most prefixes are unique: a miss reads no cell and a hit reads one
+    low = node_prefix_lower_bound(node, prefix);
+    if (low == node->size || cell_ptrs[low].prefix != prefix)
+    {
+        *idx = low;
+        return 0;
+    }
+    if (low + 1 == node->size || cell_ptrs[low + 1].prefix != prefix)
+        high = low + 1;
+#endif
 
     while (low < high)
     {
@@ -198,7 +302,13 @@ int node_bin_search(struct node *node, __u8 *key, __u32 key_size, __u32 *idx)
         // LOG("low: %u | mid: %u | high: %u\n", low, mid, high);
 
         cell_p = &cell_ptrs[mid];
-        cmp = key_compare(node, cell_p, key, key_size);
+#ifdef ENABLE_KEY_PREFIX
+        // only equal prefixes need the key in the cell body
+        if (cell_p->prefix != prefix)
+            cmp = cell_p->prefix > prefix ? 1 : -1;
+        else
+#endif
+            cmp = key_compare(node, cell_p, key, key_size);
         if (cmp == 0)
         {
             *idx = mid;
@@ -233,78 +343,134 @@ __u32 offset_from_cell(struct node *node, struct cell *cell)
 
 int node_is_full(struct node *node, __u32 key_size, __u32 value_size)
 {
-    __u32 hdr_offset_limit = sizeof(struct node) + sizeof(struct cell_ptr) * node->size;
-    __u32 free_space = node->cell_offset - hdr_offset_limit;
+    // the new cell also takes a cell_ptr slot
+    __u32 hdr_offset_limit = sizeof(struct node) + sizeof(struct cell_ptr) * (node->size + 1);
     __u32 new_cell_size = ALIGN(key_size + value_size + sizeof(struct cell), sizeof(__u32));
+    __s64 free_space = (__s64)node->cell_offset - hdr_offset_limit;
 
-    if (free_space < new_cell_size)
-    {
-        struct cell *tombstone;
-        __u32 next_off = node->tombstone_offset;
-        // follow tombstone list
-        while (next_off != 0)
-        {
-            tombstone = node_cell_from_offset(node, next_off);
-            if (tombstone->tombstone_size >= new_cell_size)
-                return 0;
-            next_off = tombstone->next_off;
-        }
-        return 1;
-    }
+    // tombstones too small for the cell are reclaimed by compacting the node
+    return free_space + node->tombstone_bytes < new_cell_size;
+}
 
-    return 0;
+// links the tombstone at prev_off, the list head if 0, to next_off. cells are
+// packed, no pointer into one is taken
+static void node_tombstone_link(struct node *node, __u32 prev_off, __u32 next_off)
+{
+    if (prev_off)
+        node_cell_from_offset(node, prev_off)->next_off = next_off;
+    else
+        node->tombstone_offset = next_off;
 }
 
 __u32 node_get_free_offset(struct node *node, __u32 key_size, __u32 value_size)
 {
-    __u32 hdr_offset_limit = sizeof(struct node) + sizeof(struct cell_ptr) * node->size;
-    __u32 free_space = node->cell_offset - hdr_offset_limit;
+    // the new cell also takes a cell_ptr slot
+    __u32 hdr_offset_limit = sizeof(struct node) + sizeof(struct cell_ptr) * (node->size + 1);
     __u32 new_cell_size = ALIGN(key_size + value_size + sizeof(struct cell), sizeof(__u32));
+    __s64 free_space = (__s64)node->cell_offset - hdr_offset_limit;
     __u32 offset;
 
-    if (free_space < new_cell_size)
+    if (free_space >= new_cell_size)
+        return node->cell_offset - new_cell_size;
+
+    if (free_space >= 0)
     {
         struct cell *tombstone, *new_tombstone;
-        // follow tombstone list
-        if (node->tombstone_offset != 0)
+        __u32 prev_off = 0;
+        // follow tombstone list, first fit
+        for (offset = node->tombstone_offset; offset != 0; prev_off = offset, offset = tombstone->next_off)
         {
-            tombstone = node_cell_from_offset(node, node->tombstone_offset);
-            if (new_cell_size <= tombstone->tombstone_size)
+            tombstone = node_cell_from_offset(node, offset);
+            if (new_cell_size > tombstone->tombstone_size)
+                continue;
+
+            __u32 diff = tombstone->tombstone_size - new_cell_size;
+
+            // the rest stays a tombstone if it can hold its header
+            if (diff >= sizeof(struct cell))
             {
-                offset = node->tombstone_offset;
-                __u32 diff = tombstone->tombstone_size - new_cell_size;
-                __u32 new_tombstone_offset;
-
-                // TODO: handle remaining space in tombstone
-                if (diff > ALIGN(sizeof(struct cell), sizeof(__u32)))
-                {
-                    new_tombstone = (struct cell *)((void *)tombstone + new_cell_size);
-                    new_tombstone->tombstone_size = diff - sizeof(struct cell);
-                    new_tombstone->next_off = tombstone->next_off;
-
-                    new_tombstone_offset = offset_from_cell(node, new_tombstone);
-                }
-                else
-                {
-                    new_tombstone_offset = tombstone->next_off;
-                }
-                node->tombstone_offset = new_tombstone_offset;
-                node->tombstone_bytes -= new_cell_size;
-
-                // LOG("using tombstone\n");
-                return offset;
+                new_tombstone = (struct cell *)((void *)tombstone + new_cell_size);
+                new_tombstone->tombstone_size = diff;
+                new_tombstone->next_off = tombstone->next_off;
+
+                node_tombstone_link(node, prev_off, offset_from_cell(node, new_tombstone));
             }
+            else
+                node_tombstone_link(node, prev_off, tombstone->next_off);
+            // a rest too short for a header stays counted, node_compact takes it back
+            node->tombstone_bytes -= new_cell_size;
+
+            // LOG("using tombstone\n");
+            return offset;
         }
+    }
+
+    if (free_space + node->tombstone_bytes < new_cell_size)
+        return 0;
+
+    // enough bytes, scattered in tombstones: compacting beats a split
+    node_compact(node);
+    ASSERT(node->cell_offset >= hdr_offset_limit + new_cell_size);
+
+    return node->cell_offset - new_cell_size;
+}
+
+// rewrite the live cells packed at the end of the node in slot order, the
+// tombstones become free space; pointers to cells of the node are stale after
+void node_compact(struct node *node)
+{
+    __u8 buf[NODE_SIZE];
+    struct cell_ptr *cell_ptrs = node_cells(node);
+    __u32 offset = NODE_SIZE;
 
-        // TODO: check if clean space in this node (rewrite tuples in order) might save a lot of space instead of split
+    for (__u32 i = 0; i < node->size; i++)
+    {
+        struct cell *cell = node_cell_from_ptr(node, &cell_ptrs[i]);
+        __u32 size = cell_size(cell);
 
-        // LOG("zeroed offset, free space %d\n", free_space);
-        offset = 0;
+        offset -= size;
+        memcpy(buf + offset, cell, size);
+        cell_ptrs[i].offset = offset;
     }
-    else
-        offset = node->cell_offset - new_cell_size;
+    memcpy((void *)node + offset, buf + offset, NODE_SIZE - offset);
+
+    node->cell_offset = offset;
+    node->tombstone_offset = 0;
+    node->tombstone_bytes = 0;
+}
 
-    return offset;
+// slots and cell extents, what the node takes of NODE_CAPACITY once compacted
+__u32 node_live_bytes(struct node *node)
+{
+    return NODE_SIZE - node->cell_offset - node->tombstone_bytes + node->size * sizeof(struct cell_ptr);
+}
+
+// copy of a leaf or internal cell of another node at slot idx, the node must have room for it
+void node_insert_cell(struct node *node, __u32 idx, struct cell *cell)
+{
+    struct cell_ptr *cell_ptrs = node_cells(node);
+    __u32 offset = node_get_free_offset(node, cell->key_size, cell->total_size - cell->key_size);
+    ASSERT(offset > 0);
+
+    memmove(&cell_ptrs[idx + 1], &cell_ptrs[idx], (node->size - idx) * sizeof(struct cell_ptr));
+    cell_ptrs[idx].offset = offset;
+#ifdef ENABLE_KEY_PREFIX
+    cell_ptrs[idx].prefix = cell_key_prefix(cell_get_key(cell), cell->key_size);
+#endif
+    memcpy(node_cell_from_offset(node, offset), cell, sizeof(*cell) + cell->total_size);
+
+    if (offset < node->cell_offset)
+        node->cell_offset = offset;
+    node->size++;
+}
+
+void node_remove_cell(struct node *node, __u32 idx)
+{
+    struct cell_ptr *cell_ptrs = node_cells(node);
+
+    node_tuple_set_tombstone(node, idx);
+    memmove(&cell_ptrs[idx], &cell_ptrs[idx + 1], (node->size - (idx + 1)) * sizeof(struct cell_ptr));
+    node->size--;
 }
 
 int node_is_leaf(struct node *node)
@@ -326,20 +492,31 @@ int node_insert_nonfull(struct node *leaf, __u32 idx, __u8 *key, __u32 key_size,
     return 0;
 }
 
-__u32 node_partition_idx(struct node *node)
+// first slot past percent of the live bytes, a full node can hold tombstones it
+// could not reuse. both sides keep a cell, an internal node also the one moving up
+__u32 node_partition_idx(struct node *node, __u32 percent)
 {
     ASSERT(node->size >= 0);
     struct cell_ptr *cell_ptrs = node_cells(node);
     struct cell *cell;
 
+    __u32 live_bytes = 0;
+    for (__u32 i = 0; i < node->size; i++)
+    {
+        cell = node_cell_from_ptr(node, &cell_ptrs[i]);
+        live_bytes += sizeof(struct cell_ptr) + sizeof(*cell) + cell->total_size;
+    }
+
     __u32 i = 0;
-    __u32 middle_bytes = 0;
-    for (; i < node->size && middle_bytes < (NODE_SIZE / 2 - sizeof(struct node)); i++)
+    __u32 left_bytes = 0;
+    for (; i < node->size && left_bytes < (__u64)live_bytes * percent / 100; i++)
     {
         cell = node_cell_from_ptr(node, &cell_ptrs[i]);
-        middle_bytes += sizeof(*cell) + cell->total_size;
+        left_bytes += sizeof(struct cell_ptr) + sizeof(*cell) + cell->total_size;
     }
-    return i;
+
+    __u32 last = node->size - (node_is_leaf(node) ? 1 : 2);
+    return max(min(i, last), 1u);
 }
 
 void internal_node_split(struct node *node, struct node *new_node, __u32 partition_idx)
@@ -354,12 +531,17 @@ void internal_node_split(struct node *node, struct node *new_node, __u32 partiti
     // write first half to new node, stop when node is half empty
     // TODO: write last half to the new node, and keep the first half in the current node, if needed clean the node
 
+    // the child of the partition cell becomes the rightmost of the left half,
+    // the right half takes over the rightmost child
+    node_set_rightmost_child(new_node, node->rightmost_pid);
+    node_set_rightmost_child(node, internal_cell_child(node_cell_from_idx(node, partition_idx)));
+
     // LOG("partition_idx: %d, len: %d\n", partition_idx, node->size);
     node_tuple_set_tombstone(node, partition_idx);
     for (__u32 j = 0, k = partition_idx + 1; k < node->size; k++, j++)
     {
         cell = node_cell_from_ptr(node, &cell_ptrs[k]);
-        new_node->cell_offset -= sizeof(*cell) + cell->key_size;
+        new_node->cell_offset -= cell_size(cell);
         new_cell_ptrs[j].offset = new_node->cell_offset;
 
         node_write_internal_cell(new_node, &new_cell_ptrs[j], cell_get_key(cell), cell->key_size, internal_cell_child(cell), 0);
@@ -388,10 +570,12 @@ void leaf_node_split(struct node *node, struct node *new_node, __u32 partition_i
     for (__u32 j = 0, k = partition_idx; k < node->size; k++, j++)
     {
         cell = node_cell_from_ptr(node, &cell_ptrs[k]);
-        new_node->cell_offset -= sizeof(*cell) + cell->key_size + cell->value_size;
+        new_node->cell_offset -= cell_size(cell);
+        new_cell_ptrs[j] = cell_ptrs[k];
         new_cell_ptrs[j].offset = new_node->cell_offset;
 
-        node_write_leaf_cell(new_node, &new_cell_ptrs[j], cell_get_key(cell), cell->key_size, leaf_cell_get_value(cell), cell->value_size, 0);
+        // copied whole, an overflowed value keeps its inline part and flags
+        memcpy(node_cell_from_ptr(new_node, &new_cell_ptrs[j]), cell, cell_size(cell));
         node_tuple_set_tombstone(node, k);
     }
 
@@ -404,7 +588,6 @@ void leaf_node_split(struct node *node, struct node *new_node, __u32 partition_i
 
 int node_delete_key(struct node *node, __u8 *key, __u32 key_size)
 {
-    struct cell_ptr *cell_ptrs = node_cells(node);
     struct cell_ptr *cell_ptr;
     __u32 idx;
     int ret;
@@ -417,30 +600,91 @@ int node_delete_key(struct node *node, __u8 *key, __u32 key_size)
     if (!cell_ptr)
         return 1;
 
-    node_tuple_set_tombstone(node, idx);
-
-    memmove(&cell_ptrs[idx], &cell_ptrs[idx + 1], (node->size - (idx + 1)) * sizeof(struct cell_ptr));
-    node->size--;
+    node_remove_cell(node, idx);
 
     return 0;
 }
 
-void node_tuple_set_tombstone(struct node *node, __u32 idx)
+// bytes of the cell area become a tombstone, or free space at its boundary
+static void node_free_extent(struct node *node, __u32 offset, __u32 size)
 {
-    struct cell_ptr *cell_ptrs = node_cells(node);
-    struct cell_ptr *cell_ptr = &cell_ptrs[idx];
+    struct cell *cell;
 
-    // TODO: merge tombstone if neighbours
-    struct cell *last_tombstone = node_cell_from_offset(node, node->tombstone_offset);
+    // tombstones right before or after the extent are merged into it
+    __u32 prev_off = 0;
+    __u32 tombstone_off = node->tombstone_offset;
+    while (tombstone_off != 0)
+    {
+        struct cell *tombstone = node_cell_from_offset(node, tombstone_off);
+        __u32 next_off = tombstone->next_off;
 
-    struct cell *cell = node_cell_from_ptr(node, cell_ptr);
+        if (tombstone_off + tombstone->tombstone_size != offset && offset + size != tombstone_off)
+        {
+            prev_off = tombstone_off;
+            tombstone_off = next_off;
+            continue;
+        }
+
+        if (tombstone_off < offset)
+            offset = tombstone_off;
+        size += tombstone->tombstone_size;
+        node->tombstone_bytes -= tombstone->tombstone_size;
+        node_tombstone_link(node, prev_off, next_off);
+        tombstone_off = next_off;
+    }
+
+    // the lowest extent goes back to the free space
+    if (offset == node->cell_offset)
+    {
+        node->cell_offset += size;
+        return;
+    }
 
-    cell->tombstone_size = sizeof(*cell) + cell->total_size;
+    cell = node_cell_from_offset(node, offset);
+    cell->tombstone_size = size;
     cell->next_off = node->tombstone_offset;
-    node->tombstone_offset = offset_from_cell(node, cell);
-    node->tombstone_bytes += cell->tombstone_size;
+    node->tombstone_offset = offset;
+    node->tombstone_bytes += size;
+}
+
+void node_tuple_set_tombstone(struct node *node, __u32 idx)
+{
+    struct cell_ptr *cell_ptr = node_get_cell_ptr(node, idx);
+    node_free_extent(node, cell_ptr->offset, cell_size(node_cell_from_ptr(node, cell_ptr)));
+}
+
+// overwrites the value of the leaf cell at idx, 1 if it does not fit the cell
+// extent. the extent left over by a shorter value is freed
+int node_update_leaf_cell(struct node *node, __u32 idx, __u8 *value, __u32 value_size)
+{
+    struct cell_ptr *cell_ptr = node_get_cell_ptr(node, idx);
+    struct cell *cell = node_cell_from_ptr(node, cell_ptr);
+    __u32 old_size = cell_size(cell);
+    __u32 new_size = ALIGN(sizeof(struct cell) + cell->key_size + value_size, sizeof(__u32));
 
-    (void)last_tombstone;
+    if (new_size > old_size)
+        return 1;
+
+    cell->flags = 0;
+    cell->value_size = value_size;
+    cell->total_size = cell->key_size + value_size;
+    memcpy(leaf_cell_get_value(cell), value, value_size);
+
+    // a rest too short for a tombstone header is not linked, it is counted
+    // with the tombstones until node_compact takes it back
+    if (old_size - new_size >= sizeof(struct cell))
+        node_free_extent(node, cell_ptr->offset + new_size, old_size - new_size);
+    else
+        node->tombstone_bytes += old_size - new_size;
+
+    return 0;
+}
+
+// the cell holds the inline part of a value_size bytes value
+void node_cell_set_overflow(struct cell *cell, __u32 value_size)
+{
+    cell->flags |= CELL_FLAG_OVERFLOW;
+    cell->value_size = value_size;
 }
 
 void node_insert_leaf_cell(struct node *node, __u32 offset, __u32 idx, __u8 *key, __u32 key_size, __u8 *value, __u32 value_size)
@@ -448,29 +692,33 @@ void node_insert_leaf_cell(struct node *node, __u32 offset, __u32 idx, __u8 *key
     struct cell_ptr *cell_ptrs = node_cells(node);
     struct cell_ptr *cell_ptr = &cell_ptrs[idx];
 
-    // TODO: implement append to the end and mark the page as unsorted keys after certain index
-    memmove(&cell_ptrs[idx + 1], &cell_ptrs[idx], (node->size - idx) * sizeof(struct cell_ptr));
+    // an append in key order shifts nothing
+    if (idx < node->size)
+        memmove(&cell_ptrs[idx + 1], &cell_ptrs[idx], (node->size - idx) * sizeof(struct cell_ptr));
     cell_ptr->offset = offset;
 
     // LOG("writing leaf cell at offset: %d idx: %d\n", offset, idx);
     node_write_leaf_cell(node, &cell_ptrs[idx], key, key_size, value, value_size, 0);
 
-    node->cell_offset = offset;
+    // a reused tombstone lies above the free space
+    if (offset < node->cell_offset)
+        node->cell_offset = offset;
     node->size++;
 }
 
-void node_insert_internal_cell(struct node *node, __u32 offset, __u32 idx, __u8 *key, __u32 key_size, struct node *child)
+void node_insert_internal_cell(struct node *node, __u32 offset, __u32 idx, __u8 *key, __u32 key_size, __u64 child_pid)
 {
     struct cell_ptr *cell_ptrs = node_cells(node);
     struct cell_ptr *cell_ptr = &cell_ptrs[idx];
 
-    // TODO: implement append to the end and mark the page as unsorted keys after certain index
-    memmove(&cell_ptrs[idx + 1], &cell_ptrs[idx], (node->size - idx) * sizeof(struct cell_ptr));
+    if (idx < node->size)
+        memmove(&cell_ptrs[idx + 1], &cell_ptrs[idx], (node->size - idx) * sizeof(struct cell_ptr));
     cell_ptr->offset = offset;
 
-    node_write_internal_cell(node, &cell_ptrs[idx], key, key_size, child, 0);
+    node_write_internal_cell(node, &cell_ptrs[idx], key, key_size, child_pid, 0);
 
-    node->cell_offset = offset;
+    if (offset < node->cell_offset)
+        node->cell_offset = offset;
     node->size++;
 }
 
@@ -483,15 +731,21 @@ void node_write_leaf_cell(struct node *node, struct cell_ptr *cell_ptr, __u8 *ke
     cell->total_size = key_size + value_size;
     memcpy(cell_get_key(cell), key, key_size);
     memcpy(leaf_cell_get_value(cell), value, value_size);
+#ifdef ENABLE_KEY_PREFIX
+    cell_ptr->prefix = cell_key_prefix(key, key_size);
+#endif
 }
 
-void node_write_internal_cell(struct node *node, struct cell_ptr *cell_ptr, __u8 *key, __u32 key_size, struct node *child, __u16 flags)
+void node_write_internal_cell(struct node *node, struct cell_ptr *cell_ptr, __u8 *key, __u32 key_size, __u64 child_pid, __u16 flags)
 {
     (void)flags;
 
     struct cell *cell = node_cell_from_ptr(node, cell_ptr);
     cell->key_size = key_size;
     cell->total_size = key_size;
-    cell->pid = (__u64)child;
+    cell->pid = child_pid;
     memcpy(cell_get_key(cell), key, key_size);
+#ifdef ENABLE_KEY_PREFIX
+    cell_ptr->prefix = cell_key_prefix(key, key_size);
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,307 @@
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "utils.h"
+#include "scheduler.h"
+#include "wal.h"
+
+#define WAL_PAGE_HDR (sizeof(struct wal_page))
+
+#ifndef __SSE4_2__
+static __u32 crc32c_table[256];
+
+__attribute__((constructor)) static void crc32c_table_init(void)
+{
+    for (__u32 i = 0; i < 256; i++)
+    {
+        __u32 crc = i;
+        for (__u32 j = 0; j < 8; j++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+}
+#endif
+
+// crc32c (castagnoli), the sse4.2 crc32 instruction when the target has it
+__u32 wal_checksum(__u32 crc, const void *data, __u64 len)
+{
+    const __u8 *p = data;
+    crc = ~crc;
+
+#ifdef __SSE4_2__
+    for (; len >= sizeof(__u64); len -= sizeof(__u64), p += sizeof(__u64))
+    {
+        __u64 word;
+        memcpy(&word, p, sizeof(word));
+        crc = (__u32)__builtin_ia32_crc32di(crc, word);
+    }
+    for (; len; len--, p++)
+        crc = __builtin_ia32_crc32qi(crc, *p);
+#else
+    for (; len; len--, p++)
+        crc = crc32c_table[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+#endif
+
+    return ~crc;
+}
+
+static __u32 wal_record_size(__u32 len)
+{
+    return ALIGN((__u32)sizeof(struct wal_record) + len, WAL_RECORD_ALIGN);
+}
+
+static __u32 wal_record_checksum(struct wal_record *record)
+{
+    return wal_checksum(0, &record->len, sizeof(*record) - offsetof(struct wal_record, len) + record->len);
+}
+
+static __u32 wal_page_checksum(struct wal_page *page)
+{
+    struct wal_page hdr = *page;
+    hdr.crc = 0;
+    return wal_checksum(0, &hdr, sizeof(hdr));
+}
+
+static inline struct wal_slot *wal_slot(struct wal *wal, __u64 page_no)
+{
+    return &wal->slots[page_no % WAL_BUF_PAGES];
+}
+
+void *wal_page_buf(struct wal *wal, __u64 page_no)
+{
+    return wal->buf + (page_no % WAL_BUF_PAGES) * WAL_PAGE_SIZE;
+}
+
+static void wal_slot_reset(struct wal_slot *slot)
+{
+    slot->filled = WAL_PAGE_HDR;
+    slot->end = WAL_PAGE_SIZE;
+    slot->waiters = NULL;
+}
+
+int wal_init(struct wal *wal, __u64 pages, __u64 epoch)
+{
+    // page aligned for O_DIRECT and registered as the write buffer
+    wal->buf = mmap(NULL, (__u64)WAL_BUF_PAGES * WAL_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (wal->buf == MAP_FAILED)
+        return -ENOMEM;
+
+    for (__u32 i = 0; i < WAL_BUF_PAGES; i++)
+        wal_slot_reset(&wal->slots[i]);
+
+    wal->epoch = epoch;
+    wal->pages = pages;
+    wal->reserved = 0;
+    wal->submitted_page = 0;
+    wal->written_page = 0;
+    wal->durable_lsn = 0;
+    wal->appended = 0;
+    wal->sealed = 0;
+
+    return 0;
+}
+
+void wal_free(struct wal *wal)
+{
+    munmap(wal->buf, (__u64)WAL_BUF_PAGES * WAL_PAGE_SIZE);
+}
+
+// close the page at the front of the log to new records, padding the rest
+static void wal_page_close(struct wal *wal, __u64 page_no, __u32 end)
+{
+    struct wal_slot *slot = wal_slot(wal, page_no);
+    __atomic_store_n(&slot->end, end, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&slot->filled, WAL_PAGE_SIZE - end, __ATOMIC_RELEASE);
+}
+
+// lock free: appenders race on a compare and swap of the reserved position,
+// copy outside of it and publish the bytes with an add on the page counter
+int wal_append(struct wal *wal, const void *data, __u32 len, struct wal_waiter *waiter, __u64 *ret_lsn)
+{
+    if (len > WAL_RECORD_MAX)
+        return -E2BIG;
+
+    __u32 size = wal_record_size(len);
+    __u64 pos = __atomic_load_n(&wal->reserved, __ATOMIC_RELAXED);
+    __u64 start, page_no;
+    __u32 off;
+
+    for (;;)
+    {
+        page_no = pos / WAL_PAGE_SIZE;
+        off = pos % WAL_PAGE_SIZE;
+
+        if (off == 0)
+            start = pos + WAL_PAGE_HDR;
+        else if (off + size > WAL_PAGE_SIZE)
+            start = (++page_no) * WAL_PAGE_SIZE + WAL_PAGE_HDR;
+        else
+            start = pos;
+
+        if (page_no >= wal->pages)
+            return -ENOSPC;
+        // the slot still holds a page being written
+        if (page_no - __atomic_load_n(&wal->written_page, __ATOMIC_ACQUIRE) >= WAL_BUF_PAGES)
+            return -EAGAIN;
+
+        if (__atomic_compare_exchange_n(&wal->reserved, &pos, start + size, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    // the record did not fit, this appender closes the previous page
+    if (off && start != pos)
+        wal_page_close(wal, page_no - 1, off);
+
+    struct wal_record *record = wal_page_buf(wal, page_no) + start % WAL_PAGE_SIZE;
+    record->len = len;
+    record->lsn = start;
+    memcpy(record->data, data, len);
+    record->crc = wal_record_checksum(record);
+
+    struct wal_slot *slot = wal_slot(wal, page_no);
+    if (waiter)
+    {
+        waiter->lsn = start;
+        waiter->next = __atomic_load_n(&slot->waiters, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&slot->waiters, &waiter->next, waiter, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    // the page is complete once every reserved byte is published
+    __atomic_add_fetch(&slot->filled, size, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&wal->appended, 1, __ATOMIC_RELAXED);
+
+    if (ret_lsn)
+        *ret_lsn = start;
+
+    return 0;
+}
+
+// complete pages after the last submitted one
+__u32 wal_pages_ready(struct wal *wal, __u32 count)
+{
+    __u32 ready = 0;
+    for (; ready < count; ready++)
+    {
+        __u64 page_no = wal->submitted_page + ready;
+        if (page_no >= wal->pages || page_no - wal->written_page >= WAL_BUF_PAGES)
+            break;
+        if (__atomic_load_n(&wal_slot(wal, page_no)->filled, __ATOMIC_ACQUIRE) != WAL_PAGE_SIZE)
+            break;
+    }
+
+    return ready;
+}
+
+// write the header of a complete page, its waiters are handed to the write op
+struct wal_waiter *wal_page_submit(struct wal *wal, __u64 page_no)
+{
+    ASSERT(page_no == wal->submitted_page);
+    struct wal_slot *slot = wal_slot(wal, page_no);
+    ASSERT(slot->filled == WAL_PAGE_SIZE);
+
+    struct wal_page *page = wal_page_buf(wal, page_no);
+    page->magic = WAL_PAGE_MAGIC;
+    page->epoch = wal->epoch;
+    page->page_no = page_no;
+    page->used = slot->end;
+    page->crc = wal_page_checksum(page);
+
+    wal->submitted_page++;
+
+    return __atomic_exchange_n(&slot->waiters, NULL, __ATOMIC_ACQUIRE);
+}
+
+void wal_pages_written(struct wal *wal, __u32 pages)
+{
+    for (__u32 i = 0; i < pages; i++)
+    {
+        wal_slot_reset(wal_slot(wal, wal->written_page));
+        __atomic_store_n(&wal->written_page, wal->written_page + 1, __ATOMIC_RELEASE);
+    }
+}
+
+// close the partially filled front page so it can be written, returns 1 if a
+// page was closed
+int wal_seal(struct wal *wal)
+{
+    __u64 pos = __atomic_load_n(&wal->reserved, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        __u64 page_no = pos / WAL_PAGE_SIZE;
+        __u32 off = pos % WAL_PAGE_SIZE;
+        // nothing appended since the last page was closed
+        if (off == 0 || page_no >= wal->pages)
+            return 0;
+
+        if (__atomic_compare_exchange_n(&wal->reserved, &pos, (page_no + 1) * WAL_PAGE_SIZE, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            wal_page_close(wal, page_no, off);
+            wal->sealed++;
+            return 1;
+        }
+    }
+}
+
+// readers on other threads never see the durable point move back
+static void wal_durable_advance(struct wal *wal, __u64 lsn)
+{
+    __u64 durable = __atomic_load_n(&wal->durable_lsn, __ATOMIC_RELAXED);
+    while (durable < lsn && !__atomic_compare_exchange_n(&wal->durable_lsn, &durable, lsn, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+// user_fsync_callback of the log pages
+int wal_page_synced(struct op_page_write *op)
+{
+    struct wal *wal = thread_ctx->wal;
+    struct wal_waiter *waiter = op->user_data;
+    struct wal_waiter *next;
+
+    __u64 page_no = op->page_id - thread_ctx->page_start;
+    wal_durable_advance(wal, (page_no + 1) * WAL_PAGE_SIZE);
+
+    while (waiter)
+    {
+        // the waiter may be reused as soon as its callback runs
+        next = waiter->next;
+        waiter->callback(waiter);
+        waiter = next;
+    }
+
+    return 0;
+}
+
+// epoch of a written page, 0 if the header does not check out
+__u64 wal_page_epoch(void *buf)
+{
+    struct wal_page *page = buf;
+    if (page->magic != WAL_PAGE_MAGIC || page->crc != wal_page_checksum(page))
+        return 0;
+
+    return page->epoch;
+}
+
+// records in a written page, -1 if the header or a record does not check out
+int wal_page_check(__u64 epoch, void *buf, __u64 page_no)
+{
+    struct wal_page *page = buf;
+    if (page->magic != WAL_PAGE_MAGIC || page->epoch != epoch || page->page_no != page_no)
+        return -1;
+    if (page->crc != wal_page_checksum(page) || page->used < WAL_PAGE_HDR || page->used > WAL_PAGE_SIZE)
+        return -1;
+
+    int records = 0;
+    for (__u32 off = WAL_PAGE_HDR; off < page->used; records++)
+    {
+        struct wal_record *record = buf + off;
+        if (off + sizeof(*record) > page->used || record->len > WAL_RECORD_MAX || off + wal_record_size(record->len) > page->used)
+            return -1;
+        if (record->lsn != page_no * WAL_PAGE_SIZE + off || record->crc != wal_record_checksum(record))
+            return -1;
+        off += wal_record_size(record->len);
+    }
+
+    return records;
+}
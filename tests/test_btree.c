@@ -1,17 +1,32 @@
 #define ASSERTION
 #define DEBUG
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <liburing.h>
 #include "../src/include/utils.h"
 #include "../src/include/tree/btree.h"
 #include "../src/include/tree/node.h"
 #include "../src/include/tree/cell.h"
 
+#ifndef TUPLE_COUNT
 #define TUPLE_COUNT (100 * 1024 * 1024)
+#endif
+#define TEST_FILE "__test_btree.db"
+#define TEST_FRAMES (4096)
 
-void validate_order(struct node *node, struct cell *lower_limit, struct cell *upper_limit)
+static struct btree btree;
+
+void validate_order(__u64 pid, struct cell *lower_limit, struct cell *upper_limit)
 {
+    // parents stay pinned while their children are checked against their cells
+    struct node *node = btree_node_fetch(&btree, pid);
+    ASSERT(node);
+
     if (node_is_leaf(node))
     {
         for (__u32 i = 1; i < node->size; i++)
@@ -65,12 +80,17 @@ void validate_order(struct node *node, struct cell *lower_limit, struct cell *up
 
         // rightmost child
         if (node->rightmost_pid)
-            validate_order((struct node *)node->rightmost_pid, node->size ? node_cell_from_idx(node, node->size - 1) : lower_limit, upper_limit);
+            validate_order(node->rightmost_pid, node->size ? node_cell_from_idx(node, node->size - 1) : lower_limit, upper_limit);
     }
+
+    btree_node_release(&btree, node, 0);
 }
 
-void print_tree(struct node *node, __u32 level, int show_cells, int show_tombstones)
+void print_tree(__u64 pid, __u32 level, int show_cells, int show_tombstones)
 {
+    struct node *node = btree_node_fetch(&btree, pid);
+    ASSERT(node);
+
     if (node_is_leaf(node))
     {
         LOG("level: %u\n", level);
@@ -86,12 +106,17 @@ void print_tree(struct node *node, __u32 level, int show_cells, int show_tombsto
         }
 
         if (node->rightmost_pid)
-            print_tree((struct node *)node->rightmost_pid, level + 1, show_cells, show_tombstones);
+            print_tree(node->rightmost_pid, level + 1, show_cells, show_tombstones);
     }
+
+    btree_node_release(&btree, node, 0);
 }
 
-void tree_info(struct node *node, __u32 *leaf, __u32 *internal, __u32 *tuple)
+void tree_info(__u64 pid, __u32 *leaf, __u32 *internal, __u32 *tuple)
 {
+    struct node *node = btree_node_fetch(&btree, pid);
+    ASSERT(node);
+
     if (node_is_leaf(node))
     {
         *tuple = *tuple + node->size;
@@ -104,16 +129,109 @@ void tree_info(struct node *node, __u32 *leaf, __u32 *internal, __u32 *tuple)
             tree_info(internal_cell_child(node_cell_from_idx(node, i)), leaf, internal, tuple);
 
         if (node->rightmost_pid)
-            tree_info((struct node *)node->rightmost_pid, leaf, internal, tuple);
+            tree_info(node->rightmost_pid, leaf, internal, tuple);
+    }
+
+    btree_node_release(&btree, node, 0);
+}
+
+// every inserted key is found with its value, keys around them are not
+void lookup_check(__u8 *key, __u8 *value, __u32 key_size, __u32 value_size, char *key_prefix, char *val_prefix)
+{
+    struct cell_pointers pointers;
+    int digits = (int)(__s64)ceil(log(TUPLE_COUNT) / log(16) + 2);
+    int ret;
+
+    for (__u32 i = 0; i <= TUPLE_COUNT + 1; i++)
+    {
+        snprintf((char *)key, key_size, "%s%.*d", key_prefix, digits, i);
+        snprintf((char *)value, value_size, "%s%.*d", val_prefix, digits, i);
+
+        ret = btree_search(&btree, key, key_size, &pointers);
+        if (i == 0 || i == TUPLE_COUNT + 1)
+        {
+            ASSERT(ret == 1);
+            continue;
+        }
+
+        ASSERT(ret == 0);
+        ASSERT(pointers.key_size == key_size && memcmp(pointers.key, key, key_size) == 0);
+        ASSERT(pointers.value_size == value_size && memcmp(pointers.value, value, value_size) == 0);
+        btree_search_release(&btree, &pointers);
+    }
+}
+
+// the leaf links cover every key in order, both ways
+void cursor_check(__u8 *key, __u32 key_size, char *key_prefix)
+{
+    struct btree_cursor cursor;
+    struct cell_pointers pointers;
+    int digits = (int)(__s64)ceil(log(TUPLE_COUNT) / log(16) + 2);
+    __u8 last_key[key_size];
+    __u32 count;
+    int ret;
+
+    btree_cursor_init(&cursor, &btree);
+
+    count = 0;
+    for (ret = btree_cursor_seek(&cursor, NULL, 0); !ret; ret = btree_cursor_next(&cursor), count++)
+    {
+        ASSERT(btree_cursor_get(&cursor, &pointers) == 0);
+        if (count)
+            ASSERT(memcmp(last_key, pointers.key, key_size) < 0);
+        memcpy(last_key, pointers.key, key_size);
+    }
+    ASSERT(ret == 1 && count == TUPLE_COUNT);
+
+    count = 0;
+    for (ret = btree_cursor_last(&cursor); !ret; ret = btree_cursor_prev(&cursor), count++)
+    {
+        ASSERT(btree_cursor_get(&cursor, &pointers) == 0);
+        if (count)
+            ASSERT(memcmp(last_key, pointers.key, key_size) > 0);
+        memcpy(last_key, pointers.key, key_size);
     }
+    ASSERT(ret == 1 && count == TUPLE_COUNT);
+
+    // seek lands on the key, then walks to the end
+    snprintf((char *)key, key_size, "%s%.*d", key_prefix, digits, TUPLE_COUNT / 2 + 1);
+    ASSERT(btree_cursor_seek(&cursor, key, key_size) == 0);
+    ASSERT(btree_cursor_get(&cursor, &pointers) == 0 && memcmp(pointers.key, key, key_size) == 0);
+    for (count = 1; !(ret = btree_cursor_next(&cursor)); count++)
+        ;
+    ASSERT(count == TUPLE_COUNT - TUPLE_COUNT / 2);
+
+    // before the first key and past the last one
+    snprintf((char *)key, key_size, "%s%.*d", key_prefix, digits, 0);
+    ASSERT(btree_cursor_seek(&cursor, key, key_size) == 0);
+    ASSERT(btree_cursor_prev(&cursor) == 1);
+    snprintf((char *)key, key_size, "%s%.*d", key_prefix, digits, TUPLE_COUNT + 1);
+    ASSERT(btree_cursor_seek(&cursor, key, key_size) == 1);
+    ASSERT(btree_cursor_get(&cursor, &pointers) == 1);
+
+    btree_cursor_close(&cursor);
 }
 
 int main()
 {
-    struct btree btree;
+    struct io_uring ring;
+    struct buffer_pool pool;
     int err;
 
-    err = btree_init(&btree);
+    err = io_uring_queue_init(64, &ring, 0);
+    ASSERT(!err);
+
+    // same O_DIRECT file as the scheduler, tmpfs has no direct io
+    unlink(TEST_FILE);
+    int fd = open(TEST_FILE, O_DIRECT | O_RDWR | O_CREAT, 0644);
+    if (fd < 0 && errno == EINVAL)
+        fd = open(TEST_FILE, O_RDWR | O_CREAT, 0644);
+    ASSERT(fd >= 0);
+
+    err = buffer_pool_init(&pool, &ring, fd, TEST_FRAMES);
+    ASSERT(!err);
+
+    err = btree_open(&btree, &pool);
     ASSERT(!err);
 
     __u8 key[16];
@@ -138,22 +256,54 @@ int main()
         err = btree_insert(&btree, key, ARRAY_LEN(key), value, ARRAY_LEN(value));
         ASSERT(!err);
 
-        // print_tree(btree.root, 0, 1, 0);
+        // print_tree(btree.root_pid, 0, 1, 0);
         // __u32 leaf = 0, internal = 0, tuple = 0;
-        // tree_info(btree.root, &leaf, &internal, &tuple);
+        // tree_info(btree.root_pid, &leaf, &internal, &tuple);
         // ASSERT(tuple == btree.count);
         // LOG("LEAF NODES: %d, INTERNAL NODES: %d, TUPLES: %d\n", leaf, internal, tuple);
-        // validate_order(btree.root, NULL, NULL);
+        // validate_order(btree.root_pid, NULL, NULL);
     }
 
-    validate_order(btree.root, NULL, NULL);
+    validate_order(btree.root_pid, NULL, NULL);
+    lookup_check(key, value, ARRAY_LEN(key), ARRAY_LEN(value), key_prefix, val_prefix);
+    cursor_check(key, ARRAY_LEN(key), key_prefix);
     __u32 leaf = 0, internal = 0, tuple = 0;
-    tree_info(btree.root, &leaf, &internal, &tuple);
-    LOG("LEAF NODES: %d, INTERNAL NODES: %d, TUPLES: %d RAM USED: %.3fMB FOR REAL DATA: %.3fMB\n",
+    tree_info(btree.root_pid, &leaf, &internal, &tuple);
+    ASSERT(tuple == btree.count);
+    LOG("LEAF NODES: %d, INTERNAL NODES: %d, TUPLES: %d DISK USED: %.3fMB FOR REAL DATA: %.3fMB RAM USED: %.3fMB\n",
         leaf, internal, tuple,
         (double)NODE_SIZE * (leaf + internal) / (1024 * 1024),
-        (double)tuple * (ARRAY_LEN(key) + ARRAY_LEN(value)) / (1024 * 1024));
-    // print_tree(btree.root, 0, 1, 0);
+        (double)tuple * (ARRAY_LEN(key) + ARRAY_LEN(value)) / (1024 * 1024),
+        (double)NODE_SIZE * TEST_FRAMES / (1024 * 1024));
+    LOG("BUFFER POOL: hits %llu misses %llu evictions %llu writebacks %llu\n",
+        pool.hits, pool.misses, pool.evictions, pool.writebacks);
+    // print_tree(btree.root_pid, 0, 1, 0);
+
+    // reopen from the file: the tree is found through the meta page
+    err = btree_flush(&btree);
+    ASSERT(!err);
+    __u64 root_pid = btree.root_pid;
+    buffer_pool_free(&pool);
+
+    err = buffer_pool_init(&pool, &ring, fd, TEST_FRAMES);
+    ASSERT(!err);
+    memset(&btree, 0, sizeof(btree));
+    err = btree_open(&btree, &pool);
+    ASSERT(!err);
+    ASSERT(btree.root_pid == root_pid);
+    ASSERT(btree.count == TUPLE_COUNT);
+
+    validate_order(btree.root_pid, NULL, NULL);
+    lookup_check(key, value, ARRAY_LEN(key), ARRAY_LEN(value), key_prefix, val_prefix);
+    cursor_check(key, ARRAY_LEN(key), key_prefix);
+    leaf = 0, internal = 0, tuple = 0;
+    tree_info(btree.root_pid, &leaf, &internal, &tuple);
+    ASSERT(tuple == btree.count);
+
+    buffer_pool_free(&pool);
+    close(fd);
+    unlink(TEST_FILE);
+    io_uring_queue_exit(&ring);
 
     LOG("TEST (%s): ok\n", __FILE__);
 }
@@ -0,0 +1,128 @@
+#ifndef TEST_BTREE_COMMON_H
+#define TEST_BTREE_COMMON_H
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <liburing.h>
+#include "../src/include/utils.h"
+#include "../src/include/tree/btree.h"
+#include "../src/include/tree/node.h"
+
+// keys, values and tree checks shared by the btree tests
+
+#define KEY_SIZE (16)
+#define VALUE_MIN (8)
+#define VALUE_MAX (120)
+
+static inline __u64 mix(__u64 x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+// spread over the key space, the number makes it unique
+static inline void key_format(__u8 *key, __u64 n)
+{
+    __u64 be[2] = {__builtin_bswap64(mix(n)), __builtin_bswap64(n)};
+    memcpy(key, be, KEY_SIZE);
+}
+
+// size of the value written to key n in a round
+static inline __u32 value_size(__u64 n, __u32 round)
+{
+    return VALUE_MIN + mix(n ^ (0x5555 + round)) % (VALUE_MAX - VALUE_MIN + 1);
+}
+
+static inline double elapsed_s(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// the tree in file, a new one if truncate is set. buffered where the file
+// system has no O_DIRECT
+static inline int tree_open(struct io_uring *ring, struct buffer_pool *pool, struct btree *btree, const char *file, __u32 frames, int truncate)
+{
+    if (truncate)
+        unlink(file);
+    int fd = open(file, O_DIRECT | O_RDWR | O_CREAT, 0644);
+    if (fd < 0 && errno == EINVAL)
+        fd = open(file, O_RDWR | O_CREAT, 0644);
+    ASSERT(fd >= 0);
+
+    ASSERT(buffer_pool_init(pool, ring, fd, frames) == 0);
+    ASSERT(btree_open(btree, pool) == 0);
+    return fd;
+}
+
+static inline void tree_close(struct buffer_pool *pool, int fd)
+{
+    buffer_pool_free(pool);
+    close(fd);
+}
+
+struct tree_walk
+{
+    __u32 leaf_level;
+    __u64 nodes;
+    __u64 keys;
+};
+
+// keys of the subtree in order within [low, high), all leaves at the same
+// level and no empty node but the root
+static inline void tree_walk(struct btree *btree, __u64 pid, struct cell *low, struct cell *high, __u32 level, struct tree_walk *walk)
+{
+    struct node *node = btree_node_fetch(btree, pid);
+    ASSERT(node && !(node->flags & BTREE_NODE_FLAGS_FREE));
+    ASSERT(node->size > 0 || pid == btree->root_pid);
+
+    for (__u32 i = 0; i < node->size; i++)
+    {
+        struct cell *cell = node_cell_from_idx(node, i);
+        if (low)
+            ASSERT(key_compare_cell(cell, cell_get_key(low), low->key_size) >= 0);
+        if (high)
+            ASSERT(key_compare_cell(cell, cell_get_key(high), high->key_size) < 0);
+        if (i)
+            ASSERT(key_compare_cell(node_cell_from_idx(node, i - 1), cell_get_key(cell), cell->key_size) < 0);
+    }
+
+    walk->nodes++;
+    if (node_is_leaf(node))
+    {
+        if (!walk->leaf_level)
+            walk->leaf_level = level;
+        ASSERT(walk->leaf_level == level);
+        walk->keys += node->size;
+    }
+    else
+    {
+        for (__u32 i = 0; i <= node->size; i++)
+        {
+            __u64 child = i < node->size ? internal_cell_child(node_cell_from_idx(node, i)) : node->rightmost_pid;
+            tree_walk(btree, child, i ? node_cell_from_idx(node, i - 1) : low, i < node->size ? node_cell_from_idx(node, i) : high, level + 1, walk);
+        }
+    }
+    btree_node_release(btree, node, 0);
+}
+
+// the tree holds btree->count keys and every page is in it or on the free
+// list, so no overflow page may be in use
+static inline struct tree_walk tree_check(struct btree *btree)
+{
+    struct tree_walk walk = {0};
+    tree_walk(btree, btree->root_pid, NULL, NULL, 1, &walk);
+    ASSERT(walk.keys == btree->count);
+    ASSERT(walk.nodes + btree->free_count == btree->next_pid - 1);
+    return walk;
+}
+
+#endif
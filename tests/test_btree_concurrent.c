@@ -0,0 +1,330 @@
+#define ASSERTION
+#define DEBUG
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "test_btree_common.h"
+
+// threads inserting, updating and deleting disjoint keys while all of them
+// read each other's keys, first over a pool small enough to evict, then with
+// values in overflow pages and with keys in order at the right edge, then a
+// bench of inserts and lookups from 1 thread up to one per cpu
+#ifndef CONCURRENT_TUPLES
+#define CONCURRENT_TUPLES (400 * 1000)
+#endif
+#define TEST_FILE "__test_btree_concurrent.db"
+#define TEST_FRAMES (64 * 1024)
+#define TEST_FRAMES_SMALL (512)
+#define THREADS_MIN (4)
+#define THREADS_MAX (256)
+#define LONG_KEYS (4096)
+// rounds from this one write values past BTREE_INLINE_MAX
+#define ROUND_LARGE (3)
+#define LARGE_MAX (BTREE_INLINE_MAX + 2 * NODE_SIZE)
+// keys a thread appends before deleting some of them back from the last one
+#define APPEND_RUN (64)
+#define APPEND_DELETES (48)
+
+enum phase
+{
+    PHASE_INSERT,
+    PHASE_CHURN,
+    PHASE_LARGE,
+    PHASE_APPEND,
+    PHASE_LOOKUP,
+};
+
+struct worker
+{
+    pthread_t thread;
+    __u32 id;
+    __u32 threads;
+    __u64 tuples;
+    enum phase phase;
+    int check;
+};
+
+static struct io_uring ring;
+static struct btree btree;
+static pthread_barrier_t barrier;
+// round of the value of every key, 0 once deleted. written by the owner only
+static __u8 rounds[CONCURRENT_TUPLES];
+// keys in the order of their numbers instead of spread
+static int sorted;
+
+static void tuple_key(__u8 *key, __u64 n)
+{
+    __u64 be[2] = {0, __builtin_bswap64(n)};
+    if (sorted)
+        memcpy(key, be, KEY_SIZE);
+    else
+        key_format(key, n);
+}
+
+static __u32 tuple_size(__u64 n, __u32 round)
+{
+    if (round < ROUND_LARGE)
+        return value_size(n, round);
+    return BTREE_INLINE_MAX + 1 + mix(n ^ round) % (LARGE_MAX - BTREE_INLINE_MAX);
+}
+
+static void put(__u64 n, __u32 round)
+{
+    __u8 key[KEY_SIZE];
+    __u8 value[LARGE_MAX];
+
+    tuple_key(key, n);
+    memset(value, (__u8)(n + round), tuple_size(n, round));
+    ASSERT(btree_upsert(&btree, key, KEY_SIZE, value, tuple_size(n, round)) == 0);
+    __atomic_store_n(&rounds[n], round, __ATOMIC_RELEASE);
+}
+
+static void del(__u64 n)
+{
+    __u8 key[KEY_SIZE];
+
+    tuple_key(key, n);
+    ASSERT(btree_delete(&btree, key, KEY_SIZE) == 0);
+    __atomic_store_n(&rounds[n], 0, __ATOMIC_RELEASE);
+}
+
+// a key of another thread may change under the read, any of its values is
+// whole: the size and the bytes belong to the same round
+static int get(__u64 n, int owned)
+{
+    __u8 key[KEY_SIZE];
+    __u8 value[LARGE_MAX];
+    __u32 size;
+
+    __u8 round = __atomic_load_n(&rounds[n], __ATOMIC_ACQUIRE);
+    tuple_key(key, n);
+    int ret = btree_get(&btree, key, KEY_SIZE, value, sizeof(value), &size);
+    ASSERT(ret == 0 || ret == 1);
+    if (owned)
+        ASSERT(ret == !round);
+    if (ret)
+        return ret;
+
+    __u8 byte = value[0];
+    ASSERT(size >= VALUE_MIN && size <= LARGE_MAX && value[size / 2] == byte && value[size - 1] == byte);
+    if (owned)
+        ASSERT(size == tuple_size(n, round) && byte == (__u8)(n + round));
+    else
+        ASSERT(size == tuple_size(n, (__u8)(byte - n)));
+
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *worker = arg;
+    __u64 seed = mix(worker->id + 1);
+
+    pthread_barrier_wait(&barrier);
+    for (__u64 n = worker->id; n < worker->tuples; n += worker->threads)
+    {
+        __u64 other = (seed = mix(seed)) % worker->tuples;
+
+        switch (worker->phase)
+        {
+        case PHASE_INSERT:
+            put(n, 1);
+            break;
+        case PHASE_CHURN:
+            // 3 of 4 keys go, enough for leaves to merge, the rest get a value of another size
+            if (n / worker->threads % 4)
+                del(n);
+            else
+                put(n, 2);
+            break;
+        case PHASE_LARGE:
+            // every key gets overflow pages, then some of the chains are
+            // replaced or deleted: freed pages come back as nodes of the
+            // splits while readers are still on the chains
+            put(n, ROUND_LARGE);
+            if (n / worker->threads % 4 == 1)
+                put(n, ROUND_LARGE + 1);
+            else if (n / worker->threads % 4 == 2)
+                del(n);
+            break;
+        case PHASE_APPEND:
+            // keys in order pile up in the tail leaf, after APPEND_RUN keys a
+            // thread deletes APPEND_DELETES of them back from the right edge:
+            // the tail splits and merges with the leaves before it
+            put(n, 1);
+            if (n / worker->threads % APPEND_RUN == APPEND_RUN - 1)
+                for (__u64 i = 0; i < APPEND_DELETES; i++)
+                    del(n - i * worker->threads);
+            break;
+        case PHASE_LOOKUP:
+            ASSERT(get(other, 0) == 0);
+            continue;
+        }
+
+        if (!worker->check)
+            continue;
+        get(n, 1);
+        get(other, other % worker->threads == worker->id);
+    }
+    pthread_barrier_wait(&barrier);
+
+    return NULL;
+}
+
+// time of the phase with every worker past the start barrier
+static double run(struct worker *workers, __u32 threads, __u64 tuples, enum phase phase, int check)
+{
+    struct timespec start;
+
+    ASSERT(pthread_barrier_init(&barrier, NULL, threads + 1) == 0);
+    for (__u32 i = 0; i < threads; i++)
+    {
+        workers[i] = (struct worker){.id = i, .threads = threads, .tuples = tuples, .phase = phase, .check = check};
+        ASSERT(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) == 0);
+    }
+
+    pthread_barrier_wait(&barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_barrier_wait(&barrier);
+    double seconds = elapsed_s(&start);
+
+    for (__u32 i = 0; i < threads; i++)
+        ASSERT(pthread_join(workers[i].thread, NULL) == 0);
+    pthread_barrier_destroy(&barrier);
+
+    return seconds;
+}
+
+// with the workers gone: the tree holds what they left, in order
+static void check(__u64 tuples)
+{
+    __u64 live = 0;
+
+    for (__u64 n = 0; n < tuples; n++)
+    {
+        get(n, 1);
+        live += !!rounds[n];
+    }
+    ASSERT(btree.count == live);
+    tree_check(&btree);
+
+    struct btree_cursor cursor;
+    __u64 scanned = 0;
+    int ret;
+    btree_cursor_init(&cursor, &btree);
+    for (ret = btree_cursor_seek(&cursor, NULL, 0); !ret; ret = btree_cursor_next(&cursor))
+    {
+        ASSERT(btree.readers == 1);
+        scanned++;
+    }
+    // past the end the cursor holds no leaf, writers may run again
+    ASSERT(ret == 1 && scanned == live && btree.readers == 0);
+}
+
+// a new tree with no key written yet
+static int tree_reset(struct buffer_pool *pool, __u32 frames)
+{
+    memset(rounds, 0, sizeof(rounds));
+    sorted = 0;
+    return tree_open(&ring, pool, &btree, TEST_FILE, frames, 1);
+}
+
+// keys of BTREE_KEY_MAX bytes with the largest inline values leave a few
+// separators per internal node, which still split. a longer key is refused
+static void long_keys(void)
+{
+    static __u8 key[BTREE_KEY_MAX + 1];
+    static __u8 value[BTREE_INLINE_MAX];
+    __u32 get_size;
+
+    memset(key, 'k', sizeof(key));
+    for (__u64 n = 0; n < LONG_KEYS; n++)
+    {
+        __u64 be = __builtin_bswap64(mix(n));
+        memcpy(key + BTREE_KEY_MAX - sizeof(be), &be, sizeof(be));
+        memset(value, (__u8)n, sizeof(value));
+        ASSERT(btree_insert(&btree, key, BTREE_KEY_MAX, value, sizeof(value)) == 0);
+    }
+    ASSERT(btree.count == LONG_KEYS);
+
+    for (__u64 n = 0; n < LONG_KEYS; n++)
+    {
+        __u64 be = __builtin_bswap64(mix(n));
+        memcpy(key + BTREE_KEY_MAX - sizeof(be), &be, sizeof(be));
+        ASSERT(btree_get(&btree, key, BTREE_KEY_MAX, value, sizeof(value), &get_size) == 0);
+        ASSERT(get_size == sizeof(value) && value[0] == (__u8)n && value[sizeof(value) - 1] == (__u8)n);
+    }
+
+    ASSERT(btree_insert(&btree, key, BTREE_KEY_MAX + 1, value, VALUE_MIN) == -1);
+    ASSERT(btree_upsert(&btree, key, BTREE_KEY_MAX + 1, value, VALUE_MIN) == -1);
+    ASSERT(btree.count == LONG_KEYS);
+}
+
+int main()
+{
+    static struct worker workers[THREADS_MAX];
+    struct buffer_pool pool;
+    __u32 cpus = min((__u32)sysconf(_SC_NPROCESSORS_ONLN), (__u32)THREADS_MAX);
+    __u32 threads = max(cpus, (__u32)THREADS_MIN);
+    int fd;
+
+    ASSERT(io_uring_queue_init(256, &ring, 0) == 0);
+
+    // more threads than cpus and a pool evicting all the time, every
+    // operation checked against the others
+    fd = tree_reset(&pool, TEST_FRAMES_SMALL);
+    run(workers, threads, CONCURRENT_TUPLES / 4, PHASE_INSERT, 1);
+    check(CONCURRENT_TUPLES / 4);
+    run(workers, threads, CONCURRENT_TUPLES / 4, PHASE_CHURN, 1);
+    check(CONCURRENT_TUPLES / 4);
+    ASSERT(pool.evictions > 0);
+    tree_close(&pool, fd);
+
+    // overflow chains freed and their pages reused under lookups reading them
+    fd = tree_reset(&pool, TEST_FRAMES_SMALL);
+    run(workers, threads, CONCURRENT_TUPLES / 16, PHASE_INSERT, 1);
+    run(workers, threads, CONCURRENT_TUPLES / 16, PHASE_CHURN, 1);
+    run(workers, threads, CONCURRENT_TUPLES / 16, PHASE_LARGE, 1);
+    // small values again, the tree check wants every chain freed
+    run(workers, threads, CONCURRENT_TUPLES / 16, PHASE_INSERT, 1);
+    check(CONCURRENT_TUPLES / 16);
+    tree_close(&pool, fd);
+
+    // every insert at the right edge, deletes freeing the leaves behind it
+    // for the splits that follow to take back
+    fd = tree_reset(&pool, TEST_FRAMES);
+    sorted = 1;
+    run(workers, threads, CONCURRENT_TUPLES, PHASE_APPEND, 1);
+    check(CONCURRENT_TUPLES);
+    tree_close(&pool, fd);
+
+    // the same over a cached tree, deletes shrinking it under the readers
+    fd = tree_reset(&pool, TEST_FRAMES);
+    run(workers, threads, CONCURRENT_TUPLES, PHASE_INSERT, 1);
+    run(workers, threads, CONCURRENT_TUPLES, PHASE_CHURN, 1);
+    check(CONCURRENT_TUPLES);
+    ASSERT(btree.free_count > 0);
+    tree_close(&pool, fd);
+
+    fd = tree_reset(&pool, TEST_FRAMES);
+    long_keys();
+    tree_close(&pool, fd);
+
+    for (__u32 t = 1; t <= cpus; t = t * 2 > cpus && t != cpus ? cpus : t * 2)
+    {
+        fd = tree_reset(&pool, TEST_FRAMES);
+        double insert_s = run(workers, t, CONCURRENT_TUPLES, PHASE_INSERT, 0);
+        double lookup_s = run(workers, t, CONCURRENT_TUPLES, PHASE_LOOKUP, 0);
+        ASSERT(btree.count == CONCURRENT_TUPLES);
+        tree_close(&pool, fd);
+
+        printf("bench btree concurrent threads: %u tuples: %u inserts/s: %.0f lookups/s: %.0f\n",
+               t, CONCURRENT_TUPLES, CONCURRENT_TUPLES / insert_s, CONCURRENT_TUPLES / lookup_s);
+    }
+
+    unlink(TEST_FILE);
+    io_uring_queue_exit(&ring);
+
+    LOG("TEST (%s): ok\n", __FILE__);
+}
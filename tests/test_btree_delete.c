@@ -0,0 +1,160 @@
+#define ASSERTION
+#define DEBUG
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include "test_btree_common.h"
+
+// delete heavy workload: rounds deleting half of the keys and inserting as
+// many new ones with other value sizes, the tree is measured after each round.
+// then most keys are deleted, the tree has to shrink, and inserted back
+#ifndef DELETE_TUPLES
+#define DELETE_TUPLES (200 * 1000)
+#endif
+#ifndef DELETE_ROUNDS
+#define DELETE_ROUNDS (4)
+#endif
+#define TEST_FILE "__test_btree_delete.db"
+#define TEST_FRAMES (64 * 1024)
+
+static struct btree btree;
+static __u8 live[DELETE_TUPLES * (DELETE_ROUNDS + 1)];
+
+static void insert(__u64 n)
+{
+    __u8 key[KEY_SIZE];
+    __u8 value[VALUE_MAX];
+
+    key_format(key, n);
+    memset(value, (__u8)n, sizeof(value));
+    ASSERT(btree_insert(&btree, key, KEY_SIZE, value, value_size(n, 0)) == 0);
+    live[n] = 1;
+}
+
+static __u32 depth(void)
+{
+    __u32 depth = 1;
+    struct node *node = btree_node_fetch(&btree, btree.root_pid);
+    ASSERT(node);
+    while (!node_is_leaf(node))
+    {
+        struct node *child = btree_node_fetch(&btree, node->rightmost_pid);
+        ASSERT(child);
+        btree_node_release(&btree, node, 0);
+        node = child;
+        depth++;
+    }
+    btree_node_release(&btree, node, 0);
+
+    return depth;
+}
+
+static __u64 nodes(void)
+{
+    return tree_check(&btree).nodes;
+}
+
+static void delete(__u64 n)
+{
+    __u8 key[KEY_SIZE];
+
+    key_format(key, n);
+    ASSERT(btree_delete(&btree, key, KEY_SIZE) == 0);
+    ASSERT(btree_delete(&btree, key, KEY_SIZE) == 1);
+    live[n] = 0;
+}
+
+static void check(__u64 numbers)
+{
+    struct cell_pointers pointers;
+    __u8 key[KEY_SIZE];
+    __u64 count = 0;
+
+    for (__u64 n = 0; n < numbers; n++)
+    {
+        key_format(key, n);
+        int ret = btree_search(&btree, key, KEY_SIZE, &pointers);
+        ASSERT(ret == !live[n]);
+        if (ret)
+            continue;
+
+        ASSERT(pointers.value_size == value_size(n, 0) && pointers.value[0] == (__u8)n);
+        btree_search_release(&btree, &pointers);
+        count++;
+    }
+    ASSERT(count == btree.count);
+
+    // both ways over the leaf links
+    struct btree_cursor cursor;
+    __u64 forward = 0, backward = 0;
+    int ret;
+    btree_cursor_init(&cursor, &btree);
+    for (ret = btree_cursor_seek(&cursor, NULL, 0); !ret; ret = btree_cursor_next(&cursor))
+        forward++;
+    for (ret = btree_cursor_last(&cursor); !ret; ret = btree_cursor_prev(&cursor))
+        backward++;
+    btree_cursor_close(&cursor);
+    ASSERT(forward == count && backward == count);
+}
+
+int main()
+{
+    struct io_uring ring;
+    struct buffer_pool pool;
+
+    ASSERT(io_uring_queue_init(64, &ring, 0) == 0);
+
+    int fd = tree_open(&ring, &pool, &btree, TEST_FILE, TEST_FRAMES, 1);
+
+    for (__u64 n = 0; n < DELETE_TUPLES; n++)
+        insert(n);
+    LOG("bench btree delete round: 0 tuples: %u nodes: %llu free: %u depth: %u\n", btree.count, nodes(), btree.free_count, depth());
+
+    __u64 numbers = DELETE_TUPLES;
+    for (__u32 round = 1; round <= DELETE_ROUNDS; round++)
+    {
+        __u64 deleted = 0;
+        for (__u64 n = 0; n < numbers; n++)
+        {
+            if (!live[n] || mix(n + round) & 1)
+                continue;
+
+            delete(n);
+            deleted++;
+        }
+
+        for (__u64 i = 0; i < deleted; i++)
+            insert(numbers + i);
+        numbers += deleted;
+
+        LOG("bench btree delete round: %u tuples: %u nodes: %llu free: %u depth: %u\n", round, btree.count, nodes(), btree.free_count, depth());
+    }
+    ASSERT(btree.count == DELETE_TUPLES);
+    check(numbers);
+    __u64 full_nodes = nodes();
+    __u32 full_depth = depth();
+
+    // 15 of 16 keys go, the tree shrinks with them
+    for (__u64 n = 0; n < numbers; n++)
+        if (live[n] && n % 16)
+            delete(n);
+    __u64 drained_nodes = nodes();
+    LOG("bench btree delete drained tuples: %u nodes: %llu free: %u depth: %u\n", btree.count, drained_nodes, btree.free_count, depth());
+    ASSERT(drained_nodes * 4 < full_nodes && depth() < full_depth);
+    check(numbers);
+
+    // deleted keys come back, separators left by them must not hide them
+    __u64 pages = btree.next_pid;
+    for (__u64 n = 0; n < DELETE_TUPLES; n++)
+        if (!live[n])
+            insert(n);
+    LOG("bench btree delete refilled tuples: %u nodes: %llu free: %u depth: %u\n", btree.count, nodes(), btree.free_count, depth());
+    ASSERT(btree.free_count == 0 || btree.next_pid == pages);
+    check(numbers);
+
+    tree_close(&pool, fd);
+    unlink(TEST_FILE);
+    io_uring_queue_exit(&ring);
+
+    LOG("TEST (%s): ok\n", __FILE__);
+}
@@ -0,0 +1,173 @@
+#define ASSERTION
+#define DEBUG
+#define _GNU_SOURCE
+#include <stdio.h>
+#include "test_btree_common.h"
+
+// bulk load against sequential inserts of the same sorted keys, the pool
+// holds the whole tree and the final flush is not timed
+#ifndef LOAD_TUPLES
+#define LOAD_TUPLES (1024 * 1024)
+#endif
+#define TEST_FILE "__test_btree_load.db"
+#define TEST_FRAMES (64 * 1024)
+#define VALUE_SIZE (16)
+// odd keys arrive this many keys behind the even ones
+#define LATE_TUPLES (64)
+
+static struct io_uring ring;
+
+// fixed width, big endian keys sort as their numbers
+static void sorted_key_format(__u8 *key, __u64 n)
+{
+    __u64 be = __builtin_bswap64(n);
+    memset(key, 'k', KEY_SIZE - sizeof(be));
+    memcpy(key + KEY_SIZE - sizeof(be), &be, sizeof(be));
+}
+
+// numbers [0, tuples) times step in a well formed tree, every key found in
+// order with its value
+static void keys_check(struct btree *btree, __u64 tuples, __u64 step)
+{
+    struct btree_cursor cursor;
+    struct cell_pointers pointers;
+    __u8 key[KEY_SIZE];
+    __u64 count = 0;
+    int ret;
+
+    ASSERT(btree->count == tuples);
+    tree_check(btree);
+
+    btree_cursor_init(&cursor, btree);
+    for (ret = btree_cursor_seek(&cursor, NULL, 0); !ret; ret = btree_cursor_next(&cursor), count++)
+    {
+        btree_cursor_get(&cursor, &pointers);
+        sorted_key_format(key, count * step);
+        ASSERT(pointers.key_size == KEY_SIZE && !memcmp(pointers.key, key, KEY_SIZE));
+        ASSERT(pointers.value_size == VALUE_SIZE && !memcmp(pointers.value, &(__u64){count * step}, sizeof(__u64)));
+    }
+    ASSERT(ret == 1 && count == tuples);
+
+    for (__u64 i = 0; i < tuples; i += 997)
+    {
+        sorted_key_format(key, i * step);
+        ASSERT(btree_search(btree, key, KEY_SIZE, &pointers) == 0);
+        btree_search_release(btree, &pointers);
+        if (step > 1)
+        {
+            sorted_key_format(key, i * step + 1);
+            ASSERT(btree_search(btree, key, KEY_SIZE, &pointers) == 1);
+        }
+    }
+}
+
+static double load(struct btree *btree, __u64 tuples, __u64 step, __u32 fill)
+{
+    struct btree_loader loader;
+    struct timespec start;
+    __u8 key[KEY_SIZE];
+    __u8 value[VALUE_SIZE];
+
+    memset(value, 'v', sizeof(value));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ASSERT(btree_load_init(&loader, btree, fill) == 0);
+    for (__u64 i = 0; i < tuples; i++)
+    {
+        sorted_key_format(key, i * step);
+        memcpy(value, &(__u64){i * step}, sizeof(__u64));
+        ASSERT(btree_load_append(&loader, key, KEY_SIZE, value, VALUE_SIZE) == 0);
+    }
+    // not after the last key
+    if (tuples)
+        ASSERT(btree_load_append(&loader, key, KEY_SIZE, value, VALUE_SIZE) == 1);
+    btree_load_finish(&loader);
+    double s = elapsed_s(&start);
+
+    ASSERT(btree_flush(btree) == 0);
+    return s;
+}
+
+int main()
+{
+    struct buffer_pool pool;
+    struct btree btree;
+    struct timespec start;
+    __u8 key[KEY_SIZE];
+    __u8 value[VALUE_SIZE];
+    int fd;
+
+    ASSERT(io_uring_queue_init(64, &ring, 0) == 0);
+
+    // empty load leaves an empty root leaf
+    fd = tree_open(&ring, &pool, &btree, TEST_FILE, TEST_FRAMES, 1);
+    load(&btree, 0, 1, BTREE_LOAD_FILL);
+    keys_check(&btree, 0, 1);
+    tree_close(&pool, fd);
+
+    // a half full load takes later inserts without splitting every leaf
+    fd = tree_open(&ring, &pool, &btree, TEST_FILE, TEST_FRAMES, 1);
+    load(&btree, LOAD_TUPLES / 8, 2, 50);
+    keys_check(&btree, LOAD_TUPLES / 8, 2);
+    memset(value, 'v', sizeof(value));
+    for (__u64 i = 0; i < LOAD_TUPLES / 8; i++)
+    {
+        sorted_key_format(key, i * 2 + 1);
+        memcpy(value, &(__u64){i * 2 + 1}, sizeof(__u64));
+        ASSERT(btree_insert(&btree, key, KEY_SIZE, value, VALUE_SIZE) == 0);
+    }
+    keys_check(&btree, LOAD_TUPLES / 4, 1);
+    tree_close(&pool, fd);
+
+    // time series with late arrivals: appends past the tail leaf mixed with
+    // keys landing behind it
+    fd = tree_open(&ring, &pool, &btree, TEST_FILE, TEST_FRAMES, 1);
+    memset(value, 'v', sizeof(value));
+    for (__u64 i = 0; i < LOAD_TUPLES / 8 + LATE_TUPLES; i++)
+    {
+        __u64 numbers[2] = {i * 2, (i - LATE_TUPLES) * 2 + 1};
+        for (__u32 j = i < LOAD_TUPLES / 8 ? 0 : 1; j < (i < LATE_TUPLES ? 1u : 2u); j++)
+        {
+            sorted_key_format(key, numbers[j]);
+            memcpy(value, &numbers[j], sizeof(__u64));
+            ASSERT(btree_insert(&btree, key, KEY_SIZE, value, VALUE_SIZE) == 0);
+        }
+    }
+    keys_check(&btree, LOAD_TUPLES / 4, 1);
+    tree_close(&pool, fd);
+
+    fd = tree_open(&ring, &pool, &btree, TEST_FILE, TEST_FRAMES, 1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (__u64 i = 0; i < LOAD_TUPLES; i++)
+    {
+        sorted_key_format(key, i);
+        memcpy(value, &(__u64){i}, sizeof(__u64));
+        ASSERT(btree_insert(&btree, key, KEY_SIZE, value, VALUE_SIZE) == 0);
+    }
+    double insert_s = elapsed_s(&start);
+    ASSERT(btree_flush(&btree) == 0);
+    __u64 insert_pages = btree.next_pid - 1;
+    keys_check(&btree, LOAD_TUPLES, 1);
+    tree_close(&pool, fd);
+
+    fd = tree_open(&ring, &pool, &btree, TEST_FILE, TEST_FRAMES, 1);
+    double load_s = load(&btree, LOAD_TUPLES, 1, BTREE_LOAD_FILL);
+    __u64 load_pages = btree.next_pid - 1;
+    keys_check(&btree, LOAD_TUPLES, 1);
+    tree_close(&pool, fd);
+
+    // the loaded tree is on disk
+    fd = tree_open(&ring, &pool, &btree, TEST_FILE, TEST_FRAMES, 0);
+    keys_check(&btree, LOAD_TUPLES, 1);
+    tree_close(&pool, fd);
+
+    // splits on the right edge leave the leaves about as full as the loader
+    ASSERT(insert_pages * 10 < load_pages * 11);
+
+    printf("bench btree load tuples: %u fill: %u inserts/s: %.0f loads/s: %.0f speedup: %.1f pages insert: %llu load: %llu\n",
+           LOAD_TUPLES, BTREE_LOAD_FILL, LOAD_TUPLES / insert_s, LOAD_TUPLES / load_s, insert_s / load_s, insert_pages, load_pages);
+
+    unlink(TEST_FILE);
+    io_uring_queue_exit(&ring);
+
+    LOG("TEST (%s): ok\n", __FILE__);
+}
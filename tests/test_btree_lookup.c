@@ -0,0 +1,191 @@
+#define ASSERTION
+#define DEBUG
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include "test_btree_common.h"
+
+// point lookup and scan microbenchmark, the tree fits in the buffer pool so
+// it measures the descent, the in-node searches and the leaf walk
+#ifndef LOOKUP_TUPLES
+#define LOOKUP_TUPLES (1024 * 1024)
+#endif
+#ifndef LOOKUP_COUNT
+#define LOOKUP_COUNT (4 * 1024 * 1024)
+#endif
+#define TEST_FILE "__test_btree_lookup.db"
+#define TEST_FRAMES (64 * 1024)
+#define VALUE_SIZE (16)
+
+static struct btree btree;
+static int shared_prefix;
+
+// fixed width, big endian keys sort as their numbers; odd numbers are never
+// inserted. With a shared prefix every key starts with the same bytes,
+// otherwise the number leads the key
+static void lookup_key_format(__u8 *key, __u64 n)
+{
+    if (shared_prefix)
+    {
+        __u64 be = __builtin_bswap64(n);
+        memset(key, 'k', KEY_SIZE - sizeof(be));
+        memcpy(key + KEY_SIZE - sizeof(be), &be, sizeof(be));
+    }
+    else
+    {
+        __u64 be = __builtin_bswap64(n << 32);
+        memcpy(key, &be, sizeof(be));
+        memset(key + sizeof(be), 'k', KEY_SIZE - sizeof(be));
+    }
+}
+
+static __u64 xorshift(__u64 *state)
+{
+    __u64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// random keys, hits on even numbers and misses on odd ones
+static double lookups(int hit)
+{
+    struct cell_pointers pointers;
+    struct timespec start;
+    __u8 key[KEY_SIZE];
+    __u64 state = 0x9E3779B97F4A7C15ull;
+    __u64 found = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (__u32 i = 0; i < LOOKUP_COUNT; i++)
+    {
+        __u64 n = (xorshift(&state) % LOOKUP_TUPLES) * 2 + !hit;
+        lookup_key_format(key, n);
+
+        int ret = btree_search(&btree, key, KEY_SIZE, &pointers);
+        ASSERT(ret >= 0);
+        if (ret)
+            continue;
+
+        __u64 stored;
+        memcpy(&stored, pointers.value, sizeof(stored));
+        ASSERT(pointers.value_size == VALUE_SIZE && stored == n);
+        btree_search_release(&btree, &pointers);
+        found++;
+    }
+    double s = elapsed_s(&start);
+
+    ASSERT(found == (hit ? LOOKUP_COUNT : 0));
+    return LOOKUP_COUNT / s;
+}
+
+// full forward scan over the leaf links
+static double scan(double *mb_per_s)
+{
+    struct btree_cursor cursor;
+    struct cell_pointers pointers;
+    struct timespec start;
+    __u64 count = 0, bytes = 0;
+    int ret;
+
+    btree_cursor_init(&cursor, &btree);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (ret = btree_cursor_seek(&cursor, NULL, 0); !ret; ret = btree_cursor_next(&cursor))
+    {
+        btree_cursor_get(&cursor, &pointers);
+        bytes += pointers.key_size + pointers.value_size;
+        count++;
+    }
+    double s = elapsed_s(&start);
+    btree_cursor_close(&cursor);
+
+    ASSERT(ret == 1 && count == LOOKUP_TUPLES);
+    *mb_per_s = bytes / s / (1024 * 1024);
+    return count / s;
+}
+
+// searches inside one full leaf, the node stays in cache
+static double node_searches(void)
+{
+    struct node *node = btree_node_alloc();
+    struct timespec start;
+    __u8 key[KEY_SIZE];
+    __u8 value[VALUE_SIZE] = {0};
+    __u64 state = 0x9E3779B97F4A7C15ull;
+    __u32 len, idx, found = 0;
+
+    ASSERT(node);
+    node_init(node, BTREE_NODE_FLAGS_LEAF);
+    for (len = 0; !node_is_full(node, KEY_SIZE, VALUE_SIZE); len++)
+    {
+        lookup_key_format(key, len * 2);
+        node_insert_nonfull(node, len, key, KEY_SIZE, value, VALUE_SIZE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (__u32 i = 0; i < LOOKUP_COUNT; i++)
+    {
+        lookup_key_format(key, (xorshift(&state) % len) * 2);
+        found += node_bin_search(node, key, KEY_SIZE, &idx);
+    }
+    double s = elapsed_s(&start);
+
+    ASSERT(found == LOOKUP_COUNT);
+    free(node);
+    return LOOKUP_COUNT / s;
+}
+
+static void bench(struct io_uring *ring)
+{
+    struct buffer_pool pool;
+    struct timespec start;
+    __u8 key[KEY_SIZE];
+    __u8 value[VALUE_SIZE];
+    int err;
+
+    int fd = tree_open(ring, &pool, &btree, TEST_FILE, TEST_FRAMES, 1);
+
+    memset(value, 'v', sizeof(value));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (__u64 i = 0; i < LOOKUP_TUPLES; i++)
+    {
+        lookup_key_format(key, i * 2);
+        memcpy(value, &(__u64){i * 2}, sizeof(__u64));
+        err = btree_insert(&btree, key, KEY_SIZE, value, VALUE_SIZE);
+        ASSERT(!err);
+    }
+    double insert_s = elapsed_s(&start);
+
+    __u64 misses = pool.misses;
+    double hits_per_s = lookups(1);
+    double misses_per_s = lookups(0);
+    double scan_mb_per_s;
+    double scan_per_s = scan(&scan_mb_per_s);
+    // every page stayed cached
+    ASSERT(pool.misses == misses);
+    double node_per_s = node_searches();
+
+    printf("bench btree lookup keys: %s tuples: %u lookups: %u inserts/s: %.0f hits/s: %.0f misses/s: %.0f scan keys/s: %.0f scan mb/s: %.0f node searches/s: %.0f\n",
+           shared_prefix ? "shared-prefix" : "number-first", LOOKUP_TUPLES, LOOKUP_COUNT, LOOKUP_TUPLES / insert_s,
+           hits_per_s, misses_per_s, scan_per_s, scan_mb_per_s, node_per_s);
+
+    tree_close(&pool, fd);
+    unlink(TEST_FILE);
+}
+
+int main()
+{
+    struct io_uring ring;
+    int err;
+
+    err = io_uring_queue_init(64, &ring, 0);
+    ASSERT(!err);
+
+    for (shared_prefix = 0; shared_prefix < 2; shared_prefix++)
+        bench(&ring);
+
+    io_uring_queue_exit(&ring);
+
+    LOG("TEST (%s): ok\n", __FILE__);
+}
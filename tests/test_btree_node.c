@@ -1,5 +1,6 @@
 #define ASSERTION
 #define DEBUG
+#include <stdlib.h>
 #include <string.h>
 #include "../src/include/utils.h"
 #include "../src/include/tree/btree.h"
@@ -57,6 +58,12 @@ void test_key_compare()
     ret = __key_compare((__u8 *)key1, strlen(key1), (__u8 *)key2, strlen(key2));
     ASSERT(ret < 0);
 
+    // a key sorts after its prefixes, as cell_key_prefix pads them
+    ret = __key_compare((__u8 *)"tes", 3, (__u8 *)key1, strlen(key1));
+    ASSERT(ret < 0);
+    ASSERT(cell_key_prefix((__u8 *)"tes", 3) < cell_key_prefix((__u8 *)key1, strlen(key1)));
+    ASSERT(cell_key_prefix((__u8 *)key1, strlen(key1)) == cell_key_prefix((__u8 *)key2, strlen(key2)));
+
     LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
 }
 
@@ -87,8 +94,89 @@ void test_insert_position()
     LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
 }
 
+// short keys, keys sharing the slot prefix and keys differing in it
+void test_prefix_order()
+{
+    struct node *node = btree_node_alloc();
+    ASSERT(node);
+    node_init(node, BTREE_NODE_FLAGS_LEAF);
+
+    insert_and_test(node, "abcf", "data");
+    insert_and_test(node, "ab", "data");
+    insert_and_test(node, "abcde", "data");
+    insert_and_test(node, "b", "data");
+    insert_and_test(node, "abcd", "data");
+    insert_and_test(node, "a", "data");
+    insert_and_test(node, "abcdd", "data");
+
+    check_index(node, "a", 0);
+    check_index(node, "ab", 1);
+    check_index(node, "abcd", 2);
+    check_index(node, "abcdd", 3);
+    check_index(node, "abcde", 4);
+    check_index(node, "abcf", 5);
+    check_index(node, "b", 6);
+
+    __u32 idx;
+    ASSERT(!node_bin_search(node, (__u8 *)"abc", 3, &idx) && idx == 2);
+    ASSERT(!node_bin_search(node, (__u8 *)"abcdf", 5, &idx) && idx == 5);
+
+    free(node);
+    LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
+}
+
+static void random_key(__u8 *key, __u32 *key_size, __u64 *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    // few letters and lengths around the prefix size: many equal prefixes and short keys
+    *key_size = 1 + *state % 6;
+    for (__u32 i = 0; i < *key_size; i++)
+        key[i] = 'a' + (*state >> (8 + i * 2)) % 3;
+}
+
+// the search matches a linear scan over prefix ties, short keys and misses
+void test_search_ties()
+{
+    struct node *node = btree_node_alloc();
+    ASSERT(node);
+    node_init(node, BTREE_NODE_FLAGS_LEAF);
+
+    __u64 state = 88172645463325252ull;
+    __u8 key[8];
+    __u32 key_size, idx;
+
+    for (__u32 i = 0; i < 2000 && !node_is_full(node, 6, 0); i++)
+    {
+        random_key(key, &key_size, &state);
+        if (!node_bin_search(node, key, key_size, &idx))
+            node_insert_nonfull(node, idx, key, key_size, NULL, 0);
+    }
+    ASSERT(node->size > 100);
+
+    for (__u32 i = 0; i < 5000; i++)
+    {
+        random_key(key, &key_size, &state);
+
+        __u32 expected = 0;
+        while (expected < node->size && key_compare(node, node_get_cell_ptr(node, expected), key, key_size) < 0)
+            expected++;
+        int found = expected < node->size && key_compare(node, node_get_cell_ptr(node, expected), key, key_size) == 0;
+
+        ASSERT(node_bin_search(node, key, key_size, &idx) == found);
+        ASSERT(idx == expected);
+    }
+
+    free(node);
+    LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
+}
+
 int main()
 {
     test_key_compare();
     test_insert_position();
+    test_prefix_order();
+    test_search_ties();
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 #define ASSERTION
 #define DEBUG
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "../src/include/utils.h"
 #include "../src/include/tree/btree.h"
@@ -96,7 +98,142 @@ void test_insert_position()
     LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
 }
 
+static __u32 tombstones(struct node *node)
+{
+    __u32 count = 0;
+    for (__u32 off = node->tombstone_offset; off; off = node_cell_from_offset(node, off)->next_off)
+        count++;
+
+    return count;
+}
+
+// neighbour tombstones become one, the lowest cell goes back to the free space
+void test_tombstone_merge()
+{
+    struct node *node = btree_node_alloc();
+    ASSERT(node);
+    node_init(node, BTREE_NODE_FLAGS_LEAF);
+
+    // inserted in order, each cell lies below the previous one
+    insert_and_test(node, "test0", "data");
+    insert_and_test(node, "test1", "data");
+    insert_and_test(node, "test2", "data");
+    insert_and_test(node, "test3", "data");
+    insert_and_test(node, "test4", "data");
+    __u32 size = ALIGN(sizeof(struct cell) + strlen("test0") + strlen("data"), sizeof(__u32));
+    __u32 cell_offset = node->cell_offset;
+
+    delete_key(node, "test1");
+    delete_key(node, "test3");
+    ASSERT(tombstones(node) == 2);
+    delete_key(node, "test2");
+    ASSERT(tombstones(node) == 1);
+    ASSERT(node->tombstone_bytes == size * 3);
+
+    delete_key(node, "test4");
+    ASSERT(tombstones(node) == 0 && node->tombstone_bytes == 0);
+    ASSERT(node->cell_offset == cell_offset + size * 4);
+    check_index(node, "test0", 0);
+
+    free(node);
+    LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
+}
+
+// a cell larger than any tombstone fits once the node is compacted
+void test_compact()
+{
+    struct node *node = btree_node_alloc();
+    ASSERT(node);
+    node_init(node, BTREE_NODE_FLAGS_LEAF);
+
+    char key[16], value[1024];
+    __u32 count;
+    memset(value, 'v', sizeof(value));
+    for (count = 0;; count++)
+    {
+        snprintf(key, sizeof(key), "key%04u", count);
+        if (node_is_full(node, strlen(key), 40))
+            break;
+        value[40] = 0;
+        insert_and_test(node, key, value);
+    }
+
+    // every other cell, no two tombstones touch
+    for (__u32 i = 1; i < count; i += 2)
+    {
+        snprintf(key, sizeof(key), "key%04u", i);
+        delete_key(node, key);
+    }
+    ASSERT(tombstones(node) == count / 2);
+
+    // more than the tombstones and the slots freed in the gap can hold alone
+    value[1000] = 0;
+    ASSERT(!node_is_full(node, strlen("big"), 1000));
+    __u32 idx;
+    ASSERT(!node_bin_search(node, (__u8 *)"big", 3, &idx));
+    node_insert_nonfull(node, idx, (__u8 *)"big", 3, (__u8 *)value, 1000);
+    ASSERT(tombstones(node) == 0 && node->tombstone_bytes == 0);
+
+    struct cell_pointers pointers;
+    ASSERT(node_get_cell(node, (__u8 *)"big", 3));
+    for (__u32 i = 0; i < count; i += 2)
+    {
+        snprintf(key, sizeof(key), "key%04u", i);
+        struct cell_ptr *cell_ptr = node_get_cell(node, (__u8 *)key, strlen(key));
+        ASSERT(cell_ptr);
+        node_cell_pointers(node, cell_ptr, &pointers);
+        ASSERT(pointers.value_size == 40 && !memcmp(pointers.value, value, 40));
+    }
+
+    free(node);
+    LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
+}
+
+// shorter values are overwritten in their cell and free the rest, longer ones do not fit it
+void test_update_in_place()
+{
+    struct node *node = btree_node_alloc();
+    ASSERT(node);
+    node_init(node, BTREE_NODE_FLAGS_LEAF);
+
+    char value[128];
+    memset(value, 'v', sizeof(value));
+    value[100] = 0;
+    insert_and_test(node, "test0", value);
+    insert_and_test(node, "test1", value);
+    __u32 cell_offset = node->cell_offset;
+
+    struct cell_pointers pointers;
+    struct cell_ptr *cell_ptr = node_get_cell(node, (__u8 *)"test0", 5);
+    ASSERT(node_update_leaf_cell(node, 0, (__u8 *)"short", 5) == 0);
+    node_cell_pointers(node, cell_ptr, &pointers);
+    ASSERT(pointers.value_size == 5 && !memcmp(pointers.value, "short", 5));
+    __u32 size = ALIGN(sizeof(struct cell) + 5 + 100, sizeof(__u32));
+    ASSERT(tombstones(node) == 1 && node->tombstone_bytes == size - ALIGN(sizeof(struct cell) + 5 + 5, sizeof(__u32)));
+    ASSERT(node->cell_offset == cell_offset);
+
+    // back to the old size the cell is too small, removed it merges with its rest
+    ASSERT(node_update_leaf_cell(node, 0, (__u8 *)value, 100) == 1);
+    node_remove_cell(node, 0);
+    ASSERT(tombstones(node) == 1 && node->tombstone_bytes == size);
+    check_index(node, "test1", 0);
+
+    // a rest too short for a tombstone is not live, compacting takes it back
+    __u32 live = node_live_bytes(node);
+    ASSERT(node_update_leaf_cell(node, 0, (__u8 *)value, 96) == 0);
+    ASSERT(tombstones(node) == 1 && node->tombstone_bytes == size + 4);
+    ASSERT(node_live_bytes(node) == live - 4);
+    node_compact(node);
+    ASSERT(tombstones(node) == 0 && node->tombstone_bytes == 0 && node_live_bytes(node) == live - 4);
+
+    free(node);
+    LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
+}
+
 int main()
 {
     test_insert_position();
+    test_tombstone_merge();
+    test_compact();
+    test_update_in_place();
 }
\ No newline at end of file
@@ -0,0 +1,149 @@
+#define ASSERTION
+#define DEBUG
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include "test_btree_common.h"
+
+// values from a few bytes to 1MB, the large ones spill to overflow pages
+#ifndef OVERFLOW_TUPLES
+#define OVERFLOW_TUPLES (4 * 1024)
+#endif
+#define TEST_FILE "__test_btree_overflow.db"
+#define TEST_FRAMES (1024)
+#define VALUE_HUGE (1024 * 1024)
+
+static struct io_uring ring;
+static __u8 value[VALUE_HUGE];
+static __u8 read_value[VALUE_HUGE];
+
+// mostly small values, every 16th between 100B and 64KB and a few of 1MB
+static __u32 mixed_size(__u64 n)
+{
+    __u64 r = mix(n ^ 0xaaaa);
+    if (n % 512 == 0)
+        return VALUE_HUGE;
+    if (n % 16 == 0)
+        return 100 + r % (64 * 1024);
+    return 8 + r % 100;
+}
+
+static void value_fill(__u8 *buf, __u64 n, __u32 size)
+{
+    for (__u32 i = 0; i < size; i += sizeof(__u64))
+    {
+        __u64 word = mix(n + i);
+        memcpy(buf + i, &word, min(size - i, (__u32)sizeof(word)));
+    }
+}
+
+// every value read back whole, returns the bytes read
+static __u64 check(struct btree *btree)
+{
+    struct cell_pointers pointers;
+    __u8 key[KEY_SIZE];
+    __u64 bytes = 0;
+
+    ASSERT(btree->count == OVERFLOW_TUPLES);
+    for (__u64 n = 0; n < OVERFLOW_TUPLES; n++)
+    {
+        __u32 size = mixed_size(n);
+        key_format(key, n);
+        ASSERT(btree_search(btree, key, KEY_SIZE, &pointers) == 0);
+        ASSERT(pointers.value_size == size);
+        ASSERT(!pointers.overflow_pid == (size <= BTREE_INLINE_MAX));
+
+        ASSERT(btree_value_read(btree, &pointers, read_value) == 0);
+        btree_search_release(btree, &pointers);
+        value_fill(value, n, size);
+        ASSERT(!memcmp(read_value, value, size));
+        bytes += size;
+
+        // the copy out through the optimistic path
+        __u32 get_size;
+        memset(read_value, 0, size);
+        ASSERT(btree_get(btree, key, KEY_SIZE, read_value, size - 1, &get_size) == 0 && get_size == size);
+        ASSERT(btree_get(btree, key, KEY_SIZE, read_value, VALUE_HUGE, &get_size) == 0 && get_size == size);
+        ASSERT(!memcmp(read_value, value, size));
+    }
+
+    return bytes;
+}
+
+// the leaves hold the inline part only, in key order
+static void scan(struct btree *btree)
+{
+    struct btree_cursor cursor;
+    struct cell_pointers pointers;
+    __u64 count = 0, overflowed = 0;
+    int ret;
+
+    btree_cursor_init(&cursor, btree);
+    for (ret = btree_cursor_seek(&cursor, NULL, 0); !ret; ret = btree_cursor_next(&cursor), count++)
+    {
+        btree_cursor_get(&cursor, &pointers);
+        if (!pointers.overflow_pid)
+            continue;
+        ASSERT(pointers.value_size > BTREE_INLINE_MAX);
+        overflowed++;
+    }
+    ASSERT(ret == 1 && count == OVERFLOW_TUPLES && overflowed > 0);
+}
+
+int main()
+{
+    struct buffer_pool pool;
+    struct btree btree;
+    struct timespec start;
+    __u8 key[KEY_SIZE];
+    __u64 bytes = 0;
+    int fd;
+
+    ASSERT(io_uring_queue_init(64, &ring, 0) == 0);
+
+    fd = tree_open(&ring, &pool, &btree, TEST_FILE, TEST_FRAMES, 1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (__u64 n = 0; n < OVERFLOW_TUPLES; n++)
+    {
+        __u32 size = mixed_size(n);
+        key_format(key, n);
+        value_fill(value, n, size);
+        ASSERT(btree_insert(&btree, key, KEY_SIZE, value, size) == 0);
+        ASSERT(btree_insert(&btree, key, KEY_SIZE, value, size) == 1);
+        bytes += size;
+    }
+    ASSERT(btree_flush(&btree) == 0);
+    double write_s = elapsed_s(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ASSERT(check(&btree) == bytes);
+    double read_s = elapsed_s(&start);
+    scan(&btree);
+    __u64 pages = btree.next_pid - 1;
+    tree_close(&pool, fd);
+
+    // the overflow pages are on disk with the leaves pointing at them
+    fd = tree_open(&ring, &pool, &btree, TEST_FILE, TEST_FRAMES, 0);
+    ASSERT(btree.next_pid - 1 == pages);
+    ASSERT(check(&btree) == bytes);
+
+    // deleted values give their overflow pages to the free list
+    __u32 free_count = btree.free_count, overflowed = 0;
+    for (__u64 n = 0; n < OVERFLOW_TUPLES; n += 16)
+    {
+        key_format(key, n);
+        ASSERT(btree_delete(&btree, key, KEY_SIZE) == 0);
+        overflowed += mixed_size(n) > BTREE_INLINE_MAX;
+    }
+    ASSERT(btree.free_count >= free_count + overflowed);
+    ASSERT(btree.next_pid - 1 == pages);
+    tree_close(&pool, fd);
+
+    printf("bench btree overflow tuples: %u MB: %.1f pages: %llu write MB/s: %.0f read MB/s: %.0f\n",
+           OVERFLOW_TUPLES, bytes / 1e6, pages, bytes / 1e6 / write_s, bytes / 1e6 / read_s);
+
+    unlink(TEST_FILE);
+    io_uring_queue_exit(&ring);
+
+    LOG("TEST (%s): ok\n", __FILE__);
+}
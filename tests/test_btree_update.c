@@ -0,0 +1,144 @@
+#define ASSERTION
+#define DEBUG
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include "test_btree_common.h"
+
+// rounds giving every key a value of another size, with btree_update against
+// btree_delete followed by btree_insert, then upserts over old and new keys
+#ifndef UPDATE_TUPLES
+#define UPDATE_TUPLES (200 * 1000)
+#endif
+#ifndef UPDATE_ROUNDS
+#define UPDATE_ROUNDS (4)
+#endif
+#define TEST_FILE "__test_btree_update.db"
+#define TEST_FRAMES (64 * 1024)
+#define VALUE_LARGE (64 * 1024)
+
+static struct btree btree;
+static __u8 rounds[UPDATE_TUPLES * 2];
+static __u8 value[VALUE_LARGE];
+static __u8 read_value[VALUE_LARGE];
+
+// the value of key n written in round r is value_size(n, r) bytes of n + r
+static void check(__u64 numbers)
+{
+    struct cell_pointers pointers;
+    __u8 key[KEY_SIZE];
+
+    for (__u64 n = 0; n < numbers; n++)
+    {
+        key_format(key, n);
+        ASSERT(btree_search(&btree, key, KEY_SIZE, &pointers) == 0);
+        __u32 size = value_size(n, rounds[n]);
+        ASSERT(pointers.value_size == size && pointers.value[0] == (__u8)(n + rounds[n]) && pointers.value[size - 1] == (__u8)(n + rounds[n]));
+        btree_search_release(&btree, &pointers);
+    }
+    ASSERT(btree.count == numbers);
+    tree_check(&btree);
+}
+
+static double update_round(__u32 round, int delete_insert)
+{
+    struct timespec start;
+    __u8 key[KEY_SIZE];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (__u64 n = 0; n < UPDATE_TUPLES; n++)
+    {
+        __u32 size = value_size(n, round);
+        key_format(key, n);
+        memset(value, (__u8)(n + round), size);
+        if (delete_insert)
+        {
+            ASSERT(btree_delete(&btree, key, KEY_SIZE) == 0);
+            ASSERT(btree_insert(&btree, key, KEY_SIZE, value, size) == 0);
+        }
+        else
+        {
+            ASSERT(btree_update(&btree, key, KEY_SIZE, value, size) == 0);
+        }
+        rounds[n] = round;
+    }
+
+    return elapsed_s(&start);
+}
+
+int main()
+{
+    struct io_uring ring;
+    struct buffer_pool pool;
+    struct cell_pointers pointers;
+    __u8 key[KEY_SIZE];
+
+    ASSERT(io_uring_queue_init(64, &ring, 0) == 0);
+
+    int fd = tree_open(&ring, &pool, &btree, TEST_FILE, TEST_FRAMES, 1);
+
+    for (__u64 n = 0; n < UPDATE_TUPLES; n++)
+    {
+        key_format(key, n);
+        memset(value, (__u8)n, value_size(n, 0));
+        ASSERT(btree_insert(&btree, key, KEY_SIZE, value, value_size(n, 0)) == 0);
+        ASSERT(btree_insert(&btree, key, KEY_SIZE, value, value_size(n, 0)) == 1);
+    }
+    key_format(key, UPDATE_TUPLES);
+    ASSERT(btree_update(&btree, key, KEY_SIZE, value, VALUE_MIN) == 1);
+    check(UPDATE_TUPLES);
+
+    double update_s = 0;
+    for (__u32 round = 1; round <= UPDATE_ROUNDS; round++)
+        update_s += update_round(round, 0);
+    __u64 update_nodes = btree.next_pid - 1 - btree.free_count;
+    check(UPDATE_TUPLES);
+
+    double delete_insert_s = 0;
+    for (__u32 round = UPDATE_ROUNDS + 1; round <= UPDATE_ROUNDS * 2; round++)
+        delete_insert_s += update_round(round, 1);
+    __u64 delete_insert_nodes = btree.next_pid - 1 - btree.free_count;
+    check(UPDATE_TUPLES);
+
+    // half of them are already in the tree
+    for (__u64 n = UPDATE_TUPLES / 2; n < UPDATE_TUPLES * 2; n++)
+    {
+        __u32 size = value_size(n, 0);
+        key_format(key, n);
+        memset(value, (__u8)n, size);
+        ASSERT(btree_upsert(&btree, key, KEY_SIZE, value, size) == 0);
+        rounds[n] = 0;
+    }
+    check(UPDATE_TUPLES * 2);
+
+    // a value growing past the inline limit moves to overflow pages and back
+    key_format(key, 0);
+    memset(value, 'l', VALUE_LARGE);
+    ASSERT(btree_update(&btree, key, KEY_SIZE, value, VALUE_LARGE) == 0);
+    ASSERT(btree_search(&btree, key, KEY_SIZE, &pointers) == 0);
+    ASSERT(pointers.overflow_pid && pointers.value_size == VALUE_LARGE);
+    ASSERT(btree_value_read(&btree, &pointers, read_value) == 0);
+    ASSERT(!memcmp(read_value, value, VALUE_LARGE));
+    btree_search_release(&btree, &pointers);
+
+    // the replaced pages go to the free list, the file does not grow with
+    // every large update
+    __u32 free_count = btree.free_count;
+    ASSERT(btree_upsert(&btree, key, KEY_SIZE, value, VALUE_LARGE) == 0);
+    ASSERT(btree.free_count >= free_count + VALUE_LARGE / BUFFER_PAGE_SIZE);
+    free_count = btree.free_count;
+    memset(value, rounds[0], value_size(0, rounds[0]));
+    ASSERT(btree_update(&btree, key, KEY_SIZE, value, value_size(0, rounds[0])) == 0);
+    ASSERT(btree.free_count >= free_count + VALUE_LARGE / BUFFER_PAGE_SIZE);
+    check(UPDATE_TUPLES * 2);
+
+    __u64 updates = (__u64)UPDATE_TUPLES * UPDATE_ROUNDS;
+    printf("bench btree update tuples: %u rounds: %u updates/s: %.0f delete+insert/s: %.0f speedup: %.2f nodes update: %llu delete+insert: %llu\n",
+           UPDATE_TUPLES, UPDATE_ROUNDS, updates / update_s, updates / delete_insert_s, delete_insert_s / update_s, update_nodes, delete_insert_nodes);
+
+    tree_close(&pool, fd);
+    unlink(TEST_FILE);
+    io_uring_queue_exit(&ring);
+
+    LOG("TEST (%s): ok\n", __FILE__);
+}
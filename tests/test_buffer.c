@@ -0,0 +1,117 @@
+#define ASSERTION
+#define DEBUG
+#include "../src/include/utils.h"
+#include "../src/include/tree/buffer.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <liburing.h>
+
+#define TEST_FILE "__test_buffer.db"
+#define FRAMES (4)
+#define PAGES (8)
+
+static void page_stamp(void *page, __u64 pid)
+{
+    *(__u64 *)page = pid;
+    *(__u64 *)(page + BUFFER_PAGE_SIZE - sizeof(__u64)) = ~pid;
+}
+
+static int page_check(void *page, __u64 pid)
+{
+    return *(__u64 *)page == pid && *(__u64 *)(page + BUFFER_PAGE_SIZE - sizeof(__u64)) == ~pid;
+}
+
+int main()
+{
+    struct io_uring ring;
+    ASSERT(io_uring_queue_init(64, &ring, 0) == 0);
+
+    int fd = open(TEST_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd >= 0);
+
+    struct buffer_pool pool;
+    ASSERT(buffer_pool_init(&pool, &ring, fd, FRAMES) == 0);
+    ASSERT(((__u64)pool.buf % BUFFER_PAGE_SIZE) == 0);
+
+    // more pages than frames: the dirty ones are written back on eviction
+    for (__u64 pid = 0; pid < PAGES; pid++)
+    {
+        void *page = buffer_pool_new(&pool, pid);
+        ASSERT(page);
+        ASSERT(buffer_pool_pid(&pool, page) == pid);
+        page_stamp(page, pid);
+        buffer_pool_unpin(&pool, page, 1);
+    }
+    ASSERT(pool.evictions == PAGES - FRAMES);
+    ASSERT(pool.writebacks == PAGES - FRAMES);
+
+    // the last pages are still cached
+    void *page = buffer_pool_fetch(&pool, PAGES - 1);
+    ASSERT(page && page_check(page, PAGES - 1));
+    buffer_pool_unpin(&pool, page, 0);
+    ASSERT(pool.hits == 1 && pool.misses == 0);
+
+    // the first ones come back from the file
+    for (__u64 pid = 0; pid < FRAMES; pid++)
+    {
+        page = buffer_pool_fetch(&pool, pid);
+        ASSERT(page && page_check(page, pid));
+        buffer_pool_unpin(&pool, page, 0);
+    }
+    ASSERT(pool.misses == FRAMES);
+
+    // one more miss clears every reference bit, a page touched after that
+    // survives the next sweep
+    page = buffer_pool_fetch(&pool, PAGES - 2);
+    ASSERT(page && page_check(page, PAGES - 2));
+    buffer_pool_unpin(&pool, page, 0);
+    __u64 hot = BUFFER_PID_NONE;
+    for (__u32 i = 0; i < FRAMES; i++)
+        if (pool.frames[i].pid != PAGES - 2)
+            hot = pool.frames[i].pid;
+    page = buffer_pool_fetch(&pool, hot);
+    buffer_pool_unpin(&pool, page, 0);
+    page = buffer_pool_fetch(&pool, PAGES - 1);
+    ASSERT(page && page_check(page, PAGES - 1));
+    buffer_pool_unpin(&pool, page, 0);
+    __u64 hits = pool.hits;
+    page = buffer_pool_fetch(&pool, hot);
+    ASSERT(pool.hits == hits + 1);
+    buffer_pool_unpin(&pool, page, 0);
+
+    // every frame pinned: no victim
+    void *pinned[FRAMES];
+    for (__u64 pid = 0; pid < FRAMES; pid++)
+    {
+        pinned[pid] = buffer_pool_fetch(&pool, pid);
+        ASSERT(pinned[pid]);
+    }
+    ASSERT(buffer_pool_fetch(&pool, PAGES - 1) == NULL);
+    for (__u64 pid = 0; pid < FRAMES; pid++)
+        buffer_pool_unpin(&pool, pinned[pid], 1);
+
+    // a page past the end of the file is a short read
+    ASSERT(buffer_pool_fetch(&pool, PAGES * 4) == NULL);
+
+    ASSERT(buffer_pool_flush(&pool) == 0);
+    for (__u32 i = 0; i < FRAMES; i++)
+        ASSERT(!pool.frames[i].dirty);
+
+    buffer_pool_free(&pool);
+
+    // reopen: everything is on disk
+    ASSERT(buffer_pool_init(&pool, &ring, fd, FRAMES) == 0);
+    for (__u64 pid = 0; pid < PAGES; pid++)
+    {
+        page = buffer_pool_fetch(&pool, pid);
+        ASSERT(page && page_check(page, pid));
+        buffer_pool_unpin(&pool, page, 0);
+    }
+    buffer_pool_free(&pool);
+
+    close(fd);
+    unlink(TEST_FILE);
+    io_uring_queue_exit(&ring);
+
+    LOG("TEST (%s): ok\n", __FILE__);
+}
@@ -0,0 +1,128 @@
+#define ASSERTION
+#define DEBUG
+#include "../src/include/utils.h"
+#include "../src/include/controller.h"
+
+#define MAX_DEPTH (1024)
+#define TARGET_US (1000)
+
+static void record_n(struct controller *ctl, __u64 latency_us, __u32 n)
+{
+    for (__u32 i = 0; i < n; i++)
+        controller_record(ctl, latency_us);
+}
+
+static void test_heuristic(void)
+{
+    struct controller ctl;
+    controller_init(&ctl, CONTROLLER_HEURISTIC, MAX_DEPTH, 0);
+
+    // same sequence as the old inline batch sizing
+    ASSERT(controller_update(&ctl, 0) == 1);
+    ASSERT(controller_update(&ctl, 0) == 2);
+    ASSERT(controller_update(&ctl, 0) == 4);
+    ASSERT(controller_update(&ctl, 4) == 5);
+    ASSERT(controller_update(&ctl, 16) == 5);
+    ASSERT(ctl.decision == CONTROLLER_HOLD);
+    ASSERT(controller_update(&ctl, 64) == 4);
+    ASSERT(ctl.decision == CONTROLLER_DECREASE);
+}
+
+static void test_aimd(void)
+{
+    struct controller ctl;
+    controller_init(&ctl, CONTROLLER_AIMD, MAX_DEPTH, TARGET_US);
+    ASSERT(ctl.depth == 1);
+
+    // no completion while ops are inflight: wait
+    ASSERT(controller_update(&ctl, 1) == 1);
+    ASSERT(ctl.decision == CONTROLLER_HOLD);
+
+    // slow start doubles while under target
+    record_n(&ctl, TARGET_US / 2, 100);
+    ASSERT(controller_update(&ctl, 1) == 2);
+    record_n(&ctl, TARGET_US / 2, 100);
+    ASSERT(controller_update(&ctl, 2) == 4);
+    ASSERT(ctl.decision == CONTROLLER_INCREASE);
+
+    for (__u32 i = 0; i < 10; i++)
+    {
+        record_n(&ctl, TARGET_US / 2, 100);
+        controller_update(&ctl, ctl.depth);
+    }
+    ASSERT(ctl.depth == MAX_DEPTH);
+
+    // a breach of the p99 target cuts the depth and ends slow start
+    record_n(&ctl, TARGET_US / 2, 98);
+    record_n(&ctl, TARGET_US * 4, 2);
+    ASSERT(controller_update(&ctl, MAX_DEPTH) == MAX_DEPTH * CONTROLLER_AIMD_DECREASE_PERCENT / 100);
+    ASSERT(ctl.decision == CONTROLLER_DECREASE);
+    ASSERT(ctl.observed_us > TARGET_US);
+
+    __u32 depth = ctl.depth;
+    record_n(&ctl, TARGET_US / 2, 100);
+    ASSERT(controller_update(&ctl, depth) == depth + CONTROLLER_AIMD_INCREASE);
+
+    // never below one op
+    for (__u32 i = 0; i < 64; i++)
+    {
+        record_n(&ctl, TARGET_US * 4, 10);
+        controller_update(&ctl, ctl.depth);
+    }
+    ASSERT(ctl.depth == 1);
+    ASSERT(ctl.decisions == 79);
+}
+
+static void test_gradient(void)
+{
+    struct controller ctl;
+    controller_init(&ctl, CONTROLLER_GRADIENT, MAX_DEPTH, 0);
+
+    // flat latency: the depth keeps growing
+    __u32 prev = ctl.depth;
+    for (__u32 i = 0; i < 64; i++)
+    {
+        record_n(&ctl, 100, 100);
+        controller_update(&ctl, ctl.depth);
+        ASSERT(ctl.depth >= prev);
+        prev = ctl.depth;
+    }
+    ASSERT(ctl.depth > 16);
+    ASSERT(ctl.min_latency_us <= 100);
+
+    // latency proportional to depth past a knee of 32: the device is
+    // saturated and the depth settles close to the knee
+    for (__u32 i = 0; i < 512; i++)
+    {
+        __u64 latency = 100 * max(1, ctl.depth / 32);
+        record_n(&ctl, latency, 100);
+        controller_update(&ctl, ctl.depth);
+    }
+    ASSERT(ctl.depth >= 32 && ctl.depth <= 32 * 3);
+
+    // a p99 target below the observed latency pushes the depth down
+    controller_init(&ctl, CONTROLLER_GRADIENT, MAX_DEPTH, TARGET_US);
+    ctl.depth = 512;
+    ctl.smoothed_depth = 512;
+    record_n(&ctl, TARGET_US / 2, 100);
+    controller_update(&ctl, ctl.depth);
+    for (__u32 i = 0; i < 16; i++)
+    {
+        record_n(&ctl, TARGET_US / 2, 98);
+        record_n(&ctl, TARGET_US * 4, 2);
+        controller_update(&ctl, ctl.depth);
+        ASSERT(ctl.decision == CONTROLLER_DECREASE);
+    }
+    ASSERT(ctl.depth < 512 / 2);
+}
+
+int main()
+{
+    test_heuristic();
+    test_aimd();
+    test_gradient();
+
+    ASSERT(controller_name(CONTROLLER_AIMD)[0] == 'a');
+
+    LOG("TEST (%s): ok\n", __FILE__);
+}
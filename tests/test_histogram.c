@@ -0,0 +1,100 @@
+#define ASSERTION
+#define DEBUG
+#include "../src/include/utils.h"
+#include "../src/include/histogram.h"
+
+void check_close(__u64 val, __u64 expected)
+{
+    // bucket upper bound is at most 1/HISTOGRAM_SUB_COUNT above the value
+    ASSERT(val >= expected);
+    ASSERT(val <= expected + expected / HISTOGRAM_SUB_COUNT + 1);
+}
+
+void test_bucket_idx()
+{
+    for (__u64 val = 0; val < HISTOGRAM_SUB_COUNT * 2; val++)
+        ASSERT(histogram_bucket_value(histogram_bucket_idx(val)) == val);
+
+    __u32 prev = 0;
+    for (__u64 val = 1; val < ((__u64)1 << HISTOGRAM_MAX_BITS); val = val * 3 / 2 + 1)
+    {
+        __u32 idx = histogram_bucket_idx(val);
+        ASSERT(idx >= prev);
+        ASSERT(idx < HISTOGRAM_BUCKETS);
+        check_close(histogram_bucket_value(idx), val);
+        prev = idx;
+    }
+
+    ASSERT(histogram_bucket_idx((__u64)1 << 40) == HISTOGRAM_BUCKETS - 1);
+
+    LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
+}
+
+void test_percentiles()
+{
+    struct histogram histogram;
+    struct histogram_percentiles p;
+    histogram_reset(&histogram);
+
+    ASSERT(histogram_value_at(&histogram, 99.0) == 0);
+
+    for (__u64 val = 1; val <= 10000; val++)
+        histogram_record(&histogram, val);
+
+    histogram_percentiles(&histogram, &p);
+    check_close(p.p50, 5000);
+    check_close(p.p90, 9000);
+    check_close(p.p99, 9900);
+    check_close(p.p999, 9990);
+    ASSERT(p.max == 10000);
+    ASSERT(histogram_value_at(&histogram, 100.0) == 10000);
+
+    struct histogram other;
+    histogram_reset(&other);
+    for (__u32 i = 0; i < 10000; i++)
+        histogram_record(&other, 1000000);
+
+    histogram_merge(&histogram, &other);
+    ASSERT(histogram.total == 20000);
+    ASSERT(histogram.max == 1000000);
+    check_close(histogram_value_at(&histogram, 25.0), 5000);
+    check_close(histogram_value_at(&histogram, 99.0), 1000000);
+
+    LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
+}
+
+void test_window()
+{
+    struct histogram_window window;
+    histogram_window_init(&window, 4);
+
+    histogram_window_record(&window, 100);
+    histogram_window_move(&window);
+    histogram_window_record(&window, 10);
+    histogram_window_record(&window, 20);
+    ASSERT(window.acc.total == 3);
+    ASSERT(window.acc.max == 100);
+
+    histogram_window_move(&window);
+    histogram_window_move(&window);
+    ASSERT(window.acc.total == 3);
+
+    // the slot holding 100 slides out of the window
+    histogram_window_move(&window);
+    ASSERT(window.acc.total == 2);
+    ASSERT(window.acc.max == 20);
+    ASSERT(histogram_value_at(&window.acc, 50.0) == 10);
+
+    histogram_window_move(&window);
+    ASSERT(window.acc.total == 0);
+    ASSERT(window.acc.max == 0);
+
+    LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
+}
+
+int main()
+{
+    test_bucket_idx();
+    test_percentiles();
+    test_window();
+}
@@ -0,0 +1,60 @@
+#define ASSERTION
+#define DEBUG
+#include "../src/include/utils.h"
+#include "../src/include/pool.h"
+#include <string.h>
+
+int main()
+{
+    struct test_item
+    {
+        __u64 a;
+        __u64 b;
+        __u32 c;
+    };
+    struct pool pool;
+    pool_init(&pool, sizeof(struct test_item), 4);
+
+    struct test_item *items[4];
+
+    ASSERT(pool.item_size >= sizeof(struct test_item));
+    ASSERT(pool.item_size % sizeof(void *) == 0);
+    ASSERT(pool_free_count(&pool) == 4);
+    ASSERT(!pool_is_empty(&pool));
+
+    for (__u32 i = 0; i < ARRAY_LEN(items); i++)
+    {
+        items[i] = pool_get(&pool);
+        ASSERT(items[i]);
+        memset(items[i], 0xff, sizeof(struct test_item));
+        for (__u32 j = 0; j < i; j++)
+            ASSERT(items[i] != items[j]);
+    }
+
+    ASSERT(pool_is_empty(&pool));
+    ASSERT(pool_free_count(&pool) == 0);
+    ASSERT(pool.high_water == 4);
+    ASSERT(pool.exhausted == 0);
+
+    ASSERT(pool_get(&pool) == NULL);
+    ASSERT(pool_get(&pool) == NULL);
+    ASSERT(pool.exhausted == 2);
+
+    pool_put(&pool, items[1]);
+    pool_put(&pool, items[3]);
+    ASSERT(pool_free_count(&pool) == 2);
+    ASSERT(pool.high_water == 4);
+
+    // last released is handed out first
+    ASSERT(pool_get(&pool) == items[3]);
+    ASSERT(pool_get(&pool) == items[1]);
+    ASSERT(pool_is_empty(&pool));
+
+    for (__u32 i = 0; i < ARRAY_LEN(items); i++)
+        pool_put(&pool, items[i]);
+
+    ASSERT(pool_free_count(&pool) == 4);
+    ASSERT(pool.used == 0);
+
+    LOG("TEST (%s): ok\n", __FILE__);
+}
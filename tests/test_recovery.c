@@ -0,0 +1,208 @@
+#define ASSERTION
+#define DEBUG
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <liburing.h>
+#include "../src/include/utils.h"
+#include "../src/include/wal.h"
+#include "../src/include/recovery.h"
+#include "../src/include/tree/btree.h"
+
+#define TEST_FILE "__test_recovery.db"
+#define TEST_TREE "__test_recovery.tree"
+#define THREADS (3)
+#define SHARD_PAGES (160)
+// page of the second shard torn by the crash
+#define TORN_PAGE (70)
+#define EPOCH (42)
+#define KEY_SIZE (16)
+#define VALUE_SIZE (32)
+// even records rewrite the key of the record this many records before them,
+// further apart than a recovery chunk
+#define REWRITE_LAG (4096)
+
+static __u64 shard_start[THREADS + 1] = {0, SHARD_PAGES, SHARD_PAGES * 2, SHARD_PAGES * 3};
+// keys of the valid records of each partition
+static __u64 partition_keys[THREADS];
+// 1 + record of the last valid write of the rewritten keys of each shard
+static __u64 last_seq[THREADS][REWRITE_LAG];
+
+// the value of a record starts with its sequence number
+static void record_key(__u8 *key, __u32 shard, __u64 seq)
+{
+    __u64 id = seq % 2 ? seq : seq % REWRITE_LAG;
+    // spread over the partitions, the second half makes it unique
+    __u64 be[2] = {__builtin_bswap64(id * 0x9E3779B97F4A7C15ull), (__u64)shard << 48 | id};
+    memcpy(key, be, KEY_SIZE);
+}
+
+// write the complete pages of the log, pages from valid_pages on are torn
+static __u64 shard_drain(int fd, __u32 shard, struct wal *wal, __u64 valid_pages)
+{
+    __u64 records = 0;
+    __u32 ready = wal_pages_ready(wal, WAL_BUF_PAGES);
+
+    for (__u32 i = 0; i < ready; i++)
+    {
+        __u64 page_no = wal->submitted_page;
+        wal_page_submit(wal, page_no);
+        void *buf = wal_page_buf(wal, page_no);
+
+        if (page_no < valid_pages)
+        {
+            struct wal_page *page = buf;
+            for (__u32 off = sizeof(struct wal_page); off < page->used; records++)
+            {
+                struct wal_record *record = buf + off;
+                struct wal_insert *insert = (struct wal_insert *)record->data;
+                __u64 seq;
+                memcpy(&seq, insert->data + insert->key_size, sizeof(seq));
+                if (seq % 2 || seq < REWRITE_LAG)
+                    partition_keys[recovery_partition(insert->data, insert->key_size, THREADS)]++;
+                if (seq % 2 == 0)
+                    last_seq[shard][seq % REWRITE_LAG] = seq + 1;
+                off += ALIGN((__u32)sizeof(*record) + record->len, WAL_RECORD_ALIGN);
+            }
+        }
+        else
+            ((__u8 *)buf)[WAL_PAGE_SIZE / 2] ^= 1;
+
+        ASSERT(pwrite(fd, buf, WAL_PAGE_SIZE, (shard_start[shard] + page_no) * WAL_PAGE_SIZE) == WAL_PAGE_SIZE);
+        wal_pages_written(wal, 1);
+    }
+
+    return records;
+}
+
+static __u64 shard_write(int fd, __u32 shard, __u64 valid_pages)
+{
+    struct wal wal;
+    __u8 record[sizeof(struct wal_insert) + KEY_SIZE + VALUE_SIZE];
+    struct wal_insert *insert = (struct wal_insert *)record;
+    __u64 records = 0;
+
+    ASSERT(wal_init(&wal, SHARD_PAGES, EPOCH) == 0);
+    memset(record, 'v', sizeof(record));
+    insert->key_size = KEY_SIZE;
+    insert->value_size = VALUE_SIZE;
+
+    for (__u64 seq = 0;; seq++)
+    {
+        record_key(insert->data, shard, seq);
+        memcpy(insert->data + KEY_SIZE, &seq, sizeof(seq));
+
+        int ret = wal_append(&wal, record, sizeof(record), NULL, NULL);
+        if (ret == -ENOSPC)
+            break;
+        ASSERT(ret == 0);
+        records += shard_drain(fd, shard, &wal, valid_pages);
+    }
+
+    wal_seal(&wal);
+    records += shard_drain(fd, shard, &wal, valid_pages);
+    ASSERT(wal.submitted_page == SHARD_PAGES);
+
+    wal_free(&wal);
+    return records;
+}
+
+static void tree_check(__u32 partition)
+{
+    struct io_uring ring;
+    struct buffer_pool pool;
+    struct btree btree;
+    char path[64];
+
+    snprintf(path, sizeof(path), "%s.%u", TEST_TREE, partition);
+    int fd = open(path, O_RDWR);
+    ASSERT(fd >= 0);
+    ASSERT(io_uring_queue_init(64, &ring, 0) == 0);
+    ASSERT(buffer_pool_init(&pool, &ring, fd, BTREE_MIN_FRAMES) == 0);
+    ASSERT(btree_open(&btree, &pool) == 0);
+    ASSERT(btree.count == partition_keys[partition]);
+
+    // rewritten keys hold the value of their last write
+    for (__u32 shard = 0; shard < THREADS; shard++)
+    {
+        for (__u64 id = 0; id < REWRITE_LAG; id += 2)
+        {
+            __u8 key[KEY_SIZE];
+            __u8 value[VALUE_SIZE];
+            __u32 size;
+            __u64 seq;
+
+            record_key(key, shard, id);
+            if (recovery_partition(key, KEY_SIZE, THREADS) != partition)
+                continue;
+            if (btree_get(&btree, key, KEY_SIZE, value, sizeof(value), &size))
+            {
+                ASSERT(!last_seq[shard][id]);
+                continue;
+            }
+            memcpy(&seq, value, sizeof(seq));
+            ASSERT(size == VALUE_SIZE && seq + 1 == last_seq[shard][id]);
+        }
+    }
+
+    buffer_pool_free(&pool);
+    io_uring_queue_exit(&ring);
+    close(fd);
+}
+
+static void trees_unlink(void)
+{
+    char path[64];
+    for (__u32 i = 0; i < THREADS; i++)
+    {
+        snprintf(path, sizeof(path), "%s.%u", TEST_TREE, i);
+        unlink(path);
+    }
+}
+
+int main()
+{
+    unlink(TEST_FILE);
+    trees_unlink();
+
+    int fd = open(TEST_FILE, O_RDWR | O_CREAT, 0644);
+    ASSERT(fd >= 0);
+
+    // a full log, a log torn by the crash and a shard never written
+    __u64 records = shard_write(fd, 0, SHARD_PAGES);
+    records += shard_write(fd, 1, TORN_PAGE);
+
+    struct recovery recovery;
+    memset(&recovery, 0, sizeof(recovery));
+    recovery.fd = fd;
+    recovery.shard_start = shard_start;
+    recovery.threads_len = THREADS;
+    recovery.tree_path = TEST_TREE;
+
+    ASSERT(recovery_run(&recovery) == 0);
+    ASSERT(recovery.pages == SHARD_PAGES + TORN_PAGE);
+    ASSERT(recovery.records == records);
+    ASSERT(recovery.replayed == records);
+    for (__u32 i = 0; i < THREADS; i++)
+    {
+        ASSERT(partition_keys[i]);
+        tree_check(i);
+    }
+
+    // a crash during replay: the log is applied again over the tree and
+    // leaves it as it was
+    ASSERT(recovery_run(&recovery) == 0);
+    ASSERT(recovery.records == records);
+    ASSERT(recovery.replayed == records);
+    for (__u32 i = 0; i < THREADS; i++)
+        tree_check(i);
+
+    close(fd);
+    unlink(TEST_FILE);
+    trees_unlink();
+
+    LOG("TEST (%s): ok records: %llu pages: %llu %.0f MB/s %.0f records/s\n", __FILE__, recovery.records, recovery.pages,
+        (double)recovery.pages * WAL_PAGE_SIZE / BYTE_MB(1) / recovery.elapsed_s, recovery.records / recovery.elapsed_s);
+}
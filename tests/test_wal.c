@@ -0,0 +1,229 @@
+#define ASSERTION
+#define DEBUG
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../src/include/utils.h"
+#include "../src/include/scheduler.h"
+#include "../src/include/wal.h"
+
+#define PAGES (WAL_BUF_PAGES * 4)
+#define APPENDERS (4)
+#define INFLIGHT (32)
+
+struct test_waiter
+{
+    struct wal_waiter inner;
+    __u64 *durable;
+    __u8 done;
+};
+
+struct test_appender
+{
+    pthread_t thread;
+    __u32 idx;
+    __u64 appended;
+    __u64 durable;
+    __u64 seen;
+    struct test_waiter waiters[INFLIGHT];
+};
+
+struct test_record
+{
+    __u32 appender;
+    __u64 seq;
+    __u8 pad[37];
+};
+
+static struct wal wal;
+static struct thread_context ctx;
+static struct test_appender appenders[APPENDERS];
+
+static void durable(struct wal_waiter *base)
+{
+    struct test_waiter *waiter = container_of(base, struct test_waiter, inner);
+    __atomic_add_fetch(waiter->durable, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&waiter->done, 1, __ATOMIC_RELEASE);
+}
+
+static void *appender_main(void *arg)
+{
+    struct test_appender *appender = arg;
+    struct test_record record;
+    memset(&record, 0, sizeof(record));
+    record.appender = appender->idx;
+
+    for (__u32 i = 0; i < INFLIGHT; i++)
+    {
+        appender->waiters[i].inner.callback = durable;
+        appender->waiters[i].durable = &appender->durable;
+        appender->waiters[i].done = 1;
+    }
+
+    for (;;)
+    {
+        struct test_waiter *waiter = &appender->waiters[appender->appended % INFLIGHT];
+        while (!__atomic_load_n(&waiter->done, __ATOMIC_ACQUIRE))
+            sched_yield();
+
+        record.seq = appender->appended;
+        waiter->done = 0;
+        int ret = wal_append(&wal, &record, sizeof(record), &waiter->inner, NULL);
+        if (ret == -EAGAIN)
+        {
+            waiter->done = 1;
+            sched_yield();
+            continue;
+        }
+        if (ret == -ENOSPC)
+        {
+            waiter->done = 1;
+            break;
+        }
+        ASSERT(!ret);
+        appender->appended++;
+    }
+
+    return NULL;
+}
+
+// every record of an appender follows its previous one
+static __u32 page_records_check(void *buf)
+{
+    struct wal_page *page = buf;
+    __u32 records = 0;
+
+    for (__u32 off = sizeof(struct wal_page); off < page->used; records++)
+    {
+        struct wal_record *record = buf + off;
+        struct test_record *data = (struct test_record *)record->data;
+        ASSERT(record->len == sizeof(struct test_record));
+        ASSERT(data->appender < APPENDERS);
+        ASSERT(data->seq == appenders[data->appender].seen);
+        appenders[data->appender].seen++;
+        off += ALIGN(sizeof(*record) + record->len, WAL_RECORD_ALIGN);
+    }
+
+    return records;
+}
+
+static void test_checksum(void)
+{
+    // crc32c check value
+    ASSERT(wal_checksum(0, "123456789", 9) == 0xE3069283);
+    ASSERT(wal_checksum(0, "", 0) == 0);
+    // incremental over split input
+    ASSERT(wal_checksum(wal_checksum(0, "1234", 4), "56789", 5) == 0xE3069283);
+
+    LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
+}
+
+static void test_append(void)
+{
+    __u8 big[WAL_RECORD_MAX + 1];
+    ASSERT(wal_init(&wal, PAGES, 42) == 0);
+    ASSERT(wal_append(&wal, big, sizeof(big), NULL, NULL) == -E2BIG);
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.wal = &wal;
+    ctx.page_start = 0;
+    thread_ctx = &ctx;
+
+    for (__u32 i = 0; i < APPENDERS; i++)
+    {
+        appenders[i].idx = i;
+        ASSERT(pthread_create(&appenders[i].thread, NULL, appender_main, &appenders[i]) == 0);
+    }
+
+    // stand in for the writer job: write complete pages in order, sync them
+    // and seal the open page whenever nothing is ready
+    __u64 records = 0;
+    while (wal.submitted_page < PAGES)
+    {
+        __u32 ready = wal_pages_ready(&wal, 8);
+        if (!ready)
+        {
+            wal_seal(&wal);
+            continue;
+        }
+
+        for (__u32 i = 0; i < ready; i++)
+        {
+            __u64 page_no = wal.submitted_page;
+            struct op_page_write op;
+            op.page_id = page_no;
+            op.user_data = wal_page_submit(&wal, page_no);
+
+            void *buf = wal_page_buf(&wal, page_no);
+            int ret = wal_page_check(wal.epoch, buf, page_no);
+            ASSERT(ret >= 0);
+            ASSERT((__u32)ret == page_records_check(buf));
+            records += ret;
+
+            wal_page_synced(&op);
+            ASSERT(wal.durable_lsn == (page_no + 1) * WAL_PAGE_SIZE);
+            wal_pages_written(&wal, 1);
+        }
+    }
+
+    __u64 appended = 0;
+    for (__u32 i = 0; i < APPENDERS; i++)
+    {
+        pthread_join(appenders[i].thread, NULL);
+        ASSERT(appenders[i].durable == appenders[i].appended);
+        ASSERT(appenders[i].seen == appenders[i].appended);
+        appended += appenders[i].appended;
+    }
+    ASSERT(records == appended);
+    ASSERT(wal.appended == appended);
+    ASSERT(wal_append(&wal, big, 8, NULL, NULL) == -ENOSPC);
+
+    LOG("TEST (%s:%s): ok records: %llu sealed: %llu\n", __FILE__, __FUNCTION__, records, wal.sealed);
+    wal_free(&wal);
+}
+
+static void test_corruption(void)
+{
+    ASSERT(wal_init(&wal, 4, 7) == 0);
+
+    __u64 lsn;
+    ASSERT(wal_append(&wal, "first", 5, NULL, &lsn) == 0);
+    ASSERT(lsn == sizeof(struct wal_page));
+    ASSERT(wal_append(&wal, "second", 6, NULL, &lsn) == 0);
+    ASSERT(wal_pages_ready(&wal, 1) == 0);
+    ASSERT(wal_seal(&wal) == 1);
+    ASSERT(wal_seal(&wal) == 0);
+    ASSERT(wal_pages_ready(&wal, 4) == 1);
+    ASSERT(wal_page_submit(&wal, 0) == NULL);
+
+    __u8 *buf = wal_page_buf(&wal, 0);
+    ASSERT(wal_page_check(wal.epoch, buf, 0) == 2);
+    ASSERT(wal_page_epoch(buf) == 7);
+    // another page number or a previous run
+    ASSERT(wal_page_check(wal.epoch, buf, 1) == -1);
+    wal.epoch++;
+    ASSERT(wal_page_check(wal.epoch, buf, 0) == -1);
+    wal.epoch--;
+
+    // torn record
+    buf[lsn + sizeof(struct wal_record)] ^= 1;
+    ASSERT(wal_page_check(wal.epoch, buf, 0) == -1);
+    buf[lsn + sizeof(struct wal_record)] ^= 1;
+    ASSERT(wal_page_check(wal.epoch, buf, 0) == 2);
+
+    // torn header
+    ((struct wal_page *)buf)->used += WAL_RECORD_ALIGN;
+    ASSERT(wal_page_check(wal.epoch, buf, 0) == -1);
+    ASSERT(wal_page_epoch(buf) == 0);
+
+    wal_free(&wal);
+    LOG("TEST (%s:%s): ok\n", __FILE__, __FUNCTION__);
+}
+
+int main()
+{
+    test_checksum();
+    test_corruption();
+    test_append();
+}